@@ -16,43 +16,127 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE /*!< pthread_setaffinity_np */
 #include <stdlib.h>
 #include <math.h>
 #include <signal.h>
 #include <string.h>
-#include <complex.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <time.h>
 #include <limits.h>
-/*! External libraries */
-#include <fftw3.h>
-#include <rtl-sdr.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "rtlmap.h"
 
-#define NUM_READ 512 
-#define log_info(...) print_log(INFO, __VA_ARGS__)
-#define log_error(...) print_log(ERROR, __VA_ARGS__)
-#define log_fatal(...) print_log(FATAL, __VA_ARGS__)
+#define FILE_BUF_LENGTH (1 << 20) /*!< stdio buffer size of the output file */
+#define RING_SLOTS 16 /*!< Number of USB buffers that the ring can hold */
+#define MAX_DEVICES 16 /*!< Maximum device count for -d */
+#define MAX_PEAKS 256 /*!< Maximum tracked peak count for -P */
+#define MAX_DECIMATION 1024 /*!< Maximum zoom factor for -Z */
+#define SINK_SLOTS 16 /*!< Queued frames of each output (see create_sinks) */
+#define RECORD_SLOTS 64 /*!< Extra ring slots for the disk latency of the recorder (-I) */
 
-static rtlsdr_dev_t *dev; /*!< RTL-SDR device */
-static fftw_plan fftwp; /**!
-			 * FFT plan that will contain 
- 			 * all the data that FFTW needs 
- 			 * to compute the FFT 
- 			 */ 
-static fftw_complex *in, *out; /*!< Input and output arrays of the transform */
-static FILE *gnuplotPipe, *file; /**!
+/**!
+ * 'Scanner' describes the hops of the frequency scanner (-S)
+ * and holds the wideband spectrum that is stitched from them.
+ * Each hop keeps the central bins of its spectrum (see -c) and
+ * the next hop starts right after the last kept bin, so the
+ * wideband spectrum has the same bin width as a single FFT.
+ */
+typedef struct Scanner {
+	int hops, /*!< Hop count of a sweep */
+		keep, /*!< Bins kept from the center of each hop */
+		bin_c, /*!< Bin count of the wideband spectrum (hops * keep) */
+		step, /*!< Frequency distance between hops (Hz) */
+		first_freq, /*!< Center frequency of the first hop (Hz) */
+		settle_len; /*!< Bytes discarded after each retune (see -k) */
+	float *sweep, /*!< Power spectrum of the current sweep */
+		*avg, /*!< Averaged wideband power spectrum (see -a) */
+		*bins; /*!< Output values of the wideband spectrum */
+	long avg_c; /*!< Number of sweeps in 'avg' */
+	struct timespec sweep_start; /*!< Start time of the current sweep */
+	double sweep_ms; /*!< Total duration of the finished sweeps (ms) */
+	int sweep_c; /*!< Finished sweep count */
+	int parts; /*!< Receivers that stitched their hops of the current sweep */
+	pthread_mutex_t lock; /*!< Protects 'parts' and the sweep buffers */
+	pthread_cond_t done; /*!< Signaled after the sweep is created */
+	PeakTracker peaks; /*!< Peaks of the wideband spectrum (-P) */
+	ChangeTrigger change; /*!< Change trigger of the wideband spectrum (-K) */
+	ChannelPlan channels; /*!< Channels of the wideband spectrum (-F) */
+} Scanner;
+static Scanner scanner = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+}; /*!< Frequency scanner state (-S) */
+/**!
+ * 'Receiver' is a RTL-SDR device given with -d and everything
+ * that reads and processes its samples. Each receiver has its own
+ * capture thread (USB), ring buffer, DSP thread and FFT engine, so
+ * devices do not wait for each other. Only the outputs are shared.
+ * (see create_fft)
+ */
+typedef struct Receiver {
+	int id, /*!< Position in the device list (-d) */
+		dev_id; /*!< RTL-SDR device index */
+	rtlsdr_dev_t *dev; /*!< RTL-SDR device */
+	int center_freq, /*!< Center frequency (Hz) */
+		first_hop, /*!< First hop of the sweep read by this device (-S) */
+		hop_c, /*!< Hop count of the sweep read by this device (-S) */
+		frame_c; /*!< Frames created from the samples of this device */
+	uint64_t sample_c; /*!< Samples processed, clock of the replay (-i) */
+	atomic_ulong missed; /*!< Frame deadlines passed without a frame (-r) */
+	FFTEngine engine; /*!< FFT engine of the DSP thread */
+	RingBuffer ring; /*!< Ring between capture and DSP thread */
+	PeakTracker peaks; /*!< Peaks of the spectrum of this device (-P) */
+	ChangeTrigger change; /*!< Change trigger of the spectrum of this device (-K) */
+	ChannelPlan channels; /*!< Channels in the spectrum of this device (-F) */
+	IQRecorder recorder; /*!< Raw I/Q recorder of this device (-I) */
+	char record_file[PATH_MAX]; /*!< File of the recorder */
+	pthread_t capture_thread, /*!< Thread that reads from the device */
+		dsp_thread; /*!< Thread that runs create_fft() */
+	atomic_int stop; /*!< Tells the DSP thread to return */
+} Receiver;
+static Receiver receivers[MAX_DEVICES]; /*!< Devices given with -d */
+static int receiver_c = 0; /*!< Receiver count */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER; /*!< Serializes the outputs of the DSP threads */
+static atomic_int exiting; /*!< Set when a signal or -n/-C ends the read */
+static FILE *gnuplotPipe, *file, *event_file, *strip_file, *hold_file, *persist_file; /**!
 				  * Pipe for communicating with gnuplot
 				  * File to write 
+				  * File to write the peak events (-E)
+				  * Waterfall strip image (-G)
+				  * File to write the hold traces (-A)
+				  * Persistence image (-V)
 				  */
+static Waterfall waterfall; /*!< History of the waterfall graph (-H) */
+static SpectrumServer server; /*!< Spectrum server (-l, -U) */
+static RtlMapMetrics metrics; /*!< Counters and timings of the pipeline (-m, -e) */
+static MetricsServer metrics_server; /*!< HTTP server of the metrics (-e) */
+static pthread_t stats_thread; /*!< Thread that prints the metrics summaries (-m) */
+static atomic_int stats_stop; /*!< Tells the stats thread to return */
+static int use_metrics = 0; /*!< Metrics are recorded (-m or -e) */
+static OutputSink file_sink, /*!< Writer of the output file */
+	strip_sink, /*!< Writer of the strip image (-G) */
+	plot_sink, /*!< Writer of the gnuplot pipe */
+	hold_sink, /*!< Writer of the hold traces (-A) */
+	persist_sink; /*!< Writer of the persistence image (-V) */
+static SpectrumHold hold; /*!< Max/min hold and persistence of the graph spectrum (-A, -V) */
+static float *hold_max, *hold_min, *persist_image; /*!< Values of the hold outputs (see write_holds) */
+static uint64_t hold_freq; /*!< Center frequency of the held spectra */
+static int channel_c = 0; /*!< Channels in the channel plan file (-F) */
+static float *channel_bins, /*!< dB or magnitude values of the channels of a frame */
+	*channel_ids; /*!< Numbers of the channels of a frame (see write_file_frames) */
+static long strip_rows = 0; /*!< Rows written to the strip image */
 static struct sigaction sig_act; /*!< For changing the signal actions */
-static const int n_read = NUM_READ; /*!< Sample count & data points & FFT size */
-static int n, /*!< Used at raw I/Q data to complex conversion */
-	read_count = 0, /*!< Current read count */
-	out_r, out_i, /*!< Real and imaginary parts of FFT *out values */
+static RtlMapConfig config = RTLMAP_DEFAULT_CONFIG; /*!< Pipeline settings from the arguments */
+static int n_read = DEFAULT_FFT_SIZE, /*!< [ARG] Sample count & data points & FFT size (optional) */
+	buf_len; /*!< USB buffer length (bytes), see rtlmap_buffer_length() */
+static int read_count = 0, /*!< Current read count */
 	_center_freq, /*!< [ARG] RTL-SDR center frequency (mandatory) */
-	_dev_id = 0, /*!< [ARG] RTL-SDR device ID (optional) */
-	_samp_rate = NUM_READ * 4000, /*!< [ARG] Sample rate (optional) */
+	_samp_rate = DEFAULT_SAMPLE_RATE, /*!< [ARG] Sample rate (optional) */
 	_gain = 14, /*!< [ARG] Device gain (optional) */
 	_refresh_rate = 500, /*!< [ARG] Refresh interval for continuous read (optional) */
 	_num_read = INT_MAX, /*!< [ARG] Number of reads, set to max val of int (optional) */
@@ -65,87 +149,173 @@ static int n, /*!< Used at raw I/Q data to complex conversion */
 			     * of the ADCs and 1/f noise. (optional)
 			     */
 	_log_colors = 1, /*!< [ARG] Use colored flags while logging (optional) */
-	_write_file = 0; /*!< [ARG] Write output of the FFT to a file|stdout (optional) */
-static float amp, db; /*!< Amplitude & dB */
-static char t_buf[16], /*!< Time buffer, used for getting current time */
-	*_filename, /*!< [ARG] File name to write samples (optional) */
-	*log_levels[] = { 
-		"INFO", "ERROR", "FATAL" /*!< Log levels */
-	},
-	*level_colors[] = {
-		"\x1b[92m", "\x1b[91m", "\x1b[33m" /*!< Log level colors (green, red, yellow) */
-	},
-	*bold_attr = "\x1b[1m", /*!< Enable bold text in terminal */
-	*all_attr_off = "\x1b[0m"; /*!< Clear previous attributes in terminal */
-enum log_level {INFO, ERROR, FATAL}; /*!< Log level enumeration */
-static va_list vargs;  /*!< Holds information about variable arguments */
-static time_t raw_time; /*!< Represents time value */
-/**!
- * 'Bin' is created from 'SampleBin' struct with
- * the purpose of storing sample IDs and values to
- * make data processing operations more easier and faster.
- * Such as classification and sorting.
- *
- * NOTE: This variable is not used properly yet,
- * just copying values and IDs in it for now.
- */
-typedef struct SampleBin { 
-	float val;
-    int id;
-} Bin;
-static Bin sample_bin[NUM_READ]; /*!< 'Bin' array that will contain IDs and values */
+	_realtime = 0, /*!< [ARG] Replay the input file at the sample rate (optional) */
+	_iq_correction = 1, /*!< [ARG] Remove DC offset and I/Q imbalance (optional) */
+	_zoom_offset = 0, /*!< [ARG] Center of the zoomed band from the center frequency (Hz) (optional) */
+	_decimation = 1, /*!< [ARG] Zoom factor, 1 shows the full band (optional) */
+	_wf_rows = 0, /*!< [ARG] Frames in the waterfall graph, 0 for the spectrum graph (optional) */
+	_write_file = 0, /*!< [ARG] Write output of the FFT to a file|stdout (optional) */
+	_binary_file = 0, /*!< [ARG] Write binary spectrum records instead of text (optional) */
+	_overlap = 50, /*!< [ARG] Overlap of Welch segments in percent (optional) */
+	_scan_mode = 0, /*!< [ARG] Frequency scanner mode (optional) */
+	_scan_start, _scan_stop, /*!< [ARG] Scanned frequency range (Hz) (mandatory for -S) */
+	_scan_crop = 25, /*!< [ARG] Percent of each hop's bins that is cropped at the edges (optional) */
+	_settle_samples = 32768, /*!< [ARG] Samples discarded after retuning for PLL settling (optional) */
+	_avg_mode = 0, /*!< [ARG] Averaging across frames (none:0, lin:1, exp:2) (optional) */
+	_peak_count = 0, /*!< [ARG] Tracked peak count, 0 disables peak detection (optional) */
+	_sink_policy = SINK_BLOCK, /*!< [ARG] Policy of the file outputs when they are behind (optional) */
+	_fft_threads = 1, /*!< [ARG] Threads of large FFTs (optional) */
+	_hold_interval = 100, /*!< [ARG] Frames between the hold outputs (optional) */
+	_stats_interval = 0, /*!< [ARG] Seconds between the metrics summaries, 0 disables them (optional) */
+	_window = WINDOW_HANN; /*!< [ARG] Window function of the FFT segments (optional) */
+static float _avg_alpha = 0.1, /*!< [ARG] Exponential averaging factor (optional) */
+	_kaiser_beta = 8.6, /*!< [ARG] Shape parameter of the Kaiser window (optional) */
+	_peak_snr = 10, /*!< [ARG] Minimum peak power above the noise floor (dB) (optional) */
+	_wf_min = 0, _wf_max = 0, /*!< [ARG] Value range of the waterfall colors (optional, default: first frame) */
+	_pre_trigger = 0, _post_trigger = 0, /*!< [ARG] Recorded seconds around a new peak or change (optional, default: all) */
+	_change_on = 0, _change_off = 0; /*!< [ARG] Levels above the baseline for the change trigger (dB) (optional) */
+static unsigned int _fft_flags = FFTW_MEASURE; /*!< [ARG] FFTW planner effort (optional) */
+static char *_filename, /*!< [ARG] File name to write samples (optional) */
+	*_wisdom_file, /*!< [ARG] FFTW wisdom file (optional, default: cache directory) */
+	*_convert_file, /*!< [ARG] Binary spectrum file to convert to text (optional) */
+	*_input_file, /*!< [ARG] Recorded I/Q file to read instead of a device (optional) */
+	*_event_file, /*!< [ARG] File to write the peak events (optional, default: stderr) */
+	*_strip_file, /*!< [ARG] PGM image to write the waterfall rows (optional) */
+	*_hold_file, /*!< [ARG] File to write the max-hold and min-hold traces (optional) */
+	*_persist_file, /*!< [ARG] PGM image to write the persistence (optional) */
+	*_channel_file, /*!< [ARG] Channel plan to write the channel powers (optional) */
+	*_listen_addr, /*!< [ARG] [host:]port of the spectrum server (optional) */
+	*_record_file, /*!< [ARG] File to write the raw I/Q samples (optional) */
+	*_udp_addr, /*!< [ARG] host:port to send the spectrum datagrams (optional) */
+	*_metrics_addr, /*!< [ARG] [host:]port of the HTTP metrics endpoint (optional) */
+	*_dev_ids = "0", /*!< [ARG] Comma separated RTL-SDR device indexes or serials (optional) */
+	*_center_freqs, /*!< [ARG] Comma separated center frequencies, one per device (mandatory) */
+	plot_cmd[128]; /*!< gnuplot command for plotting a frame, see configure_gnuplot() */
 
 /*!
- * Print log message with time, level and text.
- * Also supports format specifiers.
+ * Get the bin count of the graph and the output.
  *
- * \param level logging level (info:0, error:1, fatal:2)
- * \param format string and format specifiers for vfprintf function  
- * \return 0 on success
+ * \return bin count (wideband spectrum in scan mode)
  */
-static int print_log(int level, char *format, ...){
-	raw_time = time(NULL);
-	struct tm *local_time = localtime(&raw_time);
-	t_buf[strftime(t_buf, sizeof(t_buf), 
-			"%H:%M:%S", local_time)] = '\0';
-	if (_log_colors)
-		fprintf(stderr, "%s[%s] %s%s%s ", 
-		bold_attr, 
-		t_buf, 
-		level_colors[level], 
-		log_levels[level], 
-		all_attr_off);
-	else
-		fprintf(stderr, "[%s] %s ", 
-		t_buf, 
-		log_levels[level]);
-  	va_start(vargs, format);
-  	vfprintf(stderr, format, vargs);
-  	va_end(vargs);
-	return 0;
+static int bin_count(){
+	return _scan_mode ? scanner.bin_c : n_read;
+}
+/*!
+ * Get the frequency distance between two bins.
+ * The zoom (-Z) divides the sample rate by the decimation.
+ *
+ * \return bin width (Hz)
+ */
+static double bin_width(){
+	return (double)_samp_rate / _decimation / n_read;
 }
 /*!
- * Cancel asynchronous read operation on the SDR device. 
+ * Cancel asynchronous read operations and close the SDR devices. 
  * Close pipe and file.
  * Exit.
  */
 static void do_exit(){
-	rtlsdr_cancel_async(dev);
+	/**! Metrics read the rings and the sinks, so they are stopped first. */
+	if (_stats_interval) {
+		atomic_store(&stats_stop, 1);
+		pthread_join(stats_thread, NULL);
+	}
+	if (_metrics_addr != NULL)
+		rtlmap_metrics_stop(&metrics_server);
+	for (int i = 0; i < receiver_c; i++) {
+		Receiver *rx = &receivers[i];
+		if (rx->dev)
+			rtlsdr_cancel_async(rx->dev);
+		log_info("USB buffers (#%d): %lu received, %lu overruns, %lu dropped\n",
+			rx->dev_id,
+			atomic_load(&rx->ring.received),
+			atomic_load(&rx->ring.overruns),
+			atomic_load(&rx->ring.dropped));
+		if (_cont_read && !_scan_mode)
+			log_info("Frames (#%d): %d created, %lu deadlines missed\n", 
+				rx->dev_id, rx->frame_c, atomic_load(&rx->missed));
+		IQCorrection *corr = &rx->engine.corr;
+		if (rx->engine.correct && corr->ii > 0)
+			log_info("I/Q correction (#%d): DC %.3f/%.3f, gain %.4f, phase %.3f deg\n",
+				rx->dev_id, corr->dc_i, corr->dc_q, corr->gain, 
+				asin(fmax(-1, fmin(1, corr->iq / sqrt(corr->ii * corr->qq)))) * 180 / M_PI);
+		if (rx->dev)
+			rtlsdr_close(rx->dev);
+		rtlmap_recorder_stop(&rx->recorder);
+		rtlmap_engine_destroy(&rx->engine);
+		rtlmap_ring_free(&rx->ring);
+		rtlmap_peaks_destroy(&rx->peaks);
+		if (rx->change.frame_c)
+			log_info("Change trigger (#%d): %ld of %ld frames sent\n", 
+				rx->dev_id, rx->change.active_c, rx->change.frame_c);
+		rtlmap_change_destroy(&rx->change);
+	}
+	if (scanner.sweep_c)
+		log_info("%d sweep(s), %.1f ms per sweep (%.1f ms/GHz)\n", scanner.sweep_c,
+			scanner.sweep_ms / scanner.sweep_c, scanner.sweep_ms / scanner.sweep_c / 
+			((double)scanner.hops * scanner.step / 1e9));
+	rtlmap_peaks_destroy(&scanner.peaks);
+	if (scanner.change.frame_c)
+		log_info("Change trigger: %ld of %ld sweeps sent\n", 
+			scanner.change.active_c, scanner.change.frame_c);
+	rtlmap_change_destroy(&scanner.change);
+	/**! Queued frames are written before the outputs are closed. */
+	rtlmap_sink_destroy(&plot_sink);
+	rtlmap_sink_destroy(&file_sink);
+	rtlmap_sink_destroy(&strip_sink);
+	rtlmap_sink_destroy(&hold_sink);
+	rtlmap_sink_destroy(&persist_sink);
+	rtlmap_waterfall_destroy(&waterfall);
+	rtlmap_hold_destroy(&hold);
+	free(hold_max);
+	free(hold_min);
+	free(persist_image);
+	for (int i = 0; i < receiver_c; i++)
+		rtlmap_channels_destroy(&receivers[i].channels);
+	rtlmap_channels_destroy(&scanner.channels);
+	free(channel_bins);
+	free(channel_ids);
+	/**! Server is zeroed if it is not started, (fd 0) so it is only stopped when used. */
+	if (_listen_addr != NULL || _udp_addr != NULL)
+		rtlmap_server_stop(&server);
+	if (use_metrics)
+		rtlmap_metrics_destroy(&metrics);
+	free(scanner.sweep);
+	free(scanner.avg);
+	free(scanner.bins);
+	if(_use_gnuplot && _wf_rows)
+		fputs("unset multiplot\n", gnuplotPipe);
 	if(_use_gnuplot)
 		pclose(gnuplotPipe);
 	if(_filename != NULL && strcmp(_filename, "-"))
 		fclose(file);
+	if(event_file != NULL && event_file != stderr && event_file != stdout)
+		fclose(event_file);
+	/**! Height of the strip image is known at the end. */
+	if(strip_file != NULL) {
+		fseek(strip_file, 0, SEEK_SET);
+		rtlmap_write_pgm_header(strip_file, bin_count(), strip_rows);
+		fclose(strip_file);
+		log_info("Wrote %ld waterfall rows to %s\n", strip_rows, _strip_file);
+	}
+	if(hold_file != NULL && hold_file != stdout)
+		fclose(hold_file);
+	if(persist_file != NULL)
+		fclose(persist_file);
 	exit(0);
 }
 /*!
  * Callback for sigaction struct (sig_act).
  * Referenced at register_signals() function.
+ * Stops the asynchronous read, main() does the cleanup.
  *
  * \param signum Incoming signal number from os
  */
 static void sig_handler(int signum){
     log_info("Signal caught, exiting...\n");
-	do_exit();
+	atomic_store(&exiting, 1);
+	for (int i = 0; i < receiver_c; i++)
+		rtlsdr_cancel_async(receivers[i].dev);
 }
 /*!
  * Set signals and assign them a handler
@@ -175,6 +345,7 @@ static int register_signals(){
  * \return 0 on success
  */
 static int gnuplot_exec(char *format, ...){
+	va_list vargs;
 	va_start(vargs, format);
   	vfprintf(gnuplotPipe, format, vargs);
   	va_end(vargs);
@@ -199,100 +370,101 @@ static int configure_gnuplot(){
 	}
 	gnuplot_exec("set title 'rtl-map' enhanced\n");
 	gnuplot_exec("set xlabel 'Frequency (MHz)'\n");
-	gnuplot_exec("set ylabel 'Amplitude (dB)'\n");
+	gnuplot_exec(_mag_graph ? "set ylabel 'Magnitude'\n" : "set ylabel 'Amplitude (dB)'\n");
 	/**!
 	* Compute center frequency in MHz. [Center freq./10^6]
-	* Step size = [(512*10^3)/10^6] = 0.512
-	* Substract and add step size to center frequency for
-	* finding max and min distance from center frequency.
-	*
-	* NOTE: I don't know if this is the right way determine the min/max points.
-	* TODO #4: Check correctness of this calculation.
+	* The graph shows the sampled bandwidth, so the first and last
+	* bins are half of the sample rate away from the center frequency.
+	* Step size = [(2048000/2)/10^6] = 1.024 (default sample rate)
+	* Center frequency is at bin (FFT size / 2). (see process_samples)
+	* gnuplot numbers the points of binary arrays from 0.
+	* In scan mode, the graph shows the wideband spectrum of the
+	* scanned range. (see configure_scanner)
 	*/
-	float center_mhz = _center_freq / pow(10, 6);
-	float step_size = (n_read * pow(10, 3))  / pow(10, 6);
-	gnuplot_exec("set xtics ('%.1f' 1, '%.1f' 256, '%.1f' 512)\n", 
+	int bin_c = bin_count();
+	float center_mhz = (_center_freq + _zoom_offset) / pow(10, 6);
+	float step_size = (bin_c * bin_width() / 2.0) / pow(10, 6);
+	gnuplot_exec("set xrange [0:%d]\n", bin_c - 1);
+	gnuplot_exec("set xtics ('%.3f' 0, '%.3f' %d, '%.3f' %d)\n", 
 		center_mhz-step_size, 
-		center_mhz, 
-		center_mhz+step_size);
+		center_mhz, bin_c / 2,
+		center_mhz+step_size, bin_c - 1);
+	/**!
+	 * Frames are sent as inline binary data, 'bin_c' float values
+	 * follow the plot command. (see create_fft)
+	 * Peaks (-P) are added to the command as a second data set.
+	 */
+	snprintf(plot_cmd, sizeof(plot_cmd), "plot '-' binary array=(%d) "
+		"format='%%float' with lines lt -1 notitle", bin_c);
+	/**! Waterfall rows are drawn into their slots over the previous rows. (see add_waterfall_row) */
+	if (_wf_rows) {
+		gnuplot_exec("set ylabel 'Frame'\n");
+		gnuplot_exec("set cblabel '%s'\n", _mag_graph ? "Magnitude" : "Amplitude (dB)");
+		gnuplot_exec("set yrange [-0.5:%f]\n", _wf_rows - 0.5);
+		if (_wf_min < _wf_max)
+			gnuplot_exec("set cbrange [%f:%f]\n", _wf_min, _wf_max);
+		gnuplot_exec("set multiplot\n");
+	}
 	return 0;
 }
 /*!
- * Configure RTL-SDR device according to given optarg parameters.
- * Exits on failure at finding device from ID or
- * opening the device with given ID.
+ * Create the receivers from the device list (-d) and
+ * center frequencies (-f). A device is given with its index
+ * or serial number, devices without a frequency use the first one.
+ * In scan mode, the hops of a sweep are split between the devices.
+ * Exits on unknown device or too many devices.
  *
- * \return 0 on success
- * \return 1 on buffer reset error
+ * \param device_count device count (see rtlmap_list_devices)
+ * \return receiver count
  */
-static int configure_rtlsdr(){
-	int device_count = rtlsdr_get_device_count();
-	if (!device_count) {
-		log_error("No supported devices found.\n");
-		exit(1);
+static int create_receivers(int device_count){
+	char *ids = strdup(_dev_ids), *id, *save_id, 
+		*freqs = _center_freqs ? strdup(_center_freqs) : NULL, *save_freq = NULL,
+		*freq = freqs ? strtok_r(freqs, ",", &save_freq) : NULL;
+	for (id = strtok_r(ids, ",", &save_id); id; id = strtok_r(NULL, ",", &save_id)) {
+		if (receiver_c == MAX_DEVICES) {
+			log_fatal("Too many devices, at most %d can be used.\n", MAX_DEVICES);
+			exit(1);
+		}
+		char *end;
+		long index = strtol(id, &end, 10);
+		/**! Serial numbers may also be all digits, indexes are tried first. */
+		if (*end != '\0' || index < 0 || index >= device_count)
+			index = rtlsdr_get_index_by_serial(id);
+		if (index < 0) {
+			log_fatal("Failed to find RTL-SDR device '%s'\n", id);
+			exit(1);
+		}
+		Receiver *rx = &receivers[receiver_c];
+		rx->id = receiver_c++;
+		rx->dev_id = (int)index;
+		rx->center_freq = freq ? (int)rtlmap_parse_freq(freq, &end) : _center_freq;
+		if (freq)
+			freq = strtok_r(NULL, ",", &save_freq);
 	}
-	log_info("Starting rtl_map ~\n");
-	log_info("Found %d device(s):\n", device_count);
-	for(int i = 0; i < device_count; i++){
-		if(_log_colors)
-			log_info("#%d: %s%s%s\n", n, bold_attr, rtlsdr_get_device_name(i), all_attr_off);
-		else
-			log_info("#%d: %s\n", n, rtlsdr_get_device_name(i));
+	free(ids);
+	free(freqs);
+	if (!receiver_c) {
+		log_fatal("No device given.\n");
+		exit(1);
 	}
-	int dev_open = rtlsdr_open(&dev, _dev_id);
-	if (dev_open < 0) {
-		log_fatal("Failed to open RTL-SDR device #%d\n", _dev_id);
+	if (_scan_mode && scanner.hops < receiver_c) {
+		log_fatal("Scan range has %d hop(s), less than the device count.\n", scanner.hops);
 		exit(1);
-	}else{
-		log_info("Using device: #%d\n", dev_open);
 	}
-	/**!
-	 * Set gain mode auto if '_gain' equals to 0.
- 	 * Otherwise, set gain mode to manual.
-	 * (Mode 1 [manual] needs gain value so 
-	 * gain setter function must be called.)
- 	 */
-	if(!_gain){
-		rtlsdr_set_tuner_gain_mode(dev, _gain);
-		log_info("Gain mode set to auto.\n");
-	}else{
-		rtlsdr_set_tuner_gain_mode(dev, 1);
-		int gain_count = rtlsdr_get_tuner_gains(dev, NULL);
-		log_info("Supported gain values (%d): ", gain_count);
-		int gains[gain_count], supported_gains = rtlsdr_get_tuner_gains(dev, gains);
-		for (int i = 0; i < supported_gains; i++){
-			/**!
-			 * Different RTL-SDR devices have different supported gain
-			 * values. So select gain value between 1.0 and 3.0
-			 */
-			if (gains[i] > 10 && gains[i] < 30)
-				_gain = gains[i];
-			fprintf(stderr, "%.1f ", gains[i] / 10.0);
-		}
-		fprintf(stderr, "\n");
-		log_info("Gain set to %.1f\n", _gain / 10.0);
-		rtlsdr_set_tuner_gain(dev, _gain);
+	/**! Contiguous hop ranges, the first receivers get the remainder. */
+	for (int i = 0, first_hop = 0; _scan_mode && i < receiver_c; i++) {
+		receivers[i].first_hop = first_hop;
+		receivers[i].hop_c = scanner.hops / receiver_c + (i < scanner.hops % receiver_c);
+		first_hop += receivers[i].hop_c;
 	}
-	/**! 
-	 * Enable or disable offset tuning for zero-IF tuners, which allows to avoid
- 	 * problems caused by the DC offset of the ADCs and 1/f noise.
- 	 */
-	rtlsdr_set_offset_tuning(dev, _offset_tuning);
-	rtlsdr_set_center_freq(dev, _center_freq);
-	rtlsdr_set_sample_rate(dev, _samp_rate);
-	log_info("Center frequency set to %d Hz.\n", _center_freq);
-	log_info("Sampling at %d S/s\n", _samp_rate);
-	int r = rtlsdr_reset_buffer(dev);
-	if (r < 0){
-		log_fatal("Failed to reset buffers.\n");
-		return 1;
-	}
-	return 0;
+	return receiver_c;
 }
 /*!
  * Open file with given _filename parameter.
  * Set 'stdout' output if _filename is given as single dash.
  * Exits on failure in opening the file.
+ * Writes the header if binary output (-B) is selected.
  *
  * NOTE: This block is seperated from parse_args() function
  * due to some bugs. (About pipe open synchronization I think)
@@ -307,194 +479,830 @@ static int open_file(){
 		if(!strcmp(_filename, "-")) {
         	file = stdout;
 		} else {
-			file = fopen(_filename, "w+");
+			file = fopen(_filename, _binary_file ? "wb" : "w+");
 			if (!file) {
 				log_error("Failed to open %s\n", _filename);
 				exit(1);
 			}
    		}
+		setvbuf(file, NULL, _IOFBF, FILE_BUF_LENGTH);
+		if (_binary_file && channel_c) {
+			SpectrumHeader header;
+			rtlmap_fill_spectrum_header(&header, &config, _center_freq);
+			header.flags |= SPECTRUM_CHANNELS;
+			fwrite(&header, sizeof(header), 1, file);
+		} else if (_binary_file)
+			rtlmap_write_spectrum_header(file, &config, _center_freq);
 	}
 	return 0;
 }
 /*!
- * Compare two float samples for qsort function.
+ * Load the channel plan (-F) and map its channels to the bins
+ * of the spectrum of every device. (or the wideband spectrum)
+ * Each device measures the channels that are in its spectrum.
+ * Must be called after the FFT engines are created. (ENBW)
+ * Exits on invalid channel plan, a channel outside the spectrum
+ * of every device or failure at allocating memory.
  *
- * \param a first sample
- * \param b second sample
- * \return value for comparing
+ * \return 0 on success
  */
-static int cmp_sample(const void * a, const void * b){
-  float fa = *(const float*) a;
-  float fb = *(const float*) b;
-  return (fa > fb) - (fa < fb);
+static int load_channels(){
+	if (_channel_file == NULL)
+		return 0;
+	int plan_c = _scan_mode ? 1 : receiver_c;
+	char covered[MAX_CHANNELS] = {0};
+	for (int i = 0; i < plan_c; i++) {
+		ChannelPlan *plan = _scan_mode ? &scanner.channels : &receivers[i].channels;
+		double center_freq = _scan_mode ? _center_freq : receivers[i].center_freq + _zoom_offset;
+		if (rtlmap_channels_load(plan, _channel_file))
+			exit(1);
+		channel_c = plan->channel_c;
+		if (rtlmap_channels_map(plan, bin_count(), center_freq, bin_width(), 
+				receivers[0].engine.enbw))
+			exit(1);
+		for (int c = 0; c < plan->channel_c; c++) {
+			covered[plan->index[c] - 1] = 1;
+			log_info("Channel %d (#%d): %.0f Hz, %.0f Hz wide, bins %.1f-%.1f %s\n", 
+				plan->index[c], _scan_mode ? receivers[0].dev_id : receivers[i].dev_id, 
+				plan->center[c], plan->bandwidth[c], plan->lo[c] - 0.5, plan->hi[c] - 0.5, 
+				plan->names[c]);
+		}
+	}
+	for (int c = 0; c < channel_c; c++)
+		if (!covered[c]) {
+			log_fatal("Channel %d of %s is outside the spectrum of every device.\n", 
+				c + 1, _channel_file);
+			exit(1);
+		}
+	channel_bins = malloc(sizeof(float) * channel_c);
+	channel_ids = malloc(sizeof(float) * channel_c);
+	if (!channel_bins || !channel_ids) {
+		log_fatal("Failed to allocate channel powers.\n");
+		exit(1);
+	}
+	return 0;
 }
 /*!
- * Create FFT graph from raw I/Q samples read from RTL-SDR.
- * Uses gnuplot for creating graph. (optional, see -D arg.)
- * Uses fftw3 library for FFT's computations.
+ * Open the waterfall strip image. (-G)
+ * The header is written again with the row count at exit,
+ * so the image must be a regular file.
+ * Exits on failure at opening the file.
  *
- * \param sample_c sample count, also used for FFT size
- * \param buf array that contains I/Q samples
+ * \return 0 on success
  */
-static void create_fft(int sample_c, uint8_t *buf){
-	/**! 
-	 * Configure FFTW to convert the samples in time domain to frequency domain. 
-	 * Allocate memory for 'in' and 'out' arrays.
-	 * fftw_complex type is a basically double[2] that composed of the 
-	 * real (in[i][0]) and imaginary (in[i][1]) parts of a complex number.
-	 * in -> Complex numbers processed from 8-bit I/Q values.
-	 * out -> Output of FFT (computed from complex input).
-	 */
-	in = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*sample_c);
-	out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*sample_c);
-	/**!
-	 * Declare FFTW plan which is responsible for having in and out data.
-	 * First parameter (sample_c) -> FFT size 
-	 * FFTW_FORWARD/FFTW_BACKWARD -> Indicates the direction of the transform.
-	 * Technically, sign of the exponent in the transform.
-	 * FFTW_MEASURE/FFTW_ESTIMATE
-	 * Use FFTW_MEASURE if you want to execute several FFTs and find the 
-	 * best computation in certain amount of time. (Usually a few seconds)
-	 * FFTW_ESTIMATE is the contrary. Does not run any computation, just
-	 * builds a reasonable plan.
-	 * If you are dealing with many transforms of the same FFT size and
-	 * initialization time is not important, use FFT_MEASURE. 
-	 */
-	fftwp = fftw_plan_dft_1d(sample_c, in, out, FFTW_FORWARD, FFTW_MEASURE);
-	/**!
-	 * Convert buffer from IQ to complex ready for FFTW.
-	 * RTL-SDR outputs 'IQIQIQ...' so we have to read two samples 
-	 * at the same time. 'n' is declared for this approach.
-	 * Sample is 127 for zero signal, so substract ~127.34 for exact value.
-	 * Loop through samples and fill 'in' array with complex samples.
-	 * 
-	 * NOTE: There is a common issue with cheap RTL-SDR receivers which
-	 * is 'center frequency spike' / 'central peak' problem related to 
-	 * I/Q imbalance. This problem can be solved with a implementation of 
-	 * some algorithms.
-	 * More detail: 
-	 * https://github.com/roger-/pyrtlsdr/issues/94
-	 * https://wiki.analog.com/resources/eval/user-guides/ad-fmcomms1-ebz/iq_correction
-	 *
-	 * TODO #1: Implement I/Q correction
-	 */
-	n = 0;
-	for (int i=0; i<sample_c; i+=2){
-		in[i] = (buf[n]-127.34) + (buf[n+1]-127.34) * I;
-		n++;
+static int open_strip_file(){
+	if (_strip_file == NULL)
+		return 0;
+	if (!strcmp(_strip_file, "-") || !(strip_file = fopen(_strip_file, "wb"))) {
+		log_error("Failed to open %s (waterfall image must be a file)\n", _strip_file);
+		exit(1);
 	}
-	/**! 
-	 * Convert the complex samples to complex frequency domain.
-	 * Compute FFT.
-	 */
-	fftw_execute(fftwp);
+	setvbuf(strip_file, NULL, _IOFBF, FILE_BUF_LENGTH);
+	rtlmap_write_pgm_header(strip_file, bin_count(), 0);
+	return 0;
+}
+/*!
+ * Set the color range of the waterfall (-H, -G) from the first frame,
+ * if it is not given with -L.
+ *
+ * \param bins values of the frame
+ * \param bin_c bin count
+ */
+static void set_waterfall_range(float *bins, int bin_c){
+	_wf_min = _wf_max = bins[0];
+	for (int i = 1; i < bin_c; i++) {
+		if (bins[i] < _wf_min)
+			_wf_min = bins[i];
+		if (bins[i] > _wf_max)
+			_wf_max = bins[i];
+	}
+	if (_wf_max <= _wf_min)
+		_wf_max = _wf_min + 1;
+}
+/*!
+ * Write the frames to the output file. (writer thread of file_sink)
+ * Text lines or binary records are collected in the stdio buffer
+ * and the batch is flushed at once.
+ *
+ * \param ctx unused
+ * \param frames queued frames, oldest first
+ * \param frame_c frame count
+ */
+static void write_file_frames(void *ctx, SinkFrame **frames, int frame_c){
+	for (int f = 0; f < frame_c; f++) {
+		SinkFrame *frame = frames[f];
+		if (_binary_file)
+			rtlmap_write_spectrum_record(file, frame->bins, frame->bin_c, 
+				frame->center_freq, frame->timestamp_ns);
+		else
+			for (int i = 0; i < frame->bin_c; i++)
+				fprintf(file, "%d	%f\n", frame->extra_c ? (int)frame->extra[i] : i+1, 
+					frame->bins[i]);
+	}
+	fflush(file);
+}
+/*!
+ * Write the frames as rows of the strip image. (writer thread of strip_sink)
+ *
+ * \param ctx unused
+ * \param frames queued frames, oldest first
+ * \param frame_c frame count
+ */
+static void write_strip_rows(void *ctx, SinkFrame **frames, int frame_c){
+	for (int f = 0; f < frame_c; f++)
+		rtlmap_write_pgm_row(strip_file, frames[f]->bins, frames[f]->bin_c, _wf_min, _wf_max);
+	strip_rows += frame_c;
+	fflush(strip_file);
+}
+/*!
+ * Open the file of the hold traces (-A, text or binary like the
+ * output file) and the persistence image. (-V) The image is
+ * rewritten in place, so it must be a regular file.
+ * Allocates the holds of the graph spectrum.
+ * Exits on failure at opening the files or allocating memory.
+ *
+ * \return 0 on success
+ */
+static int open_hold_files(){
+	if (_hold_file == NULL && _persist_file == NULL)
+		return 0;
+	int bin_c = bin_count();
+	if (rtlmap_hold_create(&hold, bin_c, _persist_file != NULL))
+		exit(1);
+	hold_max = malloc(sizeof(float) * bin_c);
+	hold_min = malloc(sizeof(float) * bin_c);
+	persist_image = malloc(sizeof(float) * (size_t)(hold.cols * hold.levels + 1));
+	if (!hold_max || !hold_min || !persist_image) {
+		log_fatal("Failed to allocate the hold outputs.\n");
+		exit(1);
+	}
+	if (_hold_file != NULL) {
+		hold_file = !strcmp(_hold_file, "-") ? stdout : fopen(_hold_file, _binary_file ? "wb" : "w");
+		if (!hold_file) {
+			log_error("Failed to open %s\n", _hold_file);
+			exit(1);
+		}
+		setvbuf(hold_file, NULL, _IOFBF, FILE_BUF_LENGTH);
+		if (_binary_file)
+			rtlmap_write_spectrum_header(hold_file, &config, _center_freq);
+	}
+	if (_persist_file != NULL && 
+		(!strcmp(_persist_file, "-") || !(persist_file = fopen(_persist_file, "wb")))) {
+		log_error("Failed to open %s (persistence image must be a file)\n", _persist_file);
+		exit(1);
+	}
+	return 0;
+}
+/*!
+ * Write the hold traces. (writer thread of hold_sink)
+ * Binary files get a max-hold and a min-hold record per output,
+ * text files get 'bin  max  min' lines.
+ *
+ * \param ctx unused
+ * \param frames queued frames (max-hold values, min-hold values as extra)
+ * \param frame_c frame count
+ */
+static void write_hold_frames(void *ctx, SinkFrame **frames, int frame_c){
+	for (int f = 0; f < frame_c; f++) {
+		SinkFrame *frame = frames[f];
+		if (_binary_file) {
+			rtlmap_write_spectrum_record(hold_file, frame->bins, frame->bin_c, 
+				frame->center_freq, frame->timestamp_ns);
+			rtlmap_write_spectrum_record(hold_file, frame->extra, frame->extra_c, 
+				frame->center_freq, frame->timestamp_ns);
+		} else
+			for (int i = 0; i < frame->bin_c; i++)
+				fprintf(hold_file, "%d	%f	%f\n", i+1, frame->bins[i], frame->extra[i]);
+	}
+	fflush(hold_file);
+}
+/*!
+ * Rewrite the persistence image. (writer thread of persist_sink)
+ * Only the newest image of the batch is written.
+ *
+ * \param ctx unused
+ * \param frames queued frames (image values, see rtlmap_hold_image)
+ * \param frame_c frame count
+ */
+static void write_persistence(void *ctx, SinkFrame **frames, int frame_c){
+	SinkFrame *frame = frames[frame_c - 1];
+	fseek(persist_file, 0, SEEK_SET);
+	rtlmap_write_pgm_header(persist_file, hold.cols, hold.levels);
+	for (int row = 0; row < hold.levels; row++)
+		rtlmap_write_pgm_row(persist_file, frame->bins + (size_t)row * hold.cols, hold.cols, 0, 1);
+	fflush(persist_file);
+}
+/*!
+ * Give the holds to their outputs. (every -q frames and at exit)
+ * Values are computed here and copied into the queues, the
+ * holds keep updating while the files are written.
+ */
+static void write_holds(){
+	if (hold_sink.running) {
+		rtlmap_hold_traces(&hold, hold_max, hold_min, _mag_graph);
+		rtlmap_sink_push(&hold_sink, hold_max, hold.bin_c, hold_freq, hold_min, hold.bin_c);
+	}
+	if (persist_sink.running) {
+		rtlmap_hold_image(&hold, persist_image);
+		rtlmap_sink_push(&persist_sink, persist_image, hold.cols * hold.levels, hold_freq, NULL, 0);
+	}
+}
+/*!
+ * Add a frame to the waterfall graph. (-H)
+ * gnuplot only gets the new row, which is drawn into its slot over
+ * the previous frames. (multiplot) When the history wraps around,
+ * the multiplot is restarted with the whole history as one image,
+ * so gnuplot does not keep every row that it has received.
+ * Colors have a fixed range (-L), the first frame sets it if not given.
+ *
+ * \param bins values of the frame
+ * \param bin_c bin count
+ */
+static void add_waterfall_row(float *bins, int bin_c){
+	if (!waterfall.row_c)
+		gnuplot_exec("set cbrange [%f:%f]\n", _wf_min, _wf_max);
+	float *row = rtlmap_waterfall_push(&waterfall, bins);
+	int slot = (row - waterfall.data) / bin_c;
+	if (slot == 0 && waterfall.row_c > 1) {
+		gnuplot_exec("unset multiplot\nset multiplot\n");
+		fprintf(gnuplotPipe, "plot '-' binary array=(%d,%d) format='%%float' "
+			"with image notitle\n", bin_c, _wf_rows);
+		fwrite(waterfall.data, sizeof(float), (size_t)bin_c * _wf_rows, gnuplotPipe);
+	} else {
+		fprintf(gnuplotPipe, "plot '-' binary array=(%d,1) format='%%float' "
+			"origin=(0,%d) with image notitle\n", bin_c, slot);
+		fwrite(row, sizeof(float), bin_c, gnuplotPipe);
+	}
+}
+/*!
+ * Send the frames to gnuplot. (writer thread of plot_sink)
+ * Every frame is a row of the waterfall, but the spectrum graph
+ * only shows the newest frame of the batch, the older ones would
+ * be overdrawn right away.
+ * Sends all points with a single write in binary. (no 'e' command)
+ * Have to flush the output buffer for [read -> graph] persistence.
+ * Peaks are shown as red points. [bin, value] (extra values)
+ *
+ * \param ctx unused
+ * \param frames queued frames, oldest first
+ * \param frame_c frame count
+ */
+static void write_plot_frames(void *ctx, SinkFrame **frames, int frame_c){
+	if (_wf_rows) {
+		for (int f = 0; f < frame_c; f++)
+			add_waterfall_row(frames[f]->bins, frames[f]->bin_c);
+	} else {
+		SinkFrame *frame = frames[frame_c - 1];
+		int peak_c = frame->extra_c / 2;
+		if (peak_c)
+			fprintf(gnuplotPipe, "%s, '-' binary record=(%d) format='%%float%%float' "
+				"using 1:2 with points pt 7 lc rgb 'red' notitle\n", plot_cmd, peak_c);
+		else
+			fprintf(gnuplotPipe, "%s\n", plot_cmd);
+		fwrite(frame->bins, sizeof(float), frame->bin_c, gnuplotPipe);
+		fwrite(frame->extra, sizeof(float), frame->extra_c, gnuplotPipe);
+	}
+	fflush(gnuplotPipe);
+}
+/*!
+ * Start the writer threads of the outputs.
+ * gnuplot only shows the current frame, so its frames are dropped
+ * when it is slow. Files block the DSP threads by default (-Y).
+ * Exits on failure at creating the sinks.
+ *
+ * \return 0 on success
+ */
+static int create_sinks(){
+	int bin_c = bin_count();
+	if ((_write_file && rtlmap_sink_create(&file_sink, "file", SINK_SLOTS, 
+			channel_c ? channel_c : bin_c, channel_c, 
+			_sink_policy, write_file_frames, NULL)) ||
+		(strip_file != NULL && rtlmap_sink_create(&strip_sink, "strip image", SINK_SLOTS, 
+			bin_c, 0, _sink_policy, write_strip_rows, NULL)) ||
+		(_use_gnuplot && rtlmap_sink_create(&plot_sink, "gnuplot", SINK_SLOTS, bin_c, 
+			2 * MAX_PEAKS, SINK_DROP_OLDEST, write_plot_frames, NULL)) ||
+		(hold_file != NULL && rtlmap_sink_create(&hold_sink, "hold traces", SINK_SLOTS, 
+			bin_c, bin_c, _sink_policy, write_hold_frames, NULL)) ||
+		(persist_file != NULL && rtlmap_sink_create(&persist_sink, "persistence image", 2, 
+			hold.cols * hold.levels, 0, SINK_DROP_OLDEST, write_persistence, NULL)))
+		exit(1);
+	/**! Frames are pushed after this, so the writer threads see the pointer with the first frame. */
+	if (use_metrics)
+		file_sink.metrics = strip_sink.metrics = plot_sink.metrics = 
+			hold_sink.metrics = persist_sink.metrics = &metrics;
+	return 0;
+}
+/*!
+ * Add the queue depth and the dropped frames of an output sink.
+ *
+ * \param sink output sink (not created if it is not running)
+ * \param depth queued frame count
+ * \param dropped dropped frame count
+ */
+static void add_sink_stats(OutputSink *sink, int *depth, unsigned long *dropped){
+	if (!sink->running)
+		return;
+	pthread_mutex_lock(&sink->lock);
+	*depth += sink->count;
+	*dropped += sink->dropped;
+	pthread_mutex_unlock(&sink->lock);
+}
+/*!
+ * Fill the gauges of the metrics from the rings and the sinks.
+ * Called by the metrics before they are read. (see RtlMapMetrics)
+ *
+ * \param m metrics
+ */
+static void update_metrics(RtlMapMetrics *m){
+	m->buffers = m->overruns = m->dropped = m->missed = m->sink_dropped = 0;
+	m->ring_depth = m->ring_slots = m->sink_depth = 0;
+	for (int i = 0; i < receiver_c; i++) {
+		RingBuffer *ring = &receivers[i].ring;
+		m->buffers += atomic_load_explicit(&ring->received, memory_order_relaxed);
+		m->overruns += atomic_load_explicit(&ring->overruns, memory_order_relaxed);
+		m->dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		m->missed += atomic_load_explicit(&receivers[i].missed, memory_order_relaxed);
+		m->ring_depth += atomic_load_explicit(&ring->head, memory_order_relaxed) -
+			atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		m->ring_slots += ring->slots;
+	}
+	add_sink_stats(&file_sink, &m->sink_depth, &m->sink_dropped);
+	add_sink_stats(&strip_sink, &m->sink_depth, &m->sink_dropped);
+	add_sink_stats(&plot_sink, &m->sink_depth, &m->sink_dropped);
+	add_sink_stats(&hold_sink, &m->sink_depth, &m->sink_dropped);
+	add_sink_stats(&persist_sink, &m->sink_depth, &m->sink_dropped);
+}
+/*!
+ * Thread that prints a summary of the metrics every -m seconds.
+ * (rates, mean/p99 timings and queue depths since the last summary)
+ *
+ * \param arg unused
+ * \return NULL
+ */
+static void *stats_worker(void *arg){
+	MetricsSnapshot prev = {0};
+	char line[512];
+	while (!atomic_load(&stats_stop)) {
+		/**! Short sleeps, so the thread is joined without waiting for the interval. */
+		for (int i = 0; i < _stats_interval * 10 && !atomic_load(&stats_stop); i++)
+			usleep(100000);
+		if (atomic_load(&stats_stop))
+			break;
+		rtlmap_metrics_summary(&metrics, &prev, line, sizeof(line));
+		log_info("Stats: %s\n", line);
+	}
+	return NULL;
+}
+/*!
+ * Start recording the metrics, the summary thread (-m) and the
+ * HTTP endpoint. (-e) Exits on failure.
+ *
+ * \return 0 on success
+ */
+static int start_metrics(){
+	if (!use_metrics)
+		return 0;
+	metrics.update = update_metrics;
+	if (_metrics_addr != NULL && rtlmap_metrics_serve(&metrics_server, _metrics_addr, &metrics))
+		exit(1);
+	if (_stats_interval && pthread_create(&stats_thread, NULL, stats_worker, NULL)) {
+		log_fatal("Failed to create stats thread.\n");
+		exit(1);
+	}
+	return 0;
+}
+/*!
+ * Open the file for the peak events. (-E, stderr by default)
+ * Exits on failure at opening the file.
+ *
+ * \return 0 on success
+ */
+static int open_event_file(){
+	if (!_peak_count)
+		return 0;
+	if (_event_file == NULL)
+		event_file = stderr;
+	else if (!strcmp(_event_file, "-"))
+		event_file = stdout;
+	else if (!(event_file = fopen(_event_file, "w"))) {
+		log_error("Failed to open %s\n", _event_file);
+		exit(1);
+	}
+	return 0;
+}
+/*!
+ * Write the events of the peak tracker. (see -E)
+ * [timestamp (ms)	+|-	id	frequency (Hz)	power (dB)	SNR (dB)]
+ *
+ * \param peaks peak tracker
+ * \param center_freq center frequency of the spectrum
+ */
+static void write_peak_events(PeakTracker *peaks, int center_freq){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	double bin_hz = bin_width();
+	for (int i = 0; i < peaks->event_c; i++) {
+		PeakEvent *event = &peaks->events[i];
+		fprintf(event_file, "%lld\t%c\t%d\t%.0f\t%.2f\t%.2f\n", ms,
+			event->type == PEAK_NEW ? '+' : '-', event->id,
+			center_freq + (event->bin - peaks->bin_c / 2) * bin_hz,
+			10 * log10f(event->power), event->snr);
+	}
+	if (peaks->event_c)
+		fflush(event_file);
+}
+/*!
+ * Create FFT graph from the averaged spectrum. (see rtlmap_process)
+ * Uses gnuplot for creating graph. (optional, see -D arg.)
+ * Also used for the wideband spectrum of the scanner.
+ *
+ * \param power averaged power spectrum
+ * \param bins output values (dB or magnitude)
+ * \param sample_c bin count
+ * \param center_freq center frequency of the spectrum
+ * \param plot send the frame to gnuplot (-D disables all frames)
+ * \param peaks peak tracker of the spectrum (NULL if -P is not given)
+ * \param change change trigger of the spectrum (NULL if -K is not given)
+ * \param channels channels in the spectrum (NULL if -F is not given)
+ */
+static void create_fft(float *power, float *bins, int sample_c, int center_freq, int plot, 
+		PeakTracker *peaks, ChangeTrigger *change, ChannelPlan *channels){
+	int64_t start = use_metrics ? rtlmap_clock_ns() : 0, reduced = 0;
 	if(!_cont_read && _use_gnuplot)
 		log_info("Creating FFT graph from samples using gnuplot...\n");
 	else if (!_cont_read && !_use_gnuplot)
 		log_info("Reading samples...\n");
-	if(_use_gnuplot)
-		gnuplot_exec("plot '-' smooth frequency with linespoints lt -1 notitle\n");
-	for (int i=0; i < sample_c; i++){
-		/**! 
-		 * Compute magnitude from complex values. [Sqr(Re^2 + Im^2)]
-		 * Compute amplitude (dB) from magnitude. [10 * Log(magnitude)]
-		 *
-		 * TODO #5: Check correctness of this calculation.
-		 */
-		out_r = creal(out[i]) * creal(out[i]);
-		out_i = cimag(out[i]) * cimag(out[i]);
-		amp = sqrt(out_r + out_i);
-		if (!_mag_graph)
-			db = 10 * log10(amp);
-		else
-			db = amp;
-		if(_write_file)
-			fprintf(file, "%d	%f\n", i+1, db);
-		if(_use_gnuplot)
-			gnuplot_exec("%d	%f\n", db, i+1);
-		/**! 
-		 * Fill sample_bin with ID and values.
-		 *
-		 * NOTE: sample_bin is not used anywhere. 
-		 *
-		 * TODO #2: Find the maximum value of samples, show it on graph 
-		 * with a different color.  Might be useful for frequency scanner.
-		 * If you want to sort values see qsort function.
-		 * Example code: qsort(sample_bin, n_read, sizeof(Bin), cmp_sample);
-		 */
-		sample_bin[i].id = i;
-		sample_bin[i].val = db;
-	}
-	if(_use_gnuplot){
-		/**!
-		 * Stop giving points to gnuplot with 'e' command.
-		 * Have to flush the output buffer for [read -> graph] persistence.
-		 */
-		gnuplot_exec("e\n");
-		fflush(gnuplotPipe);
+	if(peaks != NULL && rtlmap_track_peaks(peaks, power))
+		write_peak_events(peaks, center_freq);
+	/**! Frames that look like the baseline are not sent to any output. (-K) */
+	if(change != NULL) {
+		int active = rtlmap_change_update(change, power);
+		if(change->started)
+			log_info("Spectrum changed at %.0f Hz (%.1f dB above the baseline)\n",
+				center_freq + (change->bin - sample_c / 2) * bin_width(), change->excess);
+		else if(change->stopped)
+			log_info("Spectrum is back to the baseline at %.0f Hz\n", (double)center_freq);
+		if(!active) {
+			read_count++;
+			return;
+		}
 	}
-	/**!
-	 * Deallocate FFT plan.
-	 * Free 'in' and 'out' memory regions.
+	/**! 
+	 * Compute amplitude (dB) from power in one pass. [10 * Log(Re^2 + Im^2)]
+	 * Or magnitude if -M is given. [Sqr(Re^2 + Im^2)]
 	 */
-	fftw_destroy_plan(fftwp);
-	fftw_free(in); 
-	fftw_free(out);
+	SpectrumHold *holds = plot && hold.bin_c ? &hold : NULL;
+	if(holds != NULL && !holds->step) {
+		/**! Persistence levels need the value range, the first frame sets it if -L is not given. */
+		if(persist_file != NULL && _wf_min >= _wf_max) {
+			rtlmap_reduce(power, bins, sample_c, _mag_graph);
+			set_waterfall_range(bins, sample_c);
+		}
+		rtlmap_hold_range(holds, _wf_min, _wf_max);
+	}
+	/**! Max/min hold and persistence (-A, -V) are updated in the same pass. */
+	if(holds != NULL)
+		rtlmap_reduce_hold(holds, power, bins, sample_c, _mag_graph);
+	else
+		rtlmap_reduce(power, bins, sample_c, _mag_graph);
+	if(use_metrics)
+		reduced = rtlmap_clock_ns();
+	/**! Outputs are written by their own threads. (see create_sinks) */
+	if(plot && (_wf_rows || strip_file != NULL) && _wf_min >= _wf_max)
+		set_waterfall_range(bins, sample_c);
+	if(plot && strip_file != NULL)
+		rtlmap_sink_push(&strip_sink, bins, sample_c, center_freq, NULL, 0);
+	if(_use_gnuplot && plot){
+		float points[2 * MAX_PEAKS];
+		int peak_c = peaks != NULL && !_wf_rows ? peaks->top_c : 0;
+		for (int i = 0; i < peak_c; i++) {
+			points[2 * i] = peaks->top[i].id;
+			points[2 * i + 1] = bins[peaks->top[i].id];
+		}
+		rtlmap_sink_push(&plot_sink, bins, sample_c, center_freq, points, 2 * peak_c);
+	}
+	/**! Channel powers (-F) in the spectrum are written instead of its bins. */
+	if(_write_file && channels != NULL && channels->channel_c) {
+		rtlmap_channels_measure(channels, power);
+		rtlmap_reduce(channels->power, channel_bins, channels->channel_c, _mag_graph);
+		for (int i = 0; i < channels->channel_c; i++)
+			channel_ids[i] = channels->index[i];
+		rtlmap_sink_push(&file_sink, channel_bins, channels->channel_c, center_freq, 
+			channel_ids, channels->channel_c);
+	} else if(_write_file && channels == NULL)
+		rtlmap_sink_push(&file_sink, bins, sample_c, center_freq, NULL, 0);
+	if(server.running)
+		rtlmap_server_publish(&server, bins, sample_c, center_freq);
+	/**! Holds are written at a lower rate than the frames. (-q) */
+	if(holds != NULL) {
+		hold_freq = center_freq;
+		if(holds->frame_c % _hold_interval == 0)
+			write_holds();
+	}
+	if(use_metrics) {
+		rtlmap_metrics_record(&metrics, METRIC_REDUCE, reduced - start);
+		rtlmap_metrics_record(&metrics, METRIC_OUTPUT, rtlmap_clock_ns() - reduced);
+		atomic_fetch_add_explicit(&metrics.frames, 1, memory_order_relaxed);
+	}
 	read_count++;
 }
 /*!
- * Asynchronous read callback.
- * Program jump to this function after read operation finished.
- * Runs create_fft() function and provides continuous read
- * depending on the -C argument with refresh rate.
- * Exits if -C argument is not given.
+ * Compute the hops of the frequency scanner from the given range,
+ * sample rate, FFT size and crop percentage. Allocate the wideband
+ * spectrum. Center frequency is set to the center of the scanned
+ * range, so the graph and the output files describe the wideband
+ * spectrum like a single (wide) FFT.
+ * Exits on invalid range or failure at allocating memory.
  *
- * \param n_buf raw I/Q samples
- * \param len length of buffer
- * \param ctx context which is given at rtlsdr_read_async(...)
+ * \return 0 on success
  */
-static void async_read_callback(uint8_t *n_buf, uint32_t len, void *ctx){
-	create_fft(n_read, n_buf);
-	if (_cont_read && read_count < _num_read){
-		usleep(1000*_refresh_rate);
-		rtlsdr_read_async(dev, async_read_callback, NULL, 0, n_read * n_read);
-	}else{
-		log_info("Done, exiting...\n");
-		do_exit();
+static int configure_scanner(){
+	scanner.keep = n_read - n_read * _scan_crop / 100;
+	if (scanner.keep < 1)
+		scanner.keep = 1;
+	scanner.step = (int)((double)_samp_rate * scanner.keep / n_read);
+	if (_scan_stop <= _scan_start || scanner.step < 1) {
+		log_fatal("Invalid scan range.\n");
+		exit(1);
 	}
-	/**!
-	 * TODO #3: Frequency scanner
-	 * Add -S argument for scan mode.
-	 * Add -b argument for frequency range. (eg.: 90 MHz - 100 MHz)
-	 * For frequency scanning we have to recalculate center frequency,
-	 * min and max points of graph. 
-	 * Then, rtlsdr_set_center_freq and rtlsdr_reset_buffer functions should be
-	 * called.
-	 * Optionally, sorting samples/detecting the peaks might be useful 
-	 * with this scanner application. (For sorting, see given qsort example.)
-	 * Example code:
-	 * =========================
-	 *	rtlsdr_cancel_async(dev);
-	 *	_center_freq += pow(10, 5);
-	 *	float center_mhz = _center_freq / pow(10, 6);
-	 *	float step_size = (n_read * pow(10, 3))  / pow(10, 6);
-	 *	gnuplot_exec("set xtics ('%.1f' 1, '%.1f' 256, '%.1f' 512)\n", 
-	 *	center_mhz-step_size, 
-	 *	center_mhz, 
-	 *	center_mhz+step_size);
-   	 *	rtlsdr_set_center_freq(dev, _center_freq);
-	 *	rtlsdr_reset_buffer(dev);
-	 * =========================
-	 */
+	scanner.hops = (int)(((double)_scan_stop - _scan_start + scanner.step - 1) / scanner.step);
+	scanner.bin_c = scanner.hops * scanner.keep;
+	scanner.first_freq = _scan_start + scanner.step / 2;
+	scanner.settle_len = (2 * _settle_samples + SYNC_READ_ALIGN - 1) / 
+		SYNC_READ_ALIGN * SYNC_READ_ALIGN;
+	_center_freq = _scan_start + (int)((double)scanner.hops * scanner.step / 2);
+	scanner.sweep = calloc(scanner.bin_c, sizeof(float));
+	scanner.avg = calloc(scanner.bin_c, sizeof(float));
+	scanner.bins = calloc(scanner.bin_c, sizeof(float));
+	if (!scanner.sweep || !scanner.avg || !scanner.bins) {
+		log_fatal("Failed to allocate scanner buffers.\n");
+		exit(1);
+	}
+	log_info("Scanning %d-%d Hz in %d hops of %d Hz (%d bins)\n", 
+		_scan_start, _scan_start + scanner.hops * scanner.step,
+		scanner.hops, scanner.step, scanner.bin_c);
+	return 0;
+}
+/*!
+ * Capture loop of the frequency scanner. (runs instead of
+ * rtlsdr_read_async in scan mode)
+ * For each hop of the receiver: retune, discard the samples that
+ * are read while the PLL settles, then read a buffer into the ring
+ * with the hop index as tag. The DSP thread processes hop N while
+ * hop N+1 is being captured. Returns when 'exiting' is set.
+ *
+ * \param rx receiver
+ */
+static void scan_capture(Receiver *rx){
+	uint8_t *settle_buf = malloc(scanner.settle_len ? scanner.settle_len : 1), *slot;
+	RingBuffer *ring = &rx->ring;
+	int n_bytes;
+	if (!settle_buf) {
+		log_fatal("Failed to allocate settle buffer.\n");
+		return;
+	}
+	for (int i = 0; !atomic_load(&exiting); i = (i + 1) % rx->hop_c) {
+		int hop = rx->first_hop + i;
+		rtlsdr_set_center_freq(rx->dev, scanner.first_freq + hop * scanner.step);
+		if (scanner.settle_len)
+			rtlsdr_read_sync(rx->dev, settle_buf, scanner.settle_len, &n_bytes);
+		/**! Reading is not time critical, wait for a free slot. */
+		while (!(slot = rtlmap_ring_reserve(ring)) && !atomic_load(&exiting))
+			usleep(500);
+		if (!slot)
+			break;
+		if (rtlsdr_read_sync(rx->dev, slot, buf_len, &n_bytes) < 0) {
+			log_error("Failed to read samples from device #%d.\n", rx->dev_id);
+			break;
+		}
+		rtlmap_ring_commit(ring, n_bytes, hop);
+	}
+	free(settle_buf);
+}
+/*!
+ * Stop reading from all devices. (-n frames are created)
+ */
+static void finish_read(){
+	log_info("Done, exiting...\n");
+	atomic_store(&exiting, 1);
+	for (int i = 0; i < receiver_c; i++)
+		rtlsdr_cancel_async(receivers[i].dev);
+}
+/*!
+ * Copy the central bins of a hop into the sweep.
+ * After the last hop of a receiver, waits until the other
+ * receivers stitch their hops too. The last one creates the
+ * graph of the wideband spectrum and releases the others, so
+ * no receiver starts the next sweep before it is created.
+ *
+ * \param rx receiver
+ * \param hop hop index
+ */
+static void stitch_hop(Receiver *rx, int hop){
+	FFTEngine *engine = &rx->engine;
+	struct timespec now;
+	if (!hop)
+		clock_gettime(CLOCK_MONOTONIC, &scanner.sweep_start);
+	memcpy(scanner.sweep + hop * scanner.keep, 
+		engine->avg + engine->size / 2 - scanner.keep / 2, 
+		sizeof(float) * scanner.keep);
+	if (hop != rx->first_hop + rx->hop_c - 1)
+		return;
+	pthread_mutex_lock(&scanner.lock);
+	int sweep_c = scanner.sweep_c;
+	if (++scanner.parts < receiver_c) {
+		while (scanner.sweep_c == sweep_c && !atomic_load(&exiting))
+			pthread_cond_wait(&scanner.done, &scanner.lock);
+		pthread_mutex_unlock(&scanner.lock);
+		return;
+	}
+	scanner.parts = 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	scanner.sweep_ms += (now.tv_sec - scanner.sweep_start.tv_sec) * 1e3 +
+		(now.tv_nsec - scanner.sweep_start.tv_nsec) / 1e6;
+	rtlmap_merge_average(scanner.avg, scanner.sweep, scanner.bin_c, &scanner.avg_c,
+		_avg_mode, _avg_alpha);
+	pthread_mutex_lock(&output_lock);
+	create_fft(scanner.avg, scanner.bins, scanner.bin_c, _center_freq, 1, 
+		_peak_count ? &scanner.peaks : NULL, _change_on ? &scanner.change : NULL,
+		_channel_file != NULL ? &scanner.channels : NULL);
+	pthread_mutex_unlock(&output_lock);
+	scanner.sweep_c++;
+	if (scanner.sweep_c >= (_cont_read ? _num_read : 1))
+		finish_read();
+	pthread_cond_broadcast(&scanner.done);
+	pthread_mutex_unlock(&scanner.lock);
+}
+/*!
+ * Count the new peaks of the last frame. (recorder trigger, see -J)
+ *
+ * \param peaks peak tracker
+ * \return new peak count
+ */
+static int new_peak_count(PeakTracker *peaks){
+	int new_c = 0;
+	for (int i = 0; i < peaks->event_c; i++)
+		new_c += peaks->events[i].type == PEAK_NEW;
+	return new_c;
+}
+/*!
+ * Get the first frame deadline of a receiver at or after the given time.
+ * Deadlines of the devices are on a grid of the refresh interval (-r)
+ * in the system time, so stations with synchronized clocks (NTP, GPS)
+ * create their frames at the same moments. Replayed files (-i) are
+ * timed by the sample count, their grid starts with the file.
+ *
+ * \param now time of the first buffer (ns, monotonic or sample time)
+ * \return deadline (ns)
+ */
+static int64_t frame_deadline(int64_t now){
+	int64_t period = (int64_t)_refresh_rate * 1000000;
+	if (_input_file != NULL || period <= 0)
+		return now;
+	int64_t offset = rtlmap_timestamp_ns() - rtlmap_clock_ns(), /*!< System time - monotonic time */
+		wall = now + offset;
+	return (wall + period - 1) / period * period - offset;
+}
+/*!
+ * DSP thread of a receiver.
+ * Drains the ring buffer and runs create_fft() on the samples.
+ * Without -C, the first buffer is used and reading stops.
+ * With -C, a frame is created at each deadline, every refresh
+ * interval (-r) on a fixed grid (see frame_deadline), from the
+ * first buffer at or after the deadline. Frame spacing does not
+ * drift with the FFT and output time, and deadlines that pass
+ * without a buffer (late buffers or a slow frame) are counted as
+ * missed. The buffers received in between are merged into the
+ * average if -a is given, otherwise they are dropped.
+ * In scan mode (-S), every buffer is a hop and a frame is
+ * created after each sweep. (see stitch_hop)
+ * Stops the read after -n frames. (from each device)
+ * Only the first receiver is plotted, all are written to the file.
+ *
+ * \param arg receiver
+ * \return NULL
+ */
+static void *dsp_worker(void *arg){
+	Receiver *rx = (Receiver*)arg;
+	FFTEngine *engine = &rx->engine;
+	RingBuffer *ring = &rx->ring;
+	int frame_c = _cont_read ? _num_read : 1;
+	static atomic_int finished; /*!< Receivers that created -n frames */
+	int64_t now, deadline = 0, /*!< Time of the next frame (ns, see frame_deadline) */
+		period = (int64_t)_refresh_rate * 1000000;
+	int started = 0; /*!< First deadline is set */
+	uint32_t len, tag;
+	uint8_t *buf;
+	while (1) {
+		while (sem_wait(&ring->items) && errno == EINTR);
+		/**! Buffers of the input file (-i) are processed until the ring is empty. */
+		if (atomic_load(&rx->stop) && (atomic_load(&exiting) || !rtlmap_ring_peek(ring, &len, &tag)))
+			break;
+		if (!(buf = rtlmap_ring_peek(ring, &len, &tag)))
+			continue;
+		if (_scan_mode) {
+			/**! Spectrum of a hop is not averaged with other hops. */
+			engine->avg_c = 0;
+			rtlmap_process(engine, buf, len);
+			stitch_hop(rx, tag);
+			rtlmap_ring_pop(ring);
+			if (atomic_load(&exiting))
+				break;
+			continue;
+		}
+		/**! Replayed samples are timed by the sample rate, not by the replay speed. */
+		/**! Buffers of devices are timed when they are received, not when they are processed. */
+		if (_input_file) {
+			now = (int64_t)(rx->sample_c / _samp_rate) * 1000000000 +
+				(int64_t)(rx->sample_c % _samp_rate * 1000000000 / _samp_rate);
+			rx->sample_c += len / 2;
+		} else
+			now = rtlmap_ring_time(ring);
+		if (!started) {
+			deadline = frame_deadline(now);
+			started = 1;
+		}
+		int frame_due = !_cont_read || now >= deadline;
+		/**! Zoom needs every buffer, the decimated stream must be continuous. */
+		if (frame_due || _avg_mode != AVG_NONE || _decimation > 1)
+			rtlmap_process(engine, buf, len);
+		/**! First zoomed segment may need more than one buffer. (see zoom_process) */
+		if (frame_due && engine->avg_c) {
+			pthread_mutex_lock(&output_lock);
+			create_fft(engine->avg, engine->bins, engine->size, 
+				rx->center_freq + _zoom_offset, !rx->id, 
+				_peak_count ? &rx->peaks : NULL, _change_on ? &rx->change : NULL,
+				_channel_file != NULL ? &rx->channels : NULL);
+			pthread_mutex_unlock(&output_lock);
+			if (_post_trigger > 0 && (new_peak_count(&rx->peaks) || rx->change.started))
+				rtlmap_recorder_trigger(&rx->recorder);
+			rx->frame_c++;
+			/**! Next deadline stays on the grid, the deadlines that passed are skipped. */
+			int64_t late = period > 0 ? (now - deadline) / period : 0;
+			if (late > 0)
+				atomic_fetch_add_explicit(&rx->missed, late, memory_order_relaxed);
+			deadline += (late + 1) * period;
+		} else if (_avg_mode == AVG_NONE && _decimation == 1) {
+			atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		}
+		rtlmap_ring_pop(ring);
+		if (rx->frame_c >= frame_c)
+			break;
+	}
+	if (!_scan_mode && rx->frame_c >= frame_c) {
+		rtlsdr_cancel_async(rx->dev);
+		if (atomic_fetch_add(&finished, 1) + 1 == receiver_c)
+			finish_read();
+	}
+	return NULL;
+}
+/*!
+ * Capture thread of a receiver.
+ * Single asynchronous read session, returns after
+ * rtlsdr_cancel_async() is called. (signal or -n/-C)
+ * Scanner reads synchronously after each retune instead.
+ * With -i, the recorded samples are read until the end of file.
+ *
+ * \param arg receiver
+ * \return NULL
+ */
+static void *capture_worker(void *arg){
+	Receiver *rx = (Receiver*)arg;
+	if (_input_file)
+		rtlmap_read_file(_input_file, &rx->ring, buf_len, _realtime ? _samp_rate : 0, &exiting);
+	else if (_scan_mode)
+		scan_capture(rx);
+	else if (!atomic_load(&exiting))
+		rtlmap_read_async(rx->dev, &rx->ring, buf_len);
+	return NULL;
+}
+/*!
+ * Pin a thread to a CPU core. (modulo the online core count)
+ * Used with multiple devices, so the capture and DSP threads
+ * of the receivers do not migrate between cores.
+ *
+ * \param thread thread to pin
+ * \param cpu core index
+ */
+static void pin_thread(pthread_t thread, int cpu){
+	long cpu_c = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t cpu_set;
+	if (cpu_c < 2)
+		return;
+	CPU_ZERO(&cpu_set);
+	CPU_SET(cpu % cpu_c, &cpu_set);
+	if (pthread_setaffinity_np(thread, sizeof(cpu_set), &cpu_set))
+		log_error("Failed to pin thread to CPU %ld.\n", cpu % cpu_c);
 }
 /*!
  * Print usage and exit.
  */
 static void print_usage(){
 	char *usage	= "rtl_map, a FFT-based visualizer for RTL-SDR devices. (RTL2832/DVB-T)\n\n"
-				  "Usage:\t[-d device index (default: 0)]\n"
+				  "Usage:\t[-d device index or serial, comma separated for multiple devices (default: 0)]\n"
                   "\t[-s sample rate (default: 2048000 Hz)]\n"
-				  "\t[-f center frequency (Hz)] *\n"
+				  "\t[-f center frequency (Hz, eg.: 100M), comma separated for multiple devices] *\n"
 				  "\t[-g gain (0 for auto) (default: ~1-3)]\n"
 				  "\t[-n number of reads (default: int_max.)]\n"
 				  "\t[-r refresh rate for -C read (default: 500ms)]\n"
@@ -502,12 +1310,236 @@ static void print_usage(){
 				  "\t[-C continuously read samples (default: off)]\n"
 				  "\t[-M show magnitude graph (default graph: dB)]\n"
 				  "\t[-O disable offset tuning (default: on)]\n"
+				  "\t[-Q disable DC offset and I/Q imbalance correction (default: on)]\n"
 				  "\t[-T turn off log colors (default: on)]\n"
+				  "\t[-N FFT size (default: 512)]\n"
+				  "\t[-o overlap of averaged FFT segments (0-99) (default: 50%)]\n"
+				  "\t[-a average frames (none|lin|exp[:factor]) (default: none)]\n"
+				  "\t[-Z zoom into offset:decimation around the center frequency (eg.: 250k:64)]\n"
+				  "\t[-W window function (rect|hann|blackman-harris|flattop|kaiser[:beta]) (default: hann)]\n"
+				  "\t[-p FFT planner effort (estimate|measure|patient|exhaustive) (default: measure)]\n"
+				  "\t[-t FFT threads for FFT sizes of 32768 or more (default: 1)]\n"
+				  "\t[-w FFTW wisdom file (default: $XDG_CACHE_HOME/rtl_map/wisdom)]\n"
+				  "\t[-S scan the frequency range given with -b]\n"
+				  "\t[-b frequency range to scan (start:stop, eg.: 88M:108M)]\n"
+				  "\t[-c percent of bins cropped at the edges of each hop (default: 25%)]\n"
+				  "\t[-k samples discarded after retuning (default: 32768)]\n"
+				  "\t[-B write binary spectrum records to file (default: text)]\n"
+				  "\t[-X convert binary spectrum file to text and exit]\n"
+				  "\t[-i read recorded I/Q samples from file instead of device ('-' for stdin)]\n"
+				  "\t[-R replay the file given with -i in real time (default: as fast as possible)]\n"
+				  "\t[-P track the strongest peaks (count[:snr_db], eg.: 8:6) (default: off, snr: 10dB)]\n"
+				  "\t[-E file to write the peak events ('-' for stdout) (default: stderr)]\n"
+				  "\t[-H show a waterfall of the given number of frames instead of the spectrum]\n"
+				  "\t[-G write the waterfall to a PGM image (one row per frame)]\n"
+				  "\t[-L value range of the waterfall colors (min:max, eg.: 20:80) (default: first frame)]\n"
+				  "\t[-A write the max-hold and min-hold traces to file every -q frames]\n"
+				  "\t[-V write the persistence of the spectrum to a PGM image every -q frames (levels: -L)]\n"
+				  "\t[-q frames between the outputs of -A and -V (default: 100)]\n"
+				  "\t[-F write the power of the channels in the given file instead of the bins (center bandwidth [name] lines)]\n"
+				  "\t[-l serve binary spectrum frames to TCP clients ([host:]port)]\n"
+				  "\t[-U send binary spectrum frames as UDP datagrams (host:port)]\n"
+				  "\t[-Y file outputs wait for the disk or drop the oldest frames (block|drop) (default: block)]\n"
+				  "\t[-I record the raw I/Q samples to file (*.N for multiple devices)]\n"
+				  "\t[-J record only the seconds around new peaks of -P or changes of -K (pre:post, eg.: 2:5)]\n"
+				  "\t[-K only output frames that are on[:off] dB above the baseline (eg.: 10:5) (default: off, off: on/2)]\n"
+				  "\t[-m print a summary of the metrics to stderr every given seconds (default: off)]\n"
+				  "\t[-e serve the metrics over HTTP for Prometheus ([host:]port, GET /metrics)]\n"
 				  "\t[-h show this help message and exit]\n"
                   "\t[filename (a '-' dumps samples to stdout)]\n\n";
     fprintf(stderr, "%s", usage);
     exit(0);
 }
+/*!
+ * Set FFTW planner flags from the given effort name.
+ *
+ * \param effort estimate, measure, patient or exhaustive
+ * \return 0 on success
+ * \return 1 on unknown effort
+ */
+static int parse_fft_flags(char *effort){
+	if (!strcmp(effort, "estimate"))
+		_fft_flags = FFTW_ESTIMATE;
+	else if (!strcmp(effort, "measure"))
+		_fft_flags = FFTW_MEASURE;
+	else if (!strcmp(effort, "patient"))
+		_fft_flags = FFTW_PATIENT;
+	else if (!strcmp(effort, "exhaustive"))
+		_fft_flags = FFTW_EXHAUSTIVE;
+	else
+		return 1;
+	return 0;
+}
+/*!
+ * Set averaging mode (and factor) from the given argument.
+ *
+ * \param mode none, lin or exp[:factor] (eg.: exp:0.2)
+ * \return 0 on success
+ * \return 1 on unknown mode or invalid factor
+ */
+static int parse_avg_mode(char *mode){
+	if (!strcmp(mode, "none"))
+		_avg_mode = AVG_NONE;
+	else if (!strcmp(mode, "lin"))
+		_avg_mode = AVG_LIN;
+	else if (!strncmp(mode, "exp", 3) && (mode[3] == '\0' || mode[3] == ':')) {
+		_avg_mode = AVG_EXP;
+		if (mode[3] == ':')
+			_avg_alpha = atof(mode + 4);
+		if (_avg_alpha <= 0 || _avg_alpha > 1)
+			return 1;
+	} else
+		return 1;
+	return 0;
+}
+/*!
+ * Set window function (and Kaiser beta) from the given argument.
+ *
+ * \param window rect, hann, blackman-harris, flattop or kaiser[:beta] (eg.: kaiser:6)
+ * \return 0 on success
+ * \return 1 on unknown window or invalid beta
+ */
+static int parse_window(char *window){
+	if (!strncmp(window, "kaiser", 6) && (window[6] == '\0' || window[6] == ':')) {
+		_window = WINDOW_KAISER;
+		if (window[6] == ':')
+			_kaiser_beta = atof(window + 7);
+		if (_kaiser_beta <= 0)
+			return 1;
+		return 0;
+	}
+	for (_window = WINDOW_RECT; _window < WINDOW_KAISER; _window++)
+		if (!strcmp(window, rtlmap_window_name(_window)))
+			return 0;
+	return 1;
+}
+/*!
+ * Set the value range of the waterfall colors from the given argument.
+ *
+ * \param range min:max (eg.: 20:80)
+ * \return 0 on success
+ * \return 1 on invalid range
+ */
+static int parse_wf_range(char *range){
+	char *end;
+	_wf_min = strtof(range, &end);
+	if (*end != ':')
+		return 1;
+	_wf_max = strtof(end + 1, &end);
+	if (*end != '\0' || _wf_max <= _wf_min)
+		return 1;
+	return 0;
+}
+/*!
+ * Set tracked peak count (and minimum SNR) from the given argument.
+ *
+ * \param peaks count[:snr_db] (eg.: 8:6)
+ * \return 0 on success
+ * \return 1 on invalid count or SNR
+ */
+static int parse_peaks(char *peaks){
+	char *end;
+	_peak_count = (int)strtol(peaks, &end, 10);
+	if (*end == ':')
+		_peak_snr = strtof(end + 1, &end);
+	if (*end != '\0' || _peak_count < 1 || _peak_count > MAX_PEAKS || _peak_snr < 0)
+		return 1;
+	return 0;
+}
+/*!
+ * Set the levels of the change trigger from the given argument.
+ *
+ * \param levels on[:off] (dB above the baseline, eg.: 10:5)
+ * \return 0 on success
+ * \return 1 on invalid levels
+ */
+static int parse_change(char *levels){
+	char *end;
+	_change_on = strtof(levels, &end);
+	_change_off = _change_on / 2;
+	if (*end == ':')
+		_change_off = strtof(end + 1, &end);
+	if (*end != '\0' || _change_on <= 0 || _change_off < 0 || _change_off > _change_on)
+		return 1;
+	return 0;
+}
+/*!
+ * Set the recorded seconds before and after a new peak from the given argument.
+ *
+ * \param trigger pre:post (eg.: 2:5)
+ * \return 0 on success
+ * \return 1 on invalid range
+ */
+static int parse_trigger(char *trigger){
+	char *end;
+	_pre_trigger = strtof(trigger, &end);
+	if (*end != ':')
+		return 1;
+	_post_trigger = strtof(end + 1, &end);
+	if (*end != '\0' || _pre_trigger < 0 || _post_trigger <= 0)
+		return 1;
+	return 0;
+}
+/*!
+ * Set zoom offset and decimation from the given argument.
+ *
+ * \param zoom offset:decimation (eg.: -250k:64)
+ * \return 0 on success
+ * \return 1 on invalid offset or decimation
+ */
+static int parse_zoom(char *zoom){
+	char *end;
+	double offset = rtlmap_parse_freq(zoom, &end);
+	if (*end != ':')
+		return 1;
+	_decimation = (int)strtol(end + 1, &end, 10);
+	if (*end != '\0' || _decimation < 2 || _decimation > MAX_DECIMATION || 
+		fabs(offset) > INT_MAX)
+		return 1;
+	_zoom_offset = (int)offset;
+	return 0;
+}
+/*!
+ * Check the center frequencies (-f) of the devices and
+ * set the first one as the center frequency.
+ *
+ * \param freqs comma separated frequencies (eg.: 100M,101.5M)
+ * \return 0 on success
+ * \return 1 on invalid or empty frequency
+ */
+static int parse_center_freqs(char *freqs){
+	char *end = freqs;
+	for (int i = 0; ; i++) {
+		double freq = rtlmap_parse_freq(end, &end);
+		if ((*end != ',' && *end != '\0') || freq <= 0 || freq > INT_MAX)
+			return 1;
+		if (!i)
+			_center_freq = (int)freq;
+		if (*end++ == '\0')
+			break;
+	}
+	_center_freqs = freqs;
+	return 0;
+}
+/*!
+ * Set the scanned frequency range from the given argument.
+ *
+ * \param range start:stop (eg.: 88M:108M)
+ * \return 0 on success
+ * \return 1 on invalid range
+ */
+static int parse_freq_range(char *range){
+	char *end;
+	double start = rtlmap_parse_freq(range, &end);
+	if (*end != ':')
+		return 1;
+	double stop = rtlmap_parse_freq(end + 1, &end);
+	if (*end != '\0' || start <= 0 || stop <= start || stop > INT_MAX)
+		return 1;
+	_scan_start = (int)start;
+	_scan_stop = (int)stop;
+	return 0;
+}
 /*!
  * Parse command line arguments.
  *
@@ -517,16 +1549,17 @@ static void print_usage(){
  */
 static int parse_args(int argc, char **argv){
 	int opt;
-	while ((opt = getopt(argc, argv, "d:s:f:g:r:n:DCMOTh")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:f:g:r:n:N:o:a:W:Z:p:w:X:b:c:k:i:P:E:H:G:L:l:U:Y:I:J:K:m:e:t:A:V:q:F:DCMOQTBSRh")) != -1) {
         switch (opt) {
             case 'd':
-                _dev_id = atoi(optarg);
+                _dev_ids = optarg;
                 break;
 			case 's':
                 _samp_rate = atoi(optarg);
             	break;
             case 'f':
-                _center_freq = atoi(optarg);
+				if (parse_center_freqs(optarg))
+					print_usage();
                 break;
             case 'g':
 				/**! Tenths of a dB */
@@ -538,6 +1571,43 @@ static int parse_args(int argc, char **argv){
 			case 'n':
                 _num_read = atoi(optarg);
                 break;
+			case 'N':
+				n_read = atoi(optarg);
+				if (n_read < 2 || n_read > MAX_FFT_SIZE)
+					print_usage();
+				if (!rtlmap_is_fast_fft_size(n_read))
+					log_error("FFT size %d is not a product of 2, 3, 5 and 7, "
+						"FFT will be slow.\n", n_read);
+				break;
+			case 'o':
+				_overlap = atoi(optarg);
+				if (_overlap < 0 || _overlap > 99)
+					print_usage();
+				break;
+			case 'a':
+				if (parse_avg_mode(optarg))
+					print_usage();
+				break;
+			case 'W':
+				if (parse_window(optarg))
+					print_usage();
+				break;
+			case 'Z':
+				if (parse_zoom(optarg))
+					print_usage();
+				break;
+			case 'p':
+				if (parse_fft_flags(optarg))
+					print_usage();
+				break;
+			case 't':
+				_fft_threads = atoi(optarg);
+				if (_fft_threads < 1)
+					print_usage();
+				break;
+			case 'w':
+				_wisdom_file = optarg;
+				break;
 			case 'D':
                 _use_gnuplot = 0;
                 break;		
@@ -550,9 +1620,107 @@ static int parse_args(int argc, char **argv){
 			case 'O':
                 _offset_tuning = 0;
                 break;
+			case 'Q':
+				_iq_correction = 0;
+				break;
 			case 'T':
                 _log_colors = 0;
                 break;
+			case 'B':
+				_binary_file = 1;
+				break;
+			case 'X':
+				_convert_file = optarg;
+				break;
+			case 'S':
+				_scan_mode = 1;
+				break;
+			case 'i':
+				_input_file = optarg;
+				break;
+			case 'R':
+				_realtime = 1;
+				break;
+			case 'P':
+				if (parse_peaks(optarg))
+					print_usage();
+				break;
+			case 'E':
+				_event_file = optarg;
+				break;
+			case 'H':
+				_wf_rows = atoi(optarg);
+				if (_wf_rows < 2)
+					print_usage();
+				break;
+			case 'G':
+				_strip_file = optarg;
+				break;
+			case 'A':
+				_hold_file = optarg;
+				break;
+			case 'V':
+				_persist_file = optarg;
+				break;
+			case 'q':
+				_hold_interval = atoi(optarg);
+				if (_hold_interval < 1)
+					print_usage();
+				break;
+			case 'F':
+				_channel_file = optarg;
+				break;
+			case 'L':
+				if (parse_wf_range(optarg))
+					print_usage();
+				break;
+			case 'l':
+				_listen_addr = optarg;
+				break;
+			case 'U':
+				_udp_addr = optarg;
+				break;
+			case 'Y':
+				if (!strcmp(optarg, "block"))
+					_sink_policy = SINK_BLOCK;
+				else if (!strcmp(optarg, "drop"))
+					_sink_policy = SINK_DROP_OLDEST;
+				else
+					print_usage();
+				break;
+			case 'I':
+				_record_file = optarg;
+				break;
+			case 'J':
+				if (parse_trigger(optarg))
+					print_usage();
+				break;
+			case 'K':
+				if (parse_change(optarg))
+					print_usage();
+				break;
+			case 'm':
+				_stats_interval = atoi(optarg);
+				if (_stats_interval <= 0)
+					print_usage();
+				break;
+			case 'e':
+				_metrics_addr = optarg;
+				break;
+			case 'b':
+				if (parse_freq_range(optarg))
+					print_usage();
+				break;
+			case 'c':
+				_scan_crop = atoi(optarg);
+				if (_scan_crop < 0 || _scan_crop > 90)
+					print_usage();
+				break;
+			case 'k':
+				_settle_samples = atoi(optarg);
+				if (_settle_samples < 0)
+					print_usage();
+				break;
             case 'h':
                 print_usage();
                 break;
@@ -561,10 +1729,42 @@ static int parse_args(int argc, char **argv){
                 break;
         }
     }
-	/**! Center frequency (-f) is mandatory. */
-	if (!_center_freq)
+	/**! Center frequency (-f) is mandatory. (except -X, -i, or -S with -b) */
+	if (_scan_mode && (!_scan_stop || _input_file != NULL || _decimation > 1))
+		print_usage();
+	/**! Hops of the scanner are not a continuous recording, the trigger needs peaks. */
+	if (_record_file != NULL && (_scan_mode || (_post_trigger > 0 && !_peak_count && !_change_on)))
+		print_usage();
+	/**! Baselines are learned from the frames of a continuous read. */
+	if (_change_on && !_cont_read)
+		print_usage();
+	if (_post_trigger > 0 && _record_file == NULL)
+		print_usage();
+	/**! Zoomed band must be inside the sampled band. */
+	if (abs(_zoom_offset) + _samp_rate / _decimation / 2 > _samp_rate / 2)
+		print_usage();
+	if (!_center_freq && _convert_file == NULL && !_scan_mode && _input_file == NULL)
 		print_usage();
 	_filename = argv[optind];
+	use_metrics = _stats_interval || _metrics_addr != NULL;
+	/**! Settings of the library pipeline. (see rtlmap.h) */
+	config.fft_size = n_read;
+	config.overlap = _overlap;
+	config.avg_mode = _avg_mode;
+	config.avg_alpha = _avg_alpha;
+	config.window = _window;
+	config.window_beta = _kaiser_beta;
+	config.fft_flags = _fft_flags;
+	config.fft_threads = _fft_threads;
+	config.wisdom_file = _wisdom_file;
+	config.sample_rate = _samp_rate;
+	config.gain = _gain;
+	config.offset_tuning = _offset_tuning;
+	config.iq_correction = _iq_correction;
+	config.zoom_offset = _zoom_offset;
+	config.decimation = _decimation;
+	config.magnitude = _mag_graph;
+	rtlmap_set_log_colors(_log_colors);
 	return 0;
 }
 /*!
@@ -576,9 +1776,111 @@ static int parse_args(int argc, char **argv){
  */
 void main(int argc, char **argv){
 	parse_args(argc, argv);
+	if (_scan_mode)
+		configure_scanner();
+	if (_convert_file != NULL) {
+		_binary_file = 0;
+		if (_filename == NULL)
+			_filename = "-";
+		open_file();
+		int r = rtlmap_convert_spectrum_file(_convert_file, file);
+		fclose(file);
+		exit(r);
+	}
 	register_signals();
 	configure_gnuplot();
-	configure_rtlsdr();
+	log_info("Starting rtl_map ~\n");
+	if (_input_file != NULL) {
+		/**! Single receiver without device. (see capture_worker) */
+		receivers[0].center_freq = _center_freq;
+		receiver_c = 1;
+	} else {
+		int device_count = rtlmap_list_devices();
+		if (!device_count)
+			exit(1);
+		create_receivers(device_count);
+	}
+	rtlmap_init();
+	open_event_file();
+	open_strip_file();
+	open_hold_files();
+	if (_wf_rows && _use_gnuplot && rtlmap_waterfall_create(&waterfall, _wf_rows, bin_count()))
+		exit(1);
+	buf_len = rtlmap_buffer_length(n_read);
+	if (buf_len % (2 * n_read))
+		log_info("USB buffer (%d bytes) is not a whole number of %d point segments, "
+			"an FFT size with more factors of 2 uses every sample.\n", buf_len, n_read);
+	if (_cont_read && !_scan_mode && _refresh_rate * (_samp_rate / 1000.0) < buf_len / 2)
+		log_error("Refresh interval (%d ms) is shorter than a USB buffer (%.1f ms), "
+			"deadlines will be missed.\n", _refresh_rate, buf_len / 2 * 1000.0 / _samp_rate);
+	if (use_metrics)
+		rtlmap_metrics_init(&metrics);
+	/**! Ring of a recorded device also holds the buffers before the trigger. (-J) */
+	unsigned int pre_slots = ceil(_pre_trigger * _samp_rate * 2 / buf_len),
+		post_slots = ceil(_post_trigger * _samp_rate * 2 / buf_len),
+		ring_slots = RING_SLOTS + (_record_file != NULL ? RECORD_SLOTS + pre_slots : 0);
+	for (int i = 0; i < receiver_c; i++) {
+		Receiver *rx = &receivers[i];
+		if (_record_file != NULL)
+			snprintf(rx->record_file, sizeof(rx->record_file), 
+				receiver_c > 1 ? "%s.%d" : "%s", _record_file, rx->id);
+		if ((_input_file == NULL && 
+			rtlmap_open_device(&rx->dev, rx->dev_id, rx->center_freq, &config)) ||
+			rtlmap_engine_create(&rx->engine, &config) ||
+			rtlmap_ring_init(&rx->ring, ring_slots, buf_len) ||
+			(_record_file != NULL && rtlmap_recorder_start(&rx->recorder, &rx->ring, 
+			rx->record_file, pre_slots, post_slots)) ||
+			(_peak_count && !_scan_mode &&
+			rtlmap_peaks_create(&rx->peaks, n_read, _peak_count, _peak_snr)) ||
+			(_change_on && !_scan_mode &&
+			rtlmap_change_create(&rx->change, n_read, _change_on, _change_off)))
+			exit(1);
+		if (use_metrics)
+			rx->engine.metrics = rx->ring.metrics = &metrics;
+	}
+	if (_scan_mode && ((_peak_count && 
+		rtlmap_peaks_create(&scanner.peaks, scanner.bin_c, _peak_count, _peak_snr)) ||
+		(_change_on && rtlmap_change_create(&scanner.change, scanner.bin_c, _change_on, _change_off))))
+		exit(1);
+	load_channels();
+	/**! Header has the gain that is selected while opening the devices. */
 	open_file();
-	rtlsdr_read_async(dev, async_read_callback, NULL, 0, n_read * n_read);
+	if ((_listen_addr != NULL || _udp_addr != NULL) && 
+		rtlmap_server_start(&server, _listen_addr, _udp_addr, &config, _center_freq))
+		exit(1);
+	create_sinks();
+	start_metrics();
+	for (int i = 0; i < receiver_c; i++) {
+		Receiver *rx = &receivers[i];
+		if (pthread_create(&rx->dsp_thread, NULL, dsp_worker, rx) ||
+			pthread_create(&rx->capture_thread, NULL, capture_worker, rx)) {
+			log_fatal("Failed to create threads of device #%d.\n", rx->dev_id);
+			exit(1);
+		}
+		/**! Two cores per receiver. (capture, DSP) */
+		if (receiver_c > 1) {
+			pin_thread(rx->capture_thread, 2 * i);
+			pin_thread(rx->dsp_thread, 2 * i + 1);
+		}
+	}
+	for (int i = 0; i < receiver_c; i++)
+		pthread_join(receivers[i].capture_thread, NULL);
+	/**! 
+	 * Release the DSP threads that wait for the ring or a sweep.
+	 * After the end of the input file (-i), the queued buffers are processed first.
+	 */
+	if (_input_file == NULL)
+		atomic_store(&exiting, 1);
+	pthread_mutex_lock(&scanner.lock);
+	pthread_cond_broadcast(&scanner.done);
+	pthread_mutex_unlock(&scanner.lock);
+	for (int i = 0; i < receiver_c; i++) {
+		atomic_store(&receivers[i].stop, 1);
+		sem_post(&receivers[i].ring.items);
+		pthread_join(receivers[i].dsp_thread, NULL);
+	}
+	/**! Holds since the last output are written at exit. */
+	if (hold.frame_c % _hold_interval)
+		write_holds();
+	do_exit();
 }
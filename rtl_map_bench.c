@@ -0,0 +1,360 @@
+/*
+ * rtl_map_bench, benchmarks of the rtl_map DSP path. (see rtlmap.h)
+ * Copyright (C) 2019-2023 by orhun <https://www.github.com/orhun>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "rtlmap.h"
+
+#define MAX_FRAMES (1 << 20) /*!< Latency samples kept per stage */
+#define MAX_SIZES 16 /*!< Maximum FFT size count for -N */
+
+/**!
+ * 'Stage' is a benchmarked step of the DSP path.
+ * run() processes one frame and returns the number of
+ * samples (or bins) that it processed.
+ */
+typedef struct Stage {
+	const char *name; /*!< Stage name in the output */
+	long (*run)(FFTEngine *engine); /*!< Processes one frame */
+} Stage;
+static uint8_t *iq_buf; /*!< I/Q samples (synthetic or -i) */
+static size_t iq_len, /*!< Length of 'iq_buf' (bytes) */
+	iq_pos; /*!< Position of the next frame in 'iq_buf' */
+static uint32_t buf_len; /*!< USB buffer length of the current FFT size */
+static FILE *sink; /*!< Output of the sink stages (/dev/null) */
+static int64_t *latency; /*!< Frame latencies of the current stage (ns) */
+static PeakTracker peaks; /*!< Peak tracker of the current FFT size */
+static FFTEngine zoom_engine; /*!< Engine of the current FFT size with zoom (1/32) */
+static int _duration = 200, /*!< [ARG] Run time of each stage (ms) (optional) */
+	_sizes[MAX_SIZES] = {512, 1024, 4096, 16384, 65536}, /*!< [ARG] FFT sizes (optional) */
+	_size_c = 5, /*!< FFT size count */
+	_fft_threads = 1; /*!< [ARG] Threads of large FFTs (optional) */
+static char *_input_file; /*!< [ARG] Recorded I/Q file (optional, default: synthetic) */
+
+/*!
+ * Get monotonic time in nanoseconds.
+ *
+ * \return timestamp (ns)
+ */
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*!
+ * Get the next 'len' bytes of the I/Q samples.
+ * Starts again from the beginning at the end of the samples.
+ *
+ * \param len length (must not be larger than the samples)
+ * \return I/Q samples
+ */
+static uint8_t *next_samples(size_t len){
+	if (iq_pos + len > iq_len)
+		iq_pos = 0;
+	uint8_t *buf = iq_buf + iq_pos;
+	iq_pos += len;
+	return buf;
+}
+/*!
+ * Create synthetic I/Q samples: a tone at +1/8 of the sample rate
+ * and uniform noise, like the 8-bit output of the device.
+ *
+ * \param len length (bytes)
+ * \return 0 on success
+ */
+static int create_samples(size_t len){
+	iq_len = len;
+	iq_buf = malloc(iq_len);
+	if (!iq_buf) {
+		log_fatal("Failed to allocate samples.\n");
+		exit(1);
+	}
+	srand(1);
+	for (size_t i = 0; i + 1 < iq_len; i += 2) {
+		double phase = M_PI / 4 * (i / 2);
+		iq_buf[i] = (uint8_t)(127.4 + 50 * cos(phase) + rand() % 7 - 3);
+		iq_buf[i+1] = (uint8_t)(127.4 + 50 * sin(phase) + rand() % 7 - 3);
+	}
+	return 0;
+}
+/*!
+ * Load recorded I/Q samples into memory. (see -i)
+ * Exits on failure at reading the file.
+ *
+ * \param filename I/Q file (rtl_sdr format)
+ * \return 0 on success
+ */
+static int load_samples(char *filename){
+	FILE *fp = fopen(filename, "rb");
+	if (!fp || fseek(fp, 0, SEEK_END) || (iq_len = ftell(fp)) < 2) {
+		log_fatal("Failed to read %s\n", filename);
+		exit(1);
+	}
+	rewind(fp);
+	iq_buf = malloc(iq_len);
+	if (!iq_buf || fread(iq_buf, 1, iq_len, fp) != iq_len) {
+		log_fatal("Failed to read %s\n", filename);
+		exit(1);
+	}
+	fclose(fp);
+	return 0;
+}
+/*!
+ * I/Q conversion of one FFT segment.
+ */
+static long run_convert(FFTEngine *engine){
+	rtlmap_convert(next_samples(2 * engine->size), engine->in, NULL, NULL, engine->size);
+	return engine->size;
+}
+/*!
+ * I/Q conversion of one FFT segment with DC and I/Q imbalance correction.
+ */
+static long run_convert_correct(FFTEngine *engine){
+	rtlmap_convert(next_samples(2 * engine->size), engine->in, NULL, &engine->corr, engine->size);
+	rtlmap_update_correction(&engine->corr);
+	return engine->size;
+}
+/*!
+ * I/Q conversion and windowing of one FFT segment. (Hann)
+ */
+static long run_convert_window(FFTEngine *engine){
+	rtlmap_convert(next_samples(2 * engine->size), engine->in, engine->window, NULL, engine->size);
+	return engine->size;
+}
+/*!
+ * FFT execution of one segment. (plan of the engine)
+ */
+static long run_fft(FFTEngine *engine){
+	FFTW(execute)(engine->plan);
+	return engine->size;
+}
+/*!
+ * Whole Welch path of one USB buffer. (convert + correct + window -> FFT -> |X|^2 -> average)
+ */
+static long run_process(FFTEngine *engine){
+	rtlmap_process(engine, next_samples(buf_len), buf_len);
+	return buf_len / 2;
+}
+/*!
+ * Zoomed Welch path of one USB buffer. (mix -> filter -> decimate -> FFT)
+ */
+static long run_zoom(FFTEngine *engine){
+	rtlmap_process(&zoom_engine, next_samples(buf_len), buf_len);
+	return buf_len / 2;
+}
+/*!
+ * dB reduction of one spectrum.
+ */
+static long run_reduce_db(FFTEngine *engine){
+	rtlmap_reduce(engine->avg, engine->bins, engine->size, 0);
+	return engine->size;
+}
+/*!
+ * Magnitude reduction of one spectrum.
+ */
+static long run_reduce_mag(FFTEngine *engine){
+	rtlmap_reduce(engine->avg, engine->bins, engine->size, 1);
+	return engine->size;
+}
+/*!
+ * Peak detection and tracking of one spectrum. (8 peaks, see -P arg. of rtl_map)
+ */
+static long run_peaks(FFTEngine *engine){
+	rtlmap_track_peaks(&peaks, engine->avg);
+	return engine->size;
+}
+/*!
+ * Text output of one spectrum. ('bin  value' lines)
+ */
+static long run_sink_text(FFTEngine *engine){
+	for (int i = 0; i < engine->size; i++)
+		fprintf(sink, "%d	%f\n", i+1, engine->bins[i]);
+	return engine->size;
+}
+/*!
+ * Binary output of one spectrum. (see -B arg. of rtl_map)
+ */
+static long run_sink_binary(FFTEngine *engine){
+	rtlmap_write_spectrum_record(sink, engine->bins, engine->size, 0, rtlmap_timestamp_ns());
+	return engine->size;
+}
+static Stage stages[] = {
+	{"convert", run_convert},
+	{"convert_window", run_convert_window},
+	{"convert_correct", run_convert_correct},
+	{"fft", run_fft},
+	{"process", run_process},
+	{"zoom", run_zoom},
+	{"reduce_db", run_reduce_db},
+	{"reduce_mag", run_reduce_mag},
+	{"peaks", run_peaks},
+	{"sink_text", run_sink_text},
+	{"sink_binary", run_sink_binary},
+};
+/*!
+ * Compare two latencies for qsort function.
+ */
+static int cmp_latency(const void *a, const void *b){
+	int64_t la = *(const int64_t*)a, lb = *(const int64_t*)b;
+	return (la > lb) - (la < lb);
+}
+/*!
+ * Run a stage for '_duration' ms and print its results.
+ * One warm-up frame is not counted.
+ *
+ * \param stage stage to run
+ * \param engine FFT engine of the current size
+ */
+static void run_stage(Stage *stage, FFTEngine *engine){
+	long frame_c = 0;
+	double sample_c = 0;
+	stage->run(engine);
+	int64_t start = now_ns(), end = start + (int64_t)_duration * 1000000, t = start;
+	while (t < end && frame_c < MAX_FRAMES) {
+		int64_t t_frame = t;
+		sample_c += stage->run(engine);
+		t = now_ns();
+		latency[frame_c++] = t - t_frame;
+	}
+	qsort(latency, frame_c, sizeof(int64_t), cmp_latency);
+	double ns = t - start;
+	printf("%s,%d,%s,%s,%ld,%.3f,%.2f,%.3f,%.3f\n", stage->name, engine->size,
+#ifdef FFT_FLOAT
+		"float",
+#else
+		"double",
+#endif
+		rtlmap_kernel_name(), frame_c, ns / sample_c, sample_c / ns * 1e3,
+		latency[frame_c / 2] / 1e3, latency[frame_c * 99 / 100] / 1e3);
+	fflush(stdout);
+}
+/*!
+ * Print usage and exit.
+ */
+static void print_usage(){
+	char *usage	= "rtl_map_bench, benchmarks of the rtl_map DSP path.\n\n"
+				  "Usage:\t[-N comma separated FFT sizes (default: 512,1024,4096,16384,65536)]\n"
+				  "\t[-t run time of each stage (default: 200ms)]\n"
+				  "\t[-i recorded I/Q file (default: synthetic samples)]\n"
+				  "\t[-j FFT threads for FFT sizes of 32768 or more (default: 1)]\n"
+				  "\t[-h show this help message and exit]\n\n"
+				  "Output (CSV): stage,fft_size,precision,kernels,frames,"
+				  "ns_per_sample,msps,p50_us,p99_us\n\n";
+	fprintf(stderr, "%s", usage);
+	exit(0);
+}
+/*!
+ * Parse command line arguments.
+ *
+ * \param argc argument count
+ * \param argv argument vector
+ * \return 0 on success
+ */
+static int parse_args(int argc, char **argv){
+	int opt;
+	while ((opt = getopt(argc, argv, "N:t:i:j:h")) != -1) {
+		switch (opt) {
+			case 'N':
+				_size_c = 0;
+				for (char *size = strtok(optarg, ","); size; size = strtok(NULL, ",")) {
+					if (_size_c == MAX_SIZES || atoi(size) < 2 || atoi(size) > MAX_FFT_SIZE)
+						print_usage();
+					_sizes[_size_c++] = atoi(size);
+				}
+				break;
+			case 't':
+				_duration = atoi(optarg);
+				if (_duration < 1)
+					print_usage();
+				break;
+			case 'i':
+				_input_file = optarg;
+				break;
+			case 'j':
+				_fft_threads = atoi(optarg);
+				if (_fft_threads < 1)
+					print_usage();
+				break;
+			default:
+				print_usage();
+				break;
+		}
+	}
+	if (!_size_c)
+		print_usage();
+	return 0;
+}
+/*!
+ * Entry point (main)
+ * Runs every stage for each FFT size.
+ *
+ * \param argc argument count
+ * \param argv argument vector
+ */
+int main(int argc, char **argv){
+	RtlMapConfig config = RTLMAP_DEFAULT_CONFIG;
+	FFTEngine engine;
+	size_t max_len = 0;
+	parse_args(argc, argv);
+	config.fft_threads = _fft_threads;
+	for (int i = 0; i < _size_c; i++)
+		if ((size_t)rtlmap_buffer_length(_sizes[i]) > max_len)
+			max_len = rtlmap_buffer_length(_sizes[i]);
+	if (_input_file != NULL)
+		load_samples(_input_file);
+	else
+		create_samples(4 * max_len);
+	if (iq_len < max_len) {
+		log_fatal("Input has less samples than a USB buffer (%zu bytes).\n", max_len);
+		exit(1);
+	}
+	latency = malloc(sizeof(int64_t) * MAX_FRAMES);
+	sink = fopen("/dev/null", "w");
+	if (!latency || !sink) {
+		log_fatal("Failed to allocate benchmark buffers.\n");
+		exit(1);
+	}
+	setvbuf(sink, NULL, _IOFBF, 1 << 20);
+	printf("stage,fft_size,precision,kernels,frames,ns_per_sample,msps,p50_us,p99_us\n");
+	for (int i = 0; i < _size_c; i++) {
+		config.fft_size = _sizes[i];
+		buf_len = rtlmap_buffer_length(_sizes[i]);
+		RtlMapConfig zoom_config = config;
+		zoom_config.decimation = 32;
+		zoom_config.zoom_offset = config.sample_rate / 8;
+		if (rtlmap_engine_create(&engine, &config) ||
+			rtlmap_engine_create(&zoom_engine, &zoom_config) ||
+			rtlmap_peaks_create(&peaks, _sizes[i], 8, 10))
+			exit(1);
+		/**! Spectrum for the reduce and sink stages. */
+		rtlmap_process(&engine, next_samples(buf_len), buf_len);
+		rtlmap_reduce(engine.avg, engine.bins, engine.size, 0);
+		for (size_t j = 0; j < sizeof(stages) / sizeof(stages[0]); j++)
+			run_stage(&stages[j], &engine);
+		rtlmap_engine_destroy(&engine);
+		rtlmap_engine_destroy(&zoom_engine);
+		rtlmap_peaks_destroy(&peaks);
+	}
+	fclose(sink);
+	free(latency);
+	free(iq_buf);
+	return 0;
+}
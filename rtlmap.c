@@ -0,0 +1,2392 @@
+/*
+ * librtlmap, FFT pipeline of rtl_map for RTL-SDR devices. (RTL2832/DVB-T)
+ * Copyright (C) 2019-2023 by orhun <https://www.github.com/orhun>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <time.h>
+#include <limits.h>
+#include <float.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+#include "rtlmap.h"
+
+#define IQ_OFFSET 127.34 /*!< Sample value of zero signal */
+#define MIN_POWER 1e-30f /*!< |X|^2 is clamped to this value (-300 dB) for log */
+#define DB_PER_LOG2 3.01029996f /*!< 10*log10(x) = DB_PER_LOG2 * log2(x) */
+#define FLOOR_ALPHA 0.1f /*!< Smoothing factor of the noise floor across frames */
+#define PEAK_DISTANCE 2 /*!< Bins that a tracked peak may move between frames */
+#define PEAK_MAX_MISSED 3 /*!< Frames without the peak before it is lost */
+#define CHANGE_FRAMES 32 /*!< Time constant of the baselines of the change trigger (frames) */
+#define CHANGE_SIGMA 3.0f /*!< Standard deviations above the mean for a changed bin */
+#define CHANGE_SLOW 8 /*!< Bins above the baseline adapt this many times slower */
+#define IQ_TIME_CONSTANT 0.1 /*!< Time constant of the I/Q correction estimates (s) */
+#define ZOOM_TAPS_PER_PHASE 16 /*!< Filter taps per output sample of the zoom */
+#define ZOOM_KAISER_BETA 8.0 /*!< Kaiser window of the zoom filter (~80 dB stopband) */
+#define ZOOM_CHUNK 16384 /*!< Samples converted at once by the zoom (see zoom_process) */
+#define HOLD_CHUNK 1024 /*!< Bins reduced at once by rtlmap_reduce_hold(), stay in L1 for the holds */
+#define PGM_HEIGHT_DIGITS 10 /*!< Width of the height field in PGM headers (see rtlmap_write_pgm_header) */
+
+static int log_colors = 1; /*!< Use colored flags while logging */
+static char *log_levels[] = { 
+		"INFO", "ERROR", "FATAL" /*!< Log levels */
+	},
+	*level_colors[] = {
+		"\x1b[92m", "\x1b[91m", "\x1b[33m" /*!< Log level colors (green, red, yellow) */
+	},
+	*bold_attr = "\x1b[1m", /*!< Enable bold text in terminal */
+	*all_attr_off = "\x1b[0m"; /*!< Clear previous attributes in terminal */
+/**!
+ * I/Q conversion kernel, converts 'sample_c' interleaved
+ * unsigned 8-bit I/Q pairs to complex samples.
+ * Selected at runtime by select_kernels().
+ */
+typedef void (*convert_kernel)(const uint8_t *buf, fft_complex *in, 
+	const fft_real *window, IQCorrection *corr, int sample_c);
+static convert_kernel convert_iq; /*!< Kernel used by rtlmap_process() */
+/**!
+ * Power to dB kernel, computes 10*log10(|X|^2) of 'bin_c' bins.
+ * Selected at runtime by select_kernels().
+ */
+typedef void (*db_kernel)(const float *power, float *db, int bin_c);
+static db_kernel power_to_db; /*!< Kernel used by rtlmap_reduce() */
+static fft_real iq_lut[256]; /*!< Sample value -> real value lookup table */
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT; /*!< See rtlmap_init() */
+
+static const char *kernel_name; /*!< Name of the selected kernels (lut, sse2, avx2, neon) */
+static const char *window_names[] = {
+	"rect", "hann", "blackman-harris", "flattop", "kaiser"
+}; /*!< Names of the window functions (see enum window_type) */
+
+/*!
+ * Print log message with time, level and text.
+ * Also supports format specifiers.
+ *
+ * \param level logging level (info:0, error:1, fatal:2)
+ * \param format string and format specifiers for vfprintf function  
+ * \return 0 on success
+ */
+int rtlmap_log(int level, char *format, ...){
+	char t_buf[16];
+	va_list vargs;
+	time_t raw_time = time(NULL);
+	struct tm local_time;
+	localtime_r(&raw_time, &local_time);
+	t_buf[strftime(t_buf, sizeof(t_buf), 
+			"%H:%M:%S", &local_time)] = '\0';
+	if (log_colors)
+		fprintf(stderr, "%s[%s] %s%s%s ", 
+		bold_attr, 
+		t_buf, 
+		level_colors[level], 
+		log_levels[level], 
+		all_attr_off);
+	else
+		fprintf(stderr, "[%s] %s ", 
+		t_buf, 
+		log_levels[level]);
+  	va_start(vargs, format);
+  	vfprintf(stderr, format, vargs);
+  	va_end(vargs);
+	return 0;
+}
+/*!
+ * Enable or disable colored flags while logging.
+ *
+ * \param enabled 0 for plain text
+ */
+void rtlmap_set_log_colors(int enabled){
+	log_colors = enabled;
+}
+/*!
+ * Find the default wisdom file in the user's cache directory.
+ * ($XDG_CACHE_HOME/rtl_map/wisdom or ~/.cache/rtl_map/wisdom)
+ * Single-precision wisdom is saved as 'wisdomf', like FFTW does.
+ * Creates the rtl_map directory if it does not exist.
+ *
+ * \param wisdom_path path buffer (PATH_MAX bytes)
+ * \return path of the wisdom file
+ * \return NULL if there is no usable cache directory
+ */
+static char *default_wisdom_file(char *wisdom_path){
+	char *cache_dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	if (cache_dir != NULL && cache_dir[0] != '\0')
+		snprintf(wisdom_path, PATH_MAX, "%s/rtl_map", cache_dir);
+	else if (home != NULL && home[0] != '\0') {
+		snprintf(wisdom_path, PATH_MAX, "%s/.cache", home);
+		mkdir(wisdom_path, 0755);
+		snprintf(wisdom_path, PATH_MAX, "%s/.cache/rtl_map", home);
+	} else
+		return NULL;
+	if (mkdir(wisdom_path, 0755) && errno != EEXIST)
+		return NULL;
+	strncat(wisdom_path, "/" WISDOM_FILE_NAME, PATH_MAX - strlen(wisdom_path) - 1);
+	return wisdom_path;
+}
+/*!
+ * Save the accumulated FFTW wisdom to the given file.
+ * Wisdom is written to a temporary file first and then renamed,
+ * so concurrently starting instances never read a partial file.
+ *
+ * \param filename wisdom file
+ * \return 0 on success
+ * \return 1 on failure
+ */
+static int export_wisdom(const char *filename){
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", filename, (int)getpid());
+	if (!FFTW(export_wisdom_to_filename)(tmp_path) || rename(tmp_path, filename)) {
+		remove(tmp_path);
+		log_error("Failed to save FFTW wisdom to %s\n", filename);
+		return 1;
+	}
+	return 0;
+}
+/*!
+ * Compute the zeroth order modified Bessel function of the
+ * first kind for the Kaiser window. [I0(x) = sum((x/2)^2k / (k!)^2)]
+ *
+ * \param x argument
+ * \return I0(x)
+ */
+static double bessel_i0(double x){
+	double sum = 1, term = 1, q = x * x / 4;
+	for (int k = 1; term > sum * 1e-12; k++) {
+		term *= q / ((double)k * k);
+		sum += term;
+	}
+	return sum;
+}
+/*!
+ * Compute the window coefficient of a sample.
+ * Windows are periodic (DFT-even, denominator N), so the window
+ * of the next segment would continue the cosine terms smoothly.
+ * Blackman-Harris is the 4-term, -92 dB version, flat-top is the
+ * 5-term version of MATLAB/SciPy (0.01 dB amplitude error).
+ *
+ * \param window window function (see enum window_type)
+ * \param beta shape parameter of the Kaiser window
+ * \param n sample index
+ * \param size FFT size
+ * \return coefficient
+ */
+static double window_value(int window, double beta, int n, int size){
+	double x = 2 * M_PI * n / size;
+	switch (window) {
+		case WINDOW_HANN:
+			return 0.5 - 0.5 * cos(x);
+		case WINDOW_BLACKMAN_HARRIS:
+			return 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2 * x) - 0.01168 * cos(3 * x);
+		case WINDOW_FLATTOP:
+			return 0.21557895 - 0.41663158 * cos(x) + 0.277263158 * cos(2 * x) -
+				0.083578947 * cos(3 * x) + 0.006947368 * cos(4 * x);
+		case WINDOW_KAISER: {
+			double r = 2.0 * n / size - 1;
+			return bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta);
+		}
+		default:
+			return 1;
+	}
+}
+/*!
+ * Compute the equivalent noise bandwidth of a window.
+ * [ENBW = N * sum(w^2) / sum(w)^2 bins]
+ *
+ * \param window window function (see enum window_type)
+ * \param beta shape parameter of the Kaiser window
+ * \param size FFT size
+ * \return ENBW (bins)
+ */
+static double window_enbw(int window, double beta, int size){
+	double sum = 0, sum_sq = 0;
+	for (int i = 0; i < size; i++) {
+		double w = window_value(window, beta, i, size);
+		sum += w;
+		sum_sq += w * w;
+	}
+	return size * sum_sq / (sum * sum);
+}
+/*!
+ * Compute the window table of the engine once for its FFT size.
+ * Each coefficient is stored twice (I and Q) so the conversion
+ * kernels multiply the interleaved samples without shuffling.
+ * Coefficients are divided by the coherent gain (mean of the window),
+ * so tones keep the level they have without a window. The noise
+ * floor rises by the ENBW instead, which is logged and written to
+ * the spectrum file header. [coherent gain = sum(w) / N]
+ *
+ * \param engine FFT engine
+ * \param window window function (see enum window_type)
+ * \param beta shape parameter of the Kaiser window
+ * \return 0 on success
+ * \return 1 on unknown window or failure at allocating memory
+ */
+static int create_window(FFTEngine *engine, int window, float beta){
+	int size = engine->size;
+	double sum = 0;
+	engine->coherent_gain = 1;
+	engine->enbw = 1;
+	if (window < WINDOW_RECT || window > WINDOW_KAISER) {
+		log_fatal("Unknown window function (%d).\n", window);
+		return 1;
+	}
+	if (window == WINDOW_RECT)
+		return 0;
+	engine->window = (fft_real*) FFTW(malloc)(sizeof(fft_real) * 2 * size);
+	if (!engine->window) {
+		log_fatal("Failed to allocate window table.\n");
+		return 1;
+	}
+	for (int i = 0; i < size; i++) {
+		double w = window_value(window, beta, i, size);
+		engine->window[2*i] = w;
+		sum += w;
+	}
+	engine->coherent_gain = sum / size;
+	engine->enbw = window_enbw(window, beta, size);
+	for (int i = 0; i < size; i++)
+		engine->window[2*i] = engine->window[2*i+1] = 
+			engine->window[2*i] / engine->coherent_gain;
+	log_info("Using %s window (coherent gain: %.2f dB, ENBW: %.3f bins, %.2f dB)\n",
+		window_names[window], 20 * log10(engine->coherent_gain), 
+		engine->enbw, 10 * log10(engine->enbw));
+	return 0;
+}
+/*!
+ * Create the filter and buffers of the zoom. (see ZoomFilter)
+ * The low-pass filter is a Kaiser windowed sinc with its cutoff at the
+ * edge of the decimated band and unity gain at DC. Bins close to the
+ * edges are attenuated, the stopband starts at the first aliased bin.
+ *
+ * \param engine FFT engine
+ * \param config sample rate, zoom offset and decimation
+ * \return 0 on success
+ * \return 1 on failure at allocating memory
+ */
+static int create_zoom(FFTEngine *engine, const RtlMapConfig *config){
+	ZoomFilter *zoom = &engine->zoom;
+	zoom->decimation = config->decimation > 1 ? config->decimation : 1;
+	if (zoom->decimation == 1)
+		return 0;
+	int tap_c = zoom->tap_c = zoom->decimation * ZOOM_TAPS_PER_PHASE;
+	zoom->taps = (fft_real*) FFTW(malloc)(sizeof(fft_real) * 2 * tap_c);
+	zoom->in = (fft_complex*) FFTW(malloc)(sizeof(fft_complex) * (tap_c - 1 + ZOOM_CHUNK));
+	zoom->out = (fft_complex*) FFTW(malloc)(sizeof(fft_complex) * engine->size);
+	if (!zoom->taps || !zoom->in || !zoom->out) {
+		log_fatal("Failed to allocate zoom filter.\n");
+		return 1;
+	}
+	memset(zoom->in, 0, sizeof(fft_complex) * (tap_c - 1));
+	double omega = 2 * M_PI * config->zoom_offset / config->sample_rate,
+		cutoff = 0.5 / zoom->decimation, sum = 0;
+	for (int k = 0; k < tap_c; k++) {
+		double t = k - (tap_c - 1) / 2.0, r = 2.0 * k / (tap_c - 1) - 1;
+		double h = (t == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t)) * 
+			bessel_i0(ZOOM_KAISER_BETA * sqrt(1 - r * r)) / bessel_i0(ZOOM_KAISER_BETA);
+		sum += h;
+		/**! Reversed, so the taps and the samples are read in the same direction. */
+		zoom->taps[2 * (tap_c - 1 - k)] = h * cos(omega * k);
+		zoom->taps[2 * (tap_c - 1 - k) + 1] = h * sin(omega * k);
+	}
+	for (int k = 0; k < 2 * tap_c; k++)
+		zoom->taps[k] /= sum;
+	zoom->next = tap_c - 1;
+	zoom->out_c = 0;
+	zoom->rot_re = 1;
+	zoom->rot_im = 0;
+	zoom->step_re = cos(omega * zoom->decimation);
+	zoom->step_im = -sin(omega * zoom->decimation);
+	log_info("Zoom: %+d Hz, 1/%d decimation (%d taps), %.2f Hz per bin\n", 
+		config->zoom_offset, zoom->decimation, tap_c, 
+		(double)config->sample_rate / zoom->decimation / engine->size);
+	return 0;
+}
+#ifdef FFTW_THREADS
+static int fftw_threads_ok = 0; /*!< FFTW threads are initialized (see init_fftw_threads) */
+/*!
+ * Initialize the threads of FFTW. (once per process)
+ */
+static void init_fftw_threads(){
+	fftw_threads_ok = FFTW(init_threads)() != 0;
+	if (!fftw_threads_ok)
+		log_error("Failed to initialize FFTW threads.\n");
+}
+#endif
+/*!
+ * Get the thread count of the plan of an FFT. (see -t arg.)
+ * Threads only help the large FFTs, (narrow RBW) so smaller ones
+ * and builds without fftw3(f)_threads use a single thread.
+ *
+ * \param config FFT size and threads
+ * \return thread count
+ */
+static int plan_threads(const RtlMapConfig *config){
+	if (config->fft_threads <= 1 || config->fft_size < FFT_THREADS_MIN_SIZE)
+		return 1;
+#ifdef FFTW_THREADS
+	static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+	pthread_once(&threads_once, init_fftw_threads);
+	return fftw_threads_ok ? config->fft_threads : 1;
+#else
+	log_error("FFTW is built without threads, using a single thread.\n");
+	return 1;
+#endif
+}
+/*!
+ * Allocate the 'in' and 'out' arrays and create the FFT plan.
+ *
+ * \param engine FFT engine to initialize
+ * \param config FFT size, overlap, averaging and planner settings
+ * \return 0 on success
+ * \return 1 on failure at allocating memory or planning
+ */
+int rtlmap_engine_create(FFTEngine *engine, const RtlMapConfig *config){
+	int size = config->fft_size;
+	rtlmap_init();
+	memset(engine, 0, sizeof(FFTEngine));
+	engine->size = size;
+	engine->avg_mode = config->avg_mode;
+	engine->avg_alpha = config->avg_alpha;
+	/**! 
+	 * fft_complex type is a basically fft_real[2] that composed of the 
+	 * real (in[i][0]) and imaginary (in[i][1]) parts of a complex number.
+	 * in -> Complex numbers processed from 8-bit I/Q values.
+	 * out -> Output of FFT (computed from complex input).
+	 * FFTW(malloc) returns memory aligned for SIMD.
+	 */
+	engine->in = (fft_complex*) FFTW(malloc)(sizeof(fft_complex)*size);
+	engine->out = (fft_complex*) FFTW(malloc)(sizeof(fft_complex)*size);
+	engine->psd = (float*) FFTW(malloc)(sizeof(float)*size);
+	engine->avg = (float*) FFTW(malloc)(sizeof(float)*size);
+	engine->bins = (float*) FFTW(malloc)(sizeof(float)*size);
+	engine->hop = size - size * config->overlap / 100;
+	if (engine->hop < 1)
+		engine->hop = 1;
+	engine->avg_c = 0;
+	if (!engine->in || !engine->out || !engine->psd || !engine->avg || !engine->bins) {
+		log_fatal("Failed to allocate FFT buffers.\n");
+		rtlmap_engine_destroy(engine);
+		return 1;
+	}
+	memset(engine->avg, 0, sizeof(float)*size);
+	if (create_window(engine, config->window, config->window_beta)) {
+		rtlmap_engine_destroy(engine);
+		return 1;
+	}
+	engine->correct = config->iq_correction;
+	engine->corr.gain = 1;
+	engine->corr.time_constant = (long)(config->sample_rate * IQ_TIME_CONSTANT);
+	if (create_zoom(engine, config)) {
+		rtlmap_engine_destroy(engine);
+		return 1;
+	}
+	/**!
+	 * Declare FFTW plan which is responsible for having in and out data.
+	 * First parameter (size) -> FFT size 
+	 * FFTW_FORWARD/FFTW_BACKWARD -> Indicates the direction of the transform.
+	 * Technically, sign of the exponent in the transform.
+	 * FFTW_ESTIMATE/FFTW_MEASURE/FFTW_PATIENT/FFTW_EXHAUSTIVE (see -p arg.)
+	 * Use FFTW_MEASURE if you want to execute several FFTs and find the 
+	 * best computation in certain amount of time. (Usually a few seconds)
+	 * FFTW_ESTIMATE is the contrary. Does not run any computation, just
+	 * builds a reasonable plan.
+	 * Since the plan is created only once and reused for every
+	 * frame, FFTW_MEASURE is the default. (It overwrites 'in' while planning.)
+	 *
+	 * Planning results are cached as 'wisdom' on disk. If the wisdom file
+	 * already knows a plan for this size and effort, FFTW_WISDOM_ONLY
+	 * returns it without measuring anything.
+	 * Threaded plans (see -t) are different plans in the wisdom.
+	 */
+	int threads = plan_threads(config);
+#ifdef FFTW_THREADS
+	if (fftw_threads_ok)
+		FFTW(plan_with_nthreads)(threads);
+#endif
+	char wisdom_path[PATH_MAX];
+	const char *wisdom_file = config->wisdom_file ? config->wisdom_file : 
+		default_wisdom_file(wisdom_path);
+	if (wisdom_file != NULL && FFTW(import_wisdom_from_filename)(wisdom_file))
+		log_info("Loaded FFTW wisdom from %s\n", wisdom_file);
+	struct timespec t_start, t_end;
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	engine->plan = FFTW(plan_dft_1d)(size, engine->in, engine->out, 
+		FFTW_FORWARD, config->fft_flags | FFTW_WISDOM_ONLY);
+	int from_wisdom = engine->plan != NULL;
+	if (!from_wisdom)
+		engine->plan = FFTW(plan_dft_1d)(size, engine->in, engine->out, 
+			FFTW_FORWARD, config->fft_flags);
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	if (!engine->plan) {
+		log_fatal("Failed to create FFT plan.\n");
+		rtlmap_engine_destroy(engine);
+		return 1;
+	}
+	char threads_note[32] = "";
+	if (threads > 1)
+		snprintf(threads_note, sizeof(threads_note), ", %d threads", threads);
+	log_info("FFT plan (%d points%s) %s in %.3f ms\n", size, threads_note,
+		from_wisdom ? "loaded from wisdom" : "created",
+		(t_end.tv_sec - t_start.tv_sec) * 1e3 + 
+		(t_end.tv_nsec - t_start.tv_nsec) / 1e6);
+	if (!from_wisdom && wisdom_file != NULL)
+		export_wisdom(wisdom_file);
+	return 0;
+}
+/*!
+ * Deallocate FFT plan.
+ * Free 'in', 'out' and spectrum memory regions.
+ *
+ * \param engine FFT engine to destroy
+ */
+void rtlmap_engine_destroy(FFTEngine *engine){
+	if (engine->plan)
+		FFTW(destroy_plan)(engine->plan);
+	FFTW(free)(engine->in);
+	FFTW(free)(engine->out);
+	FFTW(free)(engine->window);
+	FFTW(free)(engine->zoom.taps);
+	FFTW(free)(engine->zoom.in);
+	FFTW(free)(engine->zoom.out);
+	FFTW(free)(engine->psd);
+	FFTW(free)(engine->avg);
+	FFTW(free)(engine->bins);
+	memset(engine, 0, sizeof(FFTEngine));
+}
+/*!
+ * Allocate the slots of the ring buffer.
+ *
+ * \param ring ring buffer to initialize
+ * \param slots slot count
+ * \param slot_len size of one slot (USB buffer length)
+ * \return 0 on success
+ * \return 1 on failure at allocating memory
+ */
+int rtlmap_ring_init(RingBuffer *ring, unsigned int slots, uint32_t slot_len){
+	/**! Aligned slots can be written to disk with O_DIRECT. (see IQRecorder) */
+	ring->slots = slots;
+	ring->slot_len = (slot_len + RING_ALIGN - 1) / RING_ALIGN * RING_ALIGN;
+	ring->recorded = 0;
+	if (posix_memalign((void **)&ring->data, RING_ALIGN, (size_t)slots * ring->slot_len))
+		ring->data = NULL;
+	ring->len = calloc(slots, sizeof(uint32_t));
+	ring->tag = calloc(slots, sizeof(uint32_t));
+	ring->time_ns = calloc(slots, sizeof(int64_t));
+	if (!ring->data || !ring->len || !ring->tag || !ring->time_ns) {
+		log_fatal("Failed to allocate ring buffer.\n");
+		rtlmap_ring_free(ring);
+		return 1;
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->rec_tail, 0);
+	atomic_init(&ring->received, 0);
+	atomic_init(&ring->overruns, 0);
+	atomic_init(&ring->dropped, 0);
+	ring->metrics = NULL;
+	ring->last_commit_ns = 0;
+	sem_init(&ring->items, 0, 0);
+	return 0;
+}
+/*!
+ * Free the slots of the ring buffer.
+ *
+ * \param ring ring buffer to free
+ */
+void rtlmap_ring_free(RingBuffer *ring){
+	free(ring->data);
+	free(ring->len);
+	free(ring->tag);
+	free(ring->time_ns);
+	if (ring->slots)
+		sem_destroy(&ring->items);
+	if (ring->recorded)
+		sem_destroy(&ring->rec_items);
+	ring->recorded = 0;
+	ring->data = NULL;
+	ring->len = NULL;
+	ring->tag = NULL;
+	ring->time_ns = NULL;
+	ring->slots = 0;
+}
+/*!
+ * Get the next free slot for writing samples in place. (producer side)
+ * Slot must be published with rtlmap_ring_commit().
+ *
+ * \param ring ring buffer
+ * \return slot memory (slot_len bytes)
+ * \return NULL if the ring is full
+ */
+uint8_t *rtlmap_ring_reserve(RingBuffer *ring){
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail >= ring->slots || (ring->recorded && 
+		head - atomic_load_explicit(&ring->rec_tail, memory_order_acquire) >= ring->slots))
+		return NULL;
+	return ring->data + (size_t)(head % ring->slots) * ring->slot_len;
+}
+/*!
+ * Record a received buffer in the metrics of the ring. (producer side)
+ * Lost buffers are counted too, so the interval is the one of the device.
+ *
+ * \param ring ring buffer with metrics
+ * \param len length of the buffer
+ * \param now time of the buffer (ns, see rtlmap_clock_ns)
+ */
+static void record_buffer(RingBuffer *ring, uint32_t len, int64_t now){
+	if (ring->last_commit_ns)
+		rtlmap_metrics_record(ring->metrics, METRIC_USB_INTERVAL, now - ring->last_commit_ns);
+	ring->last_commit_ns = now;
+	atomic_fetch_add_explicit(&ring->metrics->samples, len / 2, memory_order_relaxed);
+}
+/*!
+ * Publish the slot returned by rtlmap_ring_reserve(). (producer side)
+ *
+ * \param ring ring buffer
+ * \param len length of the samples in slot
+ * \param tag tag of the slot
+ */
+void rtlmap_ring_commit(RingBuffer *ring, uint32_t len, uint32_t tag){
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int slot = head % ring->slots;
+	ring->len[slot] = len;
+	ring->tag[slot] = tag;
+	ring->time_ns[slot] = rtlmap_clock_ns();
+	atomic_fetch_add_explicit(&ring->received, 1, memory_order_relaxed);
+	if (ring->metrics != NULL)
+		record_buffer(ring, len, ring->time_ns[slot]);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	sem_post(&ring->items);
+	if (ring->recorded)
+		sem_post(&ring->rec_items);
+}
+/*!
+ * Copy samples into the next free slot. (producer side)
+ * Never blocks, the buffer is counted as an overrun
+ * if the consumer did not free any slot yet.
+ *
+ * \param ring ring buffer
+ * \param buf samples to copy
+ * \param len length of buffer
+ * \param tag tag of the slot
+ * \return 0 on success
+ * \return 1 if the ring is full
+ */
+int rtlmap_ring_push(RingBuffer *ring, const uint8_t *buf, uint32_t len, uint32_t tag){
+	uint8_t *slot = rtlmap_ring_reserve(ring);
+	if (!slot) {
+		atomic_fetch_add_explicit(&ring->received, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+		if (ring->metrics != NULL)
+			record_buffer(ring, len, rtlmap_clock_ns());
+		return 1;
+	}
+	if (len > ring->slot_len)
+		len = ring->slot_len;
+	memcpy(slot, buf, len);
+	rtlmap_ring_commit(ring, len, tag);
+	return 0;
+}
+/*!
+ * Get the oldest filled slot without removing it. (consumer side)
+ *
+ * \param ring ring buffer
+ * \param len length of the samples in slot (output)
+ * \param tag tag of the slot (output)
+ * \return slot memory
+ * \return NULL if the ring is empty
+ */
+uint8_t *rtlmap_ring_peek(RingBuffer *ring, uint32_t *len, uint32_t *tag){
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (head == tail)
+		return NULL;
+	unsigned int slot = tail % ring->slots;
+	*len = ring->len[slot];
+	*tag = ring->tag[slot];
+	return ring->data + (size_t)slot * ring->slot_len;
+}
+/*!
+ * Get the time of the slot returned by rtlmap_ring_peek(). (consumer side)
+ * Slots are timed when they are filled, so the time does not
+ * depend on how long the slot waited for the consumer.
+ *
+ * \param ring ring buffer (not empty)
+ * \return time of the slot (ns, see rtlmap_clock_ns)
+ */
+int64_t rtlmap_ring_time(const RingBuffer *ring){
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	return ring->time_ns[tail % ring->slots];
+}
+/*!
+ * Release the slot returned by rtlmap_ring_peek(). (consumer side)
+ * A recorder that is waiting for a trigger keeps its slots relative
+ * to this tail, it is woken up if the ring is full of its slots,
+ * since the producer cannot commit and wake it then.
+ *
+ * \param ring ring buffer
+ */
+void rtlmap_ring_pop(RingBuffer *ring){
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	if (ring->recorded && atomic_load_explicit(&ring->head, memory_order_acquire) - 
+			atomic_load_explicit(&ring->rec_tail, memory_order_acquire) >= ring->slots)
+		sem_post(&ring->rec_items);
+}
+/*!
+ * List the supported devices.
+ *
+ * \return device count (0 if there is no device)
+ */
+int rtlmap_list_devices(){
+	int device_count = rtlsdr_get_device_count();
+	if (!device_count) {
+		log_error("No supported devices found.\n");
+		return 0;
+	}
+	log_info("Found %d device(s):\n", device_count);
+	for(int i = 0; i < device_count; i++){
+		if(log_colors)
+			log_info("#%d: %s%s%s\n", i, bold_attr, rtlsdr_get_device_name(i), all_attr_off);
+		else
+			log_info("#%d: %s\n", i, rtlsdr_get_device_name(i));
+	}
+	return device_count;
+}
+/*!
+ * Open the RTL-SDR device and configure it according to the
+ * given settings. The selected gain is stored in the config.
+ *
+ * \param dev opened device (output)
+ * \param dev_id device index
+ * \param center_freq center frequency (Hz)
+ * \param config sample rate, gain and offset tuning settings
+ * \return 0 on success
+ * \return 1 on failure at opening the device or buffer reset error
+ */
+int rtlmap_open_device(rtlsdr_dev_t **dev_out, int dev_id, int center_freq, RtlMapConfig *config){
+	rtlsdr_dev_t *dev;
+	int dev_open = rtlsdr_open(dev_out, dev_id);
+	if (dev_open < 0) {
+		log_fatal("Failed to open RTL-SDR device #%d\n", dev_id);
+		return 1;
+	}else{
+		log_info("Using device: #%d\n", dev_id);
+	}
+	dev = *dev_out;
+	/**!
+	 * Set gain mode auto if gain equals to 0.
+ 	 * Otherwise, set gain mode to manual.
+	 * (Mode 1 [manual] needs gain value so 
+	 * gain setter function must be called.)
+ 	 */
+	if(!config->gain){
+		rtlsdr_set_tuner_gain_mode(dev, 0);
+		log_info("Gain mode set to auto.\n");
+	}else{
+		rtlsdr_set_tuner_gain_mode(dev, 1);
+		int gain_count = rtlsdr_get_tuner_gains(dev, NULL);
+		log_info("Supported gain values (%d): ", gain_count);
+		int gains[gain_count], supported_gains = rtlsdr_get_tuner_gains(dev, gains);
+		for (int i = 0; i < supported_gains; i++){
+			/**!
+			 * Different RTL-SDR devices have different supported gain
+			 * values. So select gain value between 1.0 and 3.0
+			 */
+			if (gains[i] > 10 && gains[i] < 30)
+				config->gain = gains[i];
+			fprintf(stderr, "%.1f ", gains[i] / 10.0);
+		}
+		fprintf(stderr, "\n");
+		log_info("Gain set to %.1f\n", config->gain / 10.0);
+		rtlsdr_set_tuner_gain(dev, config->gain);
+	}
+	/**! 
+	 * Enable or disable offset tuning for zero-IF tuners, which allows to avoid
+ 	 * problems caused by the DC offset of the ADCs and 1/f noise.
+ 	 */
+	rtlsdr_set_offset_tuning(dev, config->offset_tuning);
+	rtlsdr_set_center_freq(dev, center_freq);
+	rtlsdr_set_sample_rate(dev, config->sample_rate);
+	log_info("Center frequency set to %d Hz.\n", center_freq);
+	log_info("Sampling at %d S/s\n", config->sample_rate);
+	int r = rtlsdr_reset_buffer(dev);
+	if (r < 0){
+		log_fatal("Failed to reset buffers.\n");
+		return 1;
+	}
+	return 0;
+}
+/*!
+ * Asynchronous read callback.
+ * Program jump to this function after each USB transfer.
+ * Only copies the samples into the ring buffer, FFT
+ * runs on the DSP thread that drains the ring.
+ *
+ * \param n_buf raw I/Q samples
+ * \param len length of buffer
+ * \param ctx context which is given at rtlsdr_read_async(...) (ring buffer)
+ */
+static void async_read_callback(uint8_t *n_buf, uint32_t len, void *ctx){
+	rtlmap_ring_push((RingBuffer*)ctx, n_buf, len, 0);
+}
+/*!
+ * Read samples from the device into the ring buffer.
+ * Single asynchronous read session, returns after
+ * rtlsdr_cancel_async() is called.
+ *
+ * \param dev opened device (see rtlmap_open_device)
+ * \param ring ring buffer to fill (slot_len >= buf_len)
+ * \param buf_len USB buffer length (see rtlmap_buffer_length)
+ * \return 0 on success
+ */
+int rtlmap_read_async(rtlsdr_dev_t *dev, RingBuffer *ring, uint32_t buf_len){
+	return rtlsdr_read_async(dev, async_read_callback, ring, 0, buf_len);
+}
+/*!
+ * Read recorded I/Q samples into the ring buffer. (rtl_sdr format,
+ * interleaved unsigned 8-bit I/Q pairs without header)
+ * Regular files are mapped into memory and copied into the slots
+ * directly, stdin ('-') and pipes are read in buf_len chunks.
+ * With a sample rate, a buffer is committed every buf_len/2 samples
+ * of time like the device does, so slow processing shows up as
+ * overruns. Otherwise buffers are committed as fast as they are
+ * consumed and none is lost. Returns at the end of file or
+ * when 'stop' is set.
+ *
+ * \param filename I/Q file ('-' for stdin)
+ * \param ring ring buffer to fill (slot_len >= buf_len)
+ * \param buf_len buffer length in bytes (see rtlmap_buffer_length)
+ * \param sample_rate sample rate for real-time pacing (0 for as fast as possible)
+ * \param stop stops reading when set
+ * \return 0 on success
+ * \return 1 on failure at opening or reading the file
+ */
+int rtlmap_read_file(const char *filename, RingBuffer *ring, uint32_t buf_len,
+		int sample_rate, atomic_int *stop){
+	FILE *fp = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+	struct stat st;
+	uint8_t *map = NULL, *chunk = NULL, *slot;
+	size_t map_len = 0, pos = 0;
+	if (!fp) {
+		log_error("Failed to open %s\n", filename);
+		return 1;
+	}
+	if (!fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map_len = st.st_size;
+		map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+		else
+			madvise(map, map_len, MADV_SEQUENTIAL);
+	}
+	if (!map && !(chunk = malloc(buf_len))) {
+		log_error("Failed to allocate read buffer.\n");
+		if (fp != stdin)
+			fclose(fp);
+		return 1;
+	}
+	log_info("Replaying %s (%s) %s\n", filename, map ? "mapped" : "streamed",
+		sample_rate ? "in real time" : "as fast as possible");
+	struct timespec deadline, t_start, t_end;
+	size_t total = 0;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	t_start = deadline;
+	while (!atomic_load(stop)) {
+		uint8_t *src;
+		size_t len;
+		if (map) {
+			if (pos >= map_len)
+				break;
+			len = map_len - pos < buf_len ? map_len - pos : buf_len;
+			src = map + pos;
+			pos += len;
+		} else {
+			if (!(len = fread(chunk, 1, buf_len, fp)))
+				break;
+			src = chunk;
+		}
+		total += len;
+		if (sample_rate) {
+			/**! Absolute deadlines, so sleeping late does not add up. */
+			long ns = deadline.tv_nsec + (long)(len / 2 * 1e9 / sample_rate);
+			deadline.tv_sec += ns / 1000000000;
+			deadline.tv_nsec = ns % 1000000000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+			rtlmap_ring_push(ring, src, len, 0);
+			continue;
+		}
+		while (!(slot = rtlmap_ring_reserve(ring)) && !atomic_load(stop))
+			usleep(200);
+		if (!slot)
+			break;
+		memcpy(slot, src, len);
+		rtlmap_ring_commit(ring, len, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	double secs = (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+	log_info("Replayed %.2f MS in %.3f s (%.2f MS/s)\n", total / 2 / 1e6, secs,
+		secs > 0 ? total / 2 / 1e6 / secs : 0);
+	int r = !map && ferror(fp);
+	if (r)
+		log_error("Failed to read %s\n", filename);
+	if (map)
+		munmap(map, map_len);
+	free(chunk);
+	if (fp != stdin)
+		fclose(fp);
+	return r;
+}
+/*!
+ * Get current time in nanoseconds since epoch.
+ *
+ * \return timestamp (ns)
+ */
+int64_t rtlmap_timestamp_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*!
+ * Fill the header of binary spectrum file and spectrum server.
+ *
+ * \param header header to fill
+ * \param config sample rate, FFT size, gain, zoom and output values
+ * \param center_freq center frequency of the device (Hz)
+ */
+void rtlmap_fill_spectrum_header(SpectrumHeader *header, const RtlMapConfig *config, int center_freq){
+	int decimation = config->decimation > 1 ? config->decimation : 1;
+	*header = (SpectrumHeader){
+		.version = SPECTRUM_VERSION,
+		.header_size = sizeof(SpectrumHeader),
+		.center_freq = center_freq + (decimation > 1 ? config->zoom_offset : 0),
+		.sample_rate = config->sample_rate / decimation,
+		.fft_size = config->fft_size,
+		.gain = config->gain,
+		.flags = config->magnitude ? SPECTRUM_MAG : 0,
+		.timestamp_ns = rtlmap_timestamp_ns(),
+		.window = config->window,
+		.enbw = window_enbw(config->window, config->window_beta, config->fft_size)
+	};
+	memcpy(header->magic, SPECTRUM_MAGIC, sizeof(header->magic));
+}
+/*!
+ * Write the header of binary spectrum file. (see -B arg.)
+ *
+ * \param fp file to write
+ * \param config sample rate, FFT size, gain, zoom and output values
+ * \param center_freq center frequency of the device (Hz)
+ * \return 0 on success
+ */
+int rtlmap_write_spectrum_header(FILE *fp, const RtlMapConfig *config, int center_freq){
+	SpectrumHeader header;
+	rtlmap_fill_spectrum_header(&header, config, center_freq);
+	fwrite(&header, sizeof(header), 1, fp);
+	return 0;
+}
+/*!
+ * Write a frame to binary spectrum file.
+ * Record and bins are copied into the (large) stdio buffer,
+ * so the file is written in FILE_BUF_LENGTH chunks.
+ *
+ * \param fp file to write
+ * \param bins dB or magnitude values
+ * \param bin_c bin count
+ * \param center_freq center frequency of the frame
+ * \param timestamp_ns time of the frame (ns since epoch)
+ * \return 0 on success
+ */
+int rtlmap_write_spectrum_record(FILE *fp, const float *bins, int bin_c, uint64_t center_freq,
+		int64_t timestamp_ns){
+	SpectrumRecord record = {
+		.timestamp_ns = timestamp_ns,
+		.center_freq = center_freq,
+		.bin_count = bin_c
+	};
+	fwrite(&record, sizeof(record), 1, fp);
+	fwrite(bins, sizeof(float), bin_c, fp);
+	return 0;
+}
+/*!
+ * Convert binary spectrum file to the text output format,
+ * so the files written with -B can still be used by the tools
+ * which read the text output. ('bin  value' lines)
+ *
+ * \param filename binary spectrum file
+ * \param fp file to write text output
+ * \return 0 on success
+ * \return 1 on failure at opening or reading the file
+ */
+int rtlmap_convert_spectrum_file(char *filename, FILE *fp){
+	SpectrumHeader header;
+	SpectrumRecord record;
+	FILE *bin_file = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+	if (!bin_file) {
+		log_error("Failed to open %s\n", filename);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, bin_file) != 1 ||
+			memcmp(header.magic, SPECTRUM_MAGIC, sizeof(header.magic)) ||
+			header.version != SPECTRUM_VERSION) {
+		log_error("%s is not a rtl_map spectrum file.\n", filename);
+		if (bin_file != stdin)
+			fclose(bin_file);
+		return 1;
+	}
+	fseek(bin_file, header.header_size - sizeof(header), SEEK_CUR);
+	log_info("Converting %s (%u points, %u S/s, center: %lu Hz)\n", filename, 
+		header.fft_size, header.sample_rate, (unsigned long)header.center_freq);
+	float *bins = NULL;
+	uint32_t bins_len = 0;
+	long frame_c = 0;
+	while (fread(&record, sizeof(record), 1, bin_file) == 1) {
+		if (record.bin_count > bins_len) {
+			bins_len = record.bin_count;
+			bins = realloc(bins, sizeof(float) * bins_len);
+		}
+		if (!bins || fread(bins, sizeof(float), record.bin_count, bin_file) != record.bin_count) {
+			log_error("Truncated record at frame %ld\n", frame_c);
+			break;
+		}
+		for (uint32_t i = 0; i < record.bin_count; i++)
+			fprintf(fp, "%u\t%f\n", i+1, bins[i]);
+		frame_c++;
+	}
+	log_info("Converted %ld frames.\n", frame_c);
+	free(bins);
+	if (bin_file != stdin)
+		fclose(bin_file);
+	return 0;
+}
+/*!
+ * Compute the length of the USB buffer that is requested
+ * at rtlsdr_read_async. Buffer holds a whole number of FFT
+ * segments and at least DEFAULT_BUF_LENGTH bytes, so it is
+ * a multiple of lcm(2 * fft_size, SYNC_READ_ALIGN).
+ * (librtlsdr needs a multiple of 512 bytes)
+ * If that multiple is above MAX_BUF_LENGTH (large sizes with
+ * few factors of 2), the buffer is rounded up to 512 bytes
+ * and its last segment is not whole.
+ *
+ * \param fft_size FFT size
+ * \return buffer length in bytes
+ */
+int rtlmap_buffer_length(int fft_size){
+	int64_t len = 2 * fft_size, a = len, b = SYNC_READ_ALIGN;
+	while (b) {
+		int64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	int64_t step = len / a * SYNC_READ_ALIGN;
+	if (step <= MAX_BUF_LENGTH)
+		return (int)((DEFAULT_BUF_LENGTH + step - 1) / step * step);
+	if (len < DEFAULT_BUF_LENGTH)
+		len *= DEFAULT_BUF_LENGTH / len;
+	return (int)((len + SYNC_READ_ALIGN - 1) / SYNC_READ_ALIGN * SYNC_READ_ALIGN);
+}
+/*!
+ * Check if the FFT size only has small prime factors
+ * (2, 3, 5, 7) which FFTW computes the fastest.
+ *
+ * \param size FFT size
+ * \return 1 if size is FFTW-friendly
+ */
+int rtlmap_is_fast_fft_size(int size){
+	int primes[] = {2, 3, 5, 7};
+	for (int i = 0; i < 4; i++)
+		while (size % primes[i] == 0)
+			size /= primes[i];
+	return size == 1;
+}
+/*!
+ * Add the lane sums of a SIMD kernel to the sums of the I/Q correction.
+ * Lanes alternate between I and Q like the samples.
+ *
+ * \param corr I/Q correction
+ * \param lanes lane sums of the DC-free samples, their squares and
+ * their products with I [sum, sum_sq, sum_x] (3 * lane_c values)
+ * \param lane_c lane count of the registers
+ * \param sample_c number of complex samples in the sums
+ */
+static void add_lane_sums(IQCorrection *corr, const fft_real *lanes, int lane_c, int sample_c){
+	for (int l = 0; l < lane_c; l += 2) {
+		corr->sum[0] += lanes[l];
+		corr->sum[1] += lanes[l+1];
+		corr->sum[2] += lanes[lane_c + l];
+		corr->sum[3] += lanes[lane_c + l+1];
+		corr->sum[4] += lanes[2 * lane_c + l+1];
+	}
+	corr->n += sample_c;
+}
+/*!
+ * Convert I/Q samples to complex samples with a lookup table.
+ * RTL-SDR outputs 'IQIQIQ...' and complex samples are stored as
+ * 'Re Im Re Im...', so each byte simply maps to a real value.
+ * Used as fallback on CPUs without SIMD support and for the
+ * samples that do not fill a full SIMD register.
+ * The I/Q correction and the window are applied in the same
+ * pass, so the samples are not read again before the FFT.
+ * [i = I - dc_i, q = gain * (Q - dc_q) - gain * phase * i]
+ *
+ * \param buf array that contains I/Q samples
+ * \param in complex samples (output)
+ * \param window window coefficients (2 * sample_c, NULL for rectangular)
+ * \param corr I/Q correction, its sums are updated (NULL for none)
+ * \param sample_c number of complex samples
+ */
+static void convert_iq_lut(const uint8_t *buf, fft_complex *in, 
+		const fft_real *window, IQCorrection *corr, int sample_c){
+	fft_real *out = (fft_real*)in;
+	if (corr == NULL) {
+		for (int i = 0; i < 2 * sample_c; i++)
+			out[i] = window ? iq_lut[buf[i]] * window[i] : iq_lut[buf[i]];
+		return;
+	}
+	double sum[5] = {0};
+	fft_real dc_i = corr->dc_i, dc_q = corr->dc_q, 
+		scale = corr->gain, cross = -corr->gain * corr->phase;
+	for (int i = 0; i < 2 * sample_c; i += 2) {
+		fft_real re = iq_lut[buf[i]] - dc_i, im = iq_lut[buf[i+1]] - dc_q;
+		sum[0] += re;
+		sum[1] += im;
+		sum[2] += re * re;
+		sum[3] += im * im;
+		sum[4] += re * im;
+		im = scale * im + cross * re;
+		out[i] = window ? re * window[i] : re;
+		out[i+1] = window ? im * window[i+1] : im;
+	}
+	for (int k = 0; k < 5; k++)
+		corr->sum[k] += sum[k];
+	corr->n += sample_c;
+}
+#ifdef HAVE_X86_SIMD
+/*!
+ * SSE2 version of convert_iq_lut().
+ * Widens 16 bytes at a time to 32-bit integers and converts
+ * them to floats (four per register) or doubles (two per register).
+ * I of each sample is copied to the Q lane with a shuffle, so the
+ * correction is two multiplications without leaving the register.
+ */
+__attribute__((target("sse2")))
+static void convert_iq_sse2(const uint8_t *buf, fft_complex *in, 
+		const fft_real *window, IQCorrection *corr, int sample_c){
+	fft_real *out = (fft_real*)in;
+	int i = 0, len = 2 * sample_c;
+	const __m128i zero = _mm_setzero_si128();
+	fft_real dc_i = 0, dc_q = 0, gain = 1, cross = 0;
+	if (corr) {
+		dc_i = corr->dc_i;
+		dc_q = corr->dc_q;
+		gain = corr->gain;
+		cross = -corr->gain * corr->phase;
+	}
+#ifdef FFT_FLOAT
+	const __m128 offset = _mm_set1_ps(IQ_OFFSET), dc = _mm_setr_ps(dc_i, dc_q, dc_i, dc_q),
+		scale = _mm_setr_ps(1, gain, 1, gain), cross_v = _mm_setr_ps(0, cross, 0, cross);
+	__m128 acc[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+#else
+	const __m128d offset = _mm_set1_pd(IQ_OFFSET), dc = _mm_setr_pd(dc_i, dc_q),
+		scale = _mm_setr_pd(1, gain), cross_v = _mm_setr_pd(0, cross);
+	__m128d acc[3] = {_mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd()};
+#endif
+	for (; i + 16 <= len; i += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i*)(buf + i));
+		__m128i w[2] = {_mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero)};
+		for (int j = 0; j < 2; j++) {
+			__m128i d[2] = {_mm_unpacklo_epi16(w[j], zero), _mm_unpackhi_epi16(w[j], zero)};
+			for (int k = 0; k < 2; k++) {
+				int pos = i + 8 * j + 4 * k;
+#ifdef FFT_FLOAT
+				__m128 f = _mm_sub_ps(_mm_cvtepi32_ps(d[k]), offset);
+				if (corr) {
+					f = _mm_sub_ps(f, dc);
+					__m128 re = _mm_shuffle_ps(f, f, _MM_SHUFFLE(2, 2, 0, 0));
+					acc[0] = _mm_add_ps(acc[0], f);
+					acc[1] = _mm_add_ps(acc[1], _mm_mul_ps(f, f));
+					acc[2] = _mm_add_ps(acc[2], _mm_mul_ps(f, re));
+					f = _mm_add_ps(_mm_mul_ps(f, scale), _mm_mul_ps(re, cross_v));
+				}
+				if (window)
+					f = _mm_mul_ps(f, _mm_loadu_ps(window + pos));
+				_mm_storeu_ps(out + pos, f);
+#else
+				__m128d f[2] = {_mm_sub_pd(_mm_cvtepi32_pd(d[k]), offset),
+					_mm_sub_pd(_mm_cvtepi32_pd(_mm_srli_si128(d[k], 8)), offset)};
+				for (int h = 0; h < 2; h++) {
+					if (corr) {
+						f[h] = _mm_sub_pd(f[h], dc);
+						__m128d re = _mm_unpacklo_pd(f[h], f[h]);
+						acc[0] = _mm_add_pd(acc[0], f[h]);
+						acc[1] = _mm_add_pd(acc[1], _mm_mul_pd(f[h], f[h]));
+						acc[2] = _mm_add_pd(acc[2], _mm_mul_pd(f[h], re));
+						f[h] = _mm_add_pd(_mm_mul_pd(f[h], scale), _mm_mul_pd(re, cross_v));
+					}
+					if (window)
+						f[h] = _mm_mul_pd(f[h], _mm_loadu_pd(window + pos + 2 * h));
+					_mm_storeu_pd(out + pos + 2 * h, f[h]);
+				}
+#endif
+			}
+		}
+	}
+	if (corr) {
+		fft_real lanes[3 * sizeof(acc[0]) / sizeof(fft_real)];
+		for (int k = 0; k < 3; k++)
+			memcpy(lanes + k * sizeof(acc[0]) / sizeof(fft_real), &acc[k], sizeof(acc[0]));
+		add_lane_sums(corr, lanes, sizeof(acc[0]) / sizeof(fft_real), i / 2);
+	}
+	convert_iq_lut(buf + i, (fft_complex*)(out + i), window ? window + i : NULL, corr, (len - i) / 2);
+}
+/*!
+ * AVX2 version of convert_iq_lut().
+ * Widens 8 bytes at a time to 32-bit integers and converts
+ * them to floats (eight per register) or doubles (four per register).
+ */
+__attribute__((target("avx2")))
+static void convert_iq_avx2(const uint8_t *buf, fft_complex *in, 
+		const fft_real *window, IQCorrection *corr, int sample_c){
+	fft_real *out = (fft_real*)in;
+	int i = 0, len = 2 * sample_c;
+	fft_real dc_i = 0, dc_q = 0, gain = 1, cross = 0;
+	if (corr) {
+		dc_i = corr->dc_i;
+		dc_q = corr->dc_q;
+		gain = corr->gain;
+		cross = -corr->gain * corr->phase;
+	}
+#ifdef FFT_FLOAT
+	const __m256 offset = _mm256_set1_ps(IQ_OFFSET), 
+		dc = _mm256_setr_ps(dc_i, dc_q, dc_i, dc_q, dc_i, dc_q, dc_i, dc_q),
+		scale = _mm256_setr_ps(1, gain, 1, gain, 1, gain, 1, gain),
+		cross_v = _mm256_setr_ps(0, cross, 0, cross, 0, cross, 0, cross);
+	__m256 acc[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+#else
+	const __m256d offset = _mm256_set1_pd(IQ_OFFSET), 
+		dc = _mm256_setr_pd(dc_i, dc_q, dc_i, dc_q),
+		scale = _mm256_setr_pd(1, gain, 1, gain),
+		cross_v = _mm256_setr_pd(0, cross, 0, cross);
+	__m256d acc[3] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+#endif
+	for (; i + 8 <= len; i += 8) {
+		__m256i d = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(buf + i)));
+#ifdef FFT_FLOAT
+		__m256 f = _mm256_sub_ps(_mm256_cvtepi32_ps(d), offset);
+		if (corr) {
+			f = _mm256_sub_ps(f, dc);
+			__m256 re = _mm256_moveldup_ps(f);
+			acc[0] = _mm256_add_ps(acc[0], f);
+			acc[1] = _mm256_add_ps(acc[1], _mm256_mul_ps(f, f));
+			acc[2] = _mm256_add_ps(acc[2], _mm256_mul_ps(f, re));
+			f = _mm256_add_ps(_mm256_mul_ps(f, scale), _mm256_mul_ps(re, cross_v));
+		}
+		if (window)
+			f = _mm256_mul_ps(f, _mm256_loadu_ps(window + i));
+		_mm256_storeu_ps(out + i, f);
+#else
+		__m256d f[2] = {
+			_mm256_sub_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(d)), offset),
+			_mm256_sub_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(d, 1)), offset)};
+		for (int h = 0; h < 2; h++) {
+			if (corr) {
+				f[h] = _mm256_sub_pd(f[h], dc);
+				__m256d re = _mm256_movedup_pd(f[h]);
+				acc[0] = _mm256_add_pd(acc[0], f[h]);
+				acc[1] = _mm256_add_pd(acc[1], _mm256_mul_pd(f[h], f[h]));
+				acc[2] = _mm256_add_pd(acc[2], _mm256_mul_pd(f[h], re));
+				f[h] = _mm256_add_pd(_mm256_mul_pd(f[h], scale), _mm256_mul_pd(re, cross_v));
+			}
+			if (window)
+				f[h] = _mm256_mul_pd(f[h], _mm256_loadu_pd(window + i + 4 * h));
+			_mm256_storeu_pd(out + i + 4 * h, f[h]);
+		}
+#endif
+	}
+	if (corr) {
+		fft_real lanes[3 * sizeof(acc[0]) / sizeof(fft_real)];
+		for (int k = 0; k < 3; k++)
+			memcpy(lanes + k * sizeof(acc[0]) / sizeof(fft_real), &acc[k], sizeof(acc[0]));
+		add_lane_sums(corr, lanes, sizeof(acc[0]) / sizeof(fft_real), i / 2);
+	}
+	convert_iq_lut(buf + i, (fft_complex*)(out + i), window ? window + i : NULL, corr, (len - i) / 2);
+}
+#endif
+#ifdef HAVE_NEON
+/*!
+ * NEON version of convert_iq_lut().
+ * Widens 8 bytes at a time and converts them to floats
+ * (four per register) or doubles (two per register).
+ */
+static void convert_iq_neon(const uint8_t *buf, fft_complex *in, 
+		const fft_real *window, IQCorrection *corr, int sample_c){
+	fft_real *out = (fft_real*)in;
+	int i = 0, len = 2 * sample_c;
+	const float32x4_t offset = vdupq_n_f32(IQ_OFFSET);
+	fft_real dc_i = 0, dc_q = 0, gain = 1, cross = 0;
+	if (corr) {
+		dc_i = corr->dc_i;
+		dc_q = corr->dc_q;
+		gain = corr->gain;
+		cross = -corr->gain * corr->phase;
+	}
+#ifdef FFT_FLOAT
+	const fft_real coef[3][4] = {{dc_i, dc_q, dc_i, dc_q}, {1, gain, 1, gain}, {0, cross, 0, cross}};
+	const float32x4_t dc = vld1q_f32(coef[0]), scale = vld1q_f32(coef[1]), 
+		cross_v = vld1q_f32(coef[2]);
+	float32x4_t acc[3] = {vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0)};
+#else
+	const fft_real coef[3][2] = {{dc_i, dc_q}, {1, gain}, {0, cross}};
+	const float64x2_t dc = vld1q_f64(coef[0]), scale = vld1q_f64(coef[1]), 
+		cross_v = vld1q_f64(coef[2]);
+	float64x2_t acc[3] = {vdupq_n_f64(0), vdupq_n_f64(0), vdupq_n_f64(0)};
+#endif
+	for (; i + 8 <= len; i += 8) {
+		uint16x8_t w = vmovl_u8(vld1_u8(buf + i));
+		float32x4_t f[2] = {
+			vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(w))), offset),
+			vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(w))), offset)};
+		for (int k = 0; k < 2; k++) {
+#ifdef FFT_FLOAT
+			if (corr) {
+				f[k] = vsubq_f32(f[k], dc);
+				float32x4_t re = vtrn1q_f32(f[k], f[k]);
+				acc[0] = vaddq_f32(acc[0], f[k]);
+				acc[1] = vaddq_f32(acc[1], vmulq_f32(f[k], f[k]));
+				acc[2] = vaddq_f32(acc[2], vmulq_f32(f[k], re));
+				f[k] = vaddq_f32(vmulq_f32(f[k], scale), vmulq_f32(re, cross_v));
+			}
+			if (window)
+				f[k] = vmulq_f32(f[k], vld1q_f32(window + i + 4 * k));
+			vst1q_f32(out + i + 4 * k, f[k]);
+#else
+			float64x2_t d[2] = {vcvt_f64_f32(vget_low_f32(f[k])), vcvt_high_f64_f32(f[k])};
+			for (int h = 0; h < 2; h++) {
+				if (corr) {
+					d[h] = vsubq_f64(d[h], dc);
+					float64x2_t re = vtrn1q_f64(d[h], d[h]);
+					acc[0] = vaddq_f64(acc[0], d[h]);
+					acc[1] = vaddq_f64(acc[1], vmulq_f64(d[h], d[h]));
+					acc[2] = vaddq_f64(acc[2], vmulq_f64(d[h], re));
+					d[h] = vaddq_f64(vmulq_f64(d[h], scale), vmulq_f64(re, cross_v));
+				}
+				if (window)
+					d[h] = vmulq_f64(d[h], vld1q_f64(window + i + 4 * k + 2 * h));
+				vst1q_f64(out + i + 4 * k + 2 * h, d[h]);
+			}
+#endif
+		}
+	}
+	if (corr) {
+		fft_real lanes[3 * sizeof(acc[0]) / sizeof(fft_real)];
+		for (int k = 0; k < 3; k++)
+			memcpy(lanes + k * sizeof(acc[0]) / sizeof(fft_real), &acc[k], sizeof(acc[0]));
+		add_lane_sums(corr, lanes, sizeof(acc[0]) / sizeof(fft_real), i / 2);
+	}
+	convert_iq_lut(buf + i, (fft_complex*)(out + i), window ? window + i : NULL, corr, (len - i) / 2);
+}
+#endif
+/*!
+ * Approximate log2(x) for x > 0.
+ * x = m * 2^e, m is moved into [sqrt(1/2), sqrt(2)) so that
+ * s = (m-1)/(m+1) is in [-0.172, 0.172] and the series
+ * ln(m) = 2 * (s + s^3/3 + s^5/5 + s^7/7 + ...) converges fast.
+ * Truncation error is below 2*s^9/9 = 3e-8 (~1.3e-7 dB),
+ * so the result is as accurate as log10f() for dB graphs.
+ *
+ * \param x value (> 0, not denormal)
+ * \return log2(x)
+ */
+static inline float fast_log2f(float x){
+	union { float f; uint32_t i; } u = {x};
+	float e = (float)((int)(u.i >> 23) - 127);
+	u.i = (u.i & 0x007fffff) | 0x3f800000;
+	float m = u.f;
+	if (m > 1.41421356f) {
+		m *= 0.5f;
+		e += 1.0f;
+	}
+	float s = (m - 1.0f) / (m + 1.0f), s2 = s * s;
+	float ln = 2.0f * s * (1.0f + s2 * (1.0f/3 + s2 * (1.0f/5 + s2 * (1.0f/7))));
+	return e + ln * 1.44269504f;
+}
+/*!
+ * Compute dB values from power. [10 * Log(Re^2 + Im^2)]
+ * Generic version, the loop has no branches except the
+ * range reduction so compilers can vectorize it.
+ *
+ * \param power |X|^2 of bins
+ * \param db dB values (output)
+ * \param bin_c bin count
+ */
+static void power_to_db_generic(const float *power, float *db, int bin_c){
+	for (int i = 0; i < bin_c; i++)
+		db[i] = DB_PER_LOG2 * fast_log2f(power[i] > MIN_POWER ? power[i] : MIN_POWER);
+}
+#ifdef HAVE_X86_SIMD
+/*!
+ * SSE2 version of power_to_db_generic(), four bins per register.
+ */
+__attribute__((target("sse2")))
+static void power_to_db_sse2(const float *power, float *db, int bin_c){
+	const __m128 min_p = _mm_set1_ps(MIN_POWER), one = _mm_set1_ps(1.0f),
+		half = _mm_set1_ps(0.5f), sqrt2 = _mm_set1_ps(1.41421356f),
+		c3 = _mm_set1_ps(1.0f/3), c5 = _mm_set1_ps(1.0f/5), c7 = _mm_set1_ps(1.0f/7),
+		scale = _mm_set1_ps(2.0f * 1.44269504f * DB_PER_LOG2), 
+		e_scale = _mm_set1_ps(DB_PER_LOG2);
+	const __m128i mant_mask = _mm_set1_epi32(0x007fffff), 
+		one_bits = _mm_set1_epi32(0x3f800000), bias = _mm_set1_epi32(127);
+	int i = 0;
+	for (; i + 4 <= bin_c; i += 4) {
+		__m128i x = _mm_castps_si128(_mm_max_ps(_mm_loadu_ps(power + i), min_p));
+		__m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(x, 23), bias));
+		__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(x, mant_mask), one_bits));
+		__m128 big = _mm_cmpgt_ps(m, sqrt2);
+		m = _mm_or_ps(_mm_and_ps(big, _mm_mul_ps(m, half)), _mm_andnot_ps(big, m));
+		e = _mm_add_ps(e, _mm_and_ps(big, one));
+		__m128 s = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+		__m128 s2 = _mm_mul_ps(s, s);
+		__m128 p = _mm_add_ps(c5, _mm_mul_ps(s2, c7));
+		p = _mm_add_ps(c3, _mm_mul_ps(s2, p));
+		p = _mm_add_ps(one, _mm_mul_ps(s2, p));
+		_mm_storeu_ps(db + i, _mm_add_ps(_mm_mul_ps(e, e_scale), 
+			_mm_mul_ps(_mm_mul_ps(s, p), scale)));
+	}
+	power_to_db_generic(power + i, db + i, bin_c - i);
+}
+/*!
+ * AVX2 version of power_to_db_generic(), eight bins per register.
+ */
+__attribute__((target("avx2")))
+static void power_to_db_avx2(const float *power, float *db, int bin_c){
+	const __m256 min_p = _mm256_set1_ps(MIN_POWER), one = _mm256_set1_ps(1.0f),
+		half = _mm256_set1_ps(0.5f), sqrt2 = _mm256_set1_ps(1.41421356f),
+		c3 = _mm256_set1_ps(1.0f/3), c5 = _mm256_set1_ps(1.0f/5), c7 = _mm256_set1_ps(1.0f/7),
+		scale = _mm256_set1_ps(2.0f * 1.44269504f * DB_PER_LOG2), 
+		e_scale = _mm256_set1_ps(DB_PER_LOG2);
+	const __m256i mant_mask = _mm256_set1_epi32(0x007fffff), 
+		one_bits = _mm256_set1_epi32(0x3f800000), bias = _mm256_set1_epi32(127);
+	int i = 0;
+	for (; i + 8 <= bin_c; i += 8) {
+		__m256i x = _mm256_castps_si256(_mm256_max_ps(_mm256_loadu_ps(power + i), min_p));
+		__m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(x, 23), bias));
+		__m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(x, mant_mask), one_bits));
+		__m256 big = _mm256_cmp_ps(m, sqrt2, _CMP_GT_OQ);
+		m = _mm256_blendv_ps(m, _mm256_mul_ps(m, half), big);
+		e = _mm256_add_ps(e, _mm256_and_ps(big, one));
+		__m256 s = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+		__m256 s2 = _mm256_mul_ps(s, s);
+		__m256 p = _mm256_add_ps(c5, _mm256_mul_ps(s2, c7));
+		p = _mm256_add_ps(c3, _mm256_mul_ps(s2, p));
+		p = _mm256_add_ps(one, _mm256_mul_ps(s2, p));
+		_mm256_storeu_ps(db + i, _mm256_add_ps(_mm256_mul_ps(e, e_scale), 
+			_mm256_mul_ps(_mm256_mul_ps(s, p), scale)));
+	}
+	power_to_db_generic(power + i, db + i, bin_c - i);
+}
+#endif
+/*!
+ * Compute magnitude values from power. [Sqr(Re^2 + Im^2)] (see -M arg.)
+ *
+ * \param power |X|^2 of bins
+ * \param mag magnitude values (output)
+ * \param bin_c bin count
+ */
+static void power_to_mag(const float *power, float *mag, int bin_c){
+	for (int i = 0; i < bin_c; i++)
+		mag[i] = sqrtf(power[i]);
+}
+/*!
+ * Fill the lookup table and select the fastest kernels for
+ * I/Q conversion and dB computation which are supported
+ * by the CPU. (AVX2 > SSE2 > NEON > LUT/generic)
+ * NEON only has the I/Q conversion, dB values are computed
+ * by the generic loop there.
+ */
+static void select_kernels(){
+	const char *name = "lut", *db_name = "generic";
+	for (int i = 0; i < 256; i++)
+		iq_lut[i] = (fft_real)i - (fft_real)IQ_OFFSET;
+	convert_iq = convert_iq_lut;
+	power_to_db = power_to_db_generic;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		convert_iq = convert_iq_avx2;
+		power_to_db = power_to_db_avx2;
+		name = db_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		convert_iq = convert_iq_sse2;
+		power_to_db = power_to_db_sse2;
+		name = db_name = "sse2";
+	}
+#elif defined(HAVE_NEON)
+	convert_iq = convert_iq_neon;
+	name = "neon";
+#endif
+	log_info("Using %s kernel for I/Q conversion and %s kernel for dB computation.\n", 
+		name, db_name);
+	kernel_name = name;
+}
+/*!
+ * Initialize the library. (selects the kernels once per process)
+ * Called by rtlmap_engine_create(), can be called earlier.
+ *
+ * \return 0 on success
+ */
+int rtlmap_init(){
+	pthread_once(&kernels_once, select_kernels);
+	return 0;
+}
+/*!
+ * Get the name of the kernels that are selected for the CPU.
+ * (the I/Q conversion kernel, dB values use the generic loop with neon)
+ *
+ * \return lut, sse2, avx2 or neon
+ */
+const char *rtlmap_kernel_name(){
+	rtlmap_init();
+	return kernel_name;
+}
+/*!
+ * Merge a power spectrum into the average depending on the averaging mode.
+ * none -> Only the latest spectrum.
+ * lin -> Mean of all spectra. [avg += (spectrum - avg) / count]
+ * exp -> Exponential moving average. [avg += alpha * (spectrum - avg)]
+ *
+ * \param avg averaged power spectrum
+ * \param spectrum power spectrum to merge
+ * \param bin_c bin count
+ * \param avg_c number of spectra in 'avg', incremented
+ * \param avg_mode averaging mode (see enum avg_mode)
+ * \param avg_alpha exponential averaging factor
+ */
+void rtlmap_merge_average(float *avg, const float *spectrum, int bin_c, long *avg_c,
+		int avg_mode, float avg_alpha){
+	(*avg_c)++;
+	float weight = 1.0;
+	if (avg_mode == AVG_LIN)
+		weight = 1.0 / *avg_c;
+	else if (avg_mode == AVG_EXP && *avg_c > 1)
+		weight = avg_alpha;
+	for (int i=0; i < bin_c; i++)
+		avg[i] += weight * (spectrum[i] - avg[i]);
+}
+/*!
+ * Compute the FFT of the segment in 'in' and accumulate its power.
+ *
+ * \param engine FFT engine
+ */
+static void accumulate_segment(FFTEngine *engine){
+	int sample_c = engine->size, half = sample_c / 2;
+	fft_real *out = (fft_real*)engine->out;
+	float *psd = engine->psd;
+	int64_t start = engine->metrics != NULL ? rtlmap_clock_ns() : 0;
+	/**! 
+	 * Convert the complex samples to complex frequency domain.
+	 * Compute FFT.
+	 */
+	FFTW(execute)(engine->plan);
+	/**!
+	 * Accumulate power of bins. [Re^2 + Im^2]
+	 * FFTW puts 0 Hz at out[0] and negative frequencies after
+	 * out[size/2], so bins are swapped (fftshift) for having
+	 * frequencies in ascending order with the center at size/2.
+	 */
+	for (int i=0; i < sample_c - half; i++)
+		psd[i + half] += out[2*i] * out[2*i] + out[2*i+1] * out[2*i+1];
+	for (int i=sample_c - half; i < sample_c; i++)
+		psd[i - (sample_c - half)] += out[2*i] * out[2*i] + out[2*i+1] * out[2*i+1];
+	if (engine->metrics != NULL)
+		engine->fft_ns += rtlmap_clock_ns() - start;
+}
+/*!
+ * Mix, filter and decimate a buffer, then accumulate the power of
+ * the decimated segments. (see ZoomFilter) The decimated stream
+ * continues across buffers, so a buffer may complete no segment
+ * if it is shorter than FFT size * decimation samples.
+ * Samples are converted in chunks of ZOOM_CHUNK, the filter
+ * history (tap_c - 1 samples) is kept in front of the chunk.
+ *
+ * \param engine FFT engine with zoom
+ * \param buf array that contains I/Q samples
+ * \param len length of buffer
+ * \return number of completed segments
+ */
+static int zoom_process(FFTEngine *engine, uint8_t *buf, uint32_t len){
+	ZoomFilter *zoom = &engine->zoom;
+	IQCorrection *corr = engine->correct ? &engine->corr : NULL;
+	int hist = zoom->tap_c - 1, size = engine->size, segment_c = 0;
+	const fft_real *h = zoom->taps;
+	for (uint32_t pos = 0; pos < len / 2; ) {
+		int n = len / 2 - pos < ZOOM_CHUNK ? (int)(len / 2 - pos) : ZOOM_CHUNK;
+		convert_iq(buf + 2 * pos, zoom->in + hist, NULL, corr, n);
+		if (corr)
+			rtlmap_update_correction(corr);
+		pos += n;
+		for (; zoom->next < hist + n; zoom->next += zoom->decimation) {
+			const fft_real *x = (fft_real*)(zoom->in + zoom->next - hist);
+			fft_real re = 0, im = 0;
+			for (int j = 0; j < zoom->tap_c; j++) {
+				re += h[2*j] * x[2*j] - h[2*j+1] * x[2*j+1];
+				im += h[2*j] * x[2*j+1] + h[2*j+1] * x[2*j];
+			}
+			fft_real *y = zoom->out[zoom->out_c];
+			y[0] = re * zoom->rot_re - im * zoom->rot_im;
+			y[1] = re * zoom->rot_im + im * zoom->rot_re;
+			double rot_re = zoom->rot_re * zoom->step_re - zoom->rot_im * zoom->step_im;
+			zoom->rot_im = zoom->rot_re * zoom->step_im + zoom->rot_im * zoom->step_re;
+			zoom->rot_re = rot_re;
+			if (++zoom->out_c < size)
+				continue;
+			/**! Segment is complete, the next one starts 'hop' samples later. (see -o) */
+			fft_real *seg = (fft_real*)engine->in, *src = (fft_real*)zoom->out;
+			for (int i = 0; i < 2 * size; i++)
+				seg[i] = engine->window ? src[i] * engine->window[i] : src[i];
+			accumulate_segment(engine);
+			segment_c++;
+			memmove(zoom->out, zoom->out + engine->hop, sizeof(fft_complex) * (size - engine->hop));
+			zoom->out_c = size - engine->hop;
+		}
+		zoom->next -= n;
+		memmove(zoom->in, zoom->in + n, sizeof(fft_complex) * hist);
+	}
+	/**! Keep the mixer phase on the unit circle. */
+	double mag = sqrt(zoom->rot_re * zoom->rot_re + zoom->rot_im * zoom->rot_im);
+	zoom->rot_re /= mag;
+	zoom->rot_im /= mag;
+	return segment_c;
+}
+/*!
+ * Compute the averaged power spectrum of a buffer. (Welch's method)
+ * The buffer is divided into segments of FFT size which overlap
+ * by -o percent, so every sample of the buffer is used.
+ * |X|^2 of the segments are averaged, then the result is merged
+ * into 'avg' depending on the averaging mode. (see -a arg.)
+ * With zoom (see -Z), segments are taken from the decimated stream.
+ * Uses fftw3 library for FFT's computations.
+ * With metrics, FFT time and the rest (convert, zoom filter) of the
+ * buffer are recorded separately.
+ *
+ * \param engine FFT engine (plan and buffers) created at startup
+ * \param buf array that contains I/Q samples
+ * \param len length of buffer
+ */
+void rtlmap_process(FFTEngine *engine, uint8_t *buf, uint32_t len){
+	int sample_c = engine->size, segment_c = 0;
+	float *psd = engine->psd;
+	int64_t start = engine->metrics != NULL ? rtlmap_clock_ns() : 0;
+	engine->fft_ns = 0;
+	memset(psd, 0, sizeof(float)*sample_c);
+	if (engine->zoom.decimation > 1)
+		segment_c = zoom_process(engine, buf, len);
+	else for (uint32_t pos = 0; pos + sample_c <= len / 2; pos += engine->hop){
+		uint8_t *seg = buf + 2 * pos;
+		/**!
+		 * Convert buffer from IQ to complex ready for FFTW.
+		 * RTL-SDR outputs 'IQIQIQ...' so we have to read two samples 
+		 * at the same time. (see convert_iq_lut)
+		 * Sample is 127 for zero signal, so substract ~127.34 for exact value.
+		 * The window (see -W) is applied in the same pass.
+		 * 
+		 * NOTE: There is a common issue with cheap RTL-SDR receivers which
+		 * is 'center frequency spike' / 'central peak' problem related to 
+		 * I/Q imbalance. The remaining DC offset and the gain/phase
+		 * imbalance are estimated from the samples and corrected in the
+		 * same pass, the estimates are updated after each segment.
+		 * (see IQCorrection, -Q disables it)
+		 * More detail: 
+		 * https://github.com/roger-/pyrtlsdr/issues/94
+		 * https://wiki.analog.com/resources/eval/user-guides/ad-fmcomms1-ebz/iq_correction
+		 */
+		IQCorrection *corr = engine->correct ? &engine->corr : NULL;
+		convert_iq(seg, engine->in, engine->window, corr, sample_c);
+		if (corr)
+			rtlmap_update_correction(corr);
+		accumulate_segment(engine);
+		segment_c++;
+	}
+	if (segment_c) {
+		/**! Merge the spectrum of this buffer into the average. */
+		for (int i=0; i < sample_c; i++)
+			psd[i] /= segment_c;
+		rtlmap_merge_average(engine->avg, psd, sample_c, &engine->avg_c,
+			engine->avg_mode, engine->avg_alpha);
+	}
+	if (engine->metrics != NULL) {
+		rtlmap_metrics_record(engine->metrics, METRIC_CONVERT,
+			rtlmap_clock_ns() - start - engine->fft_ns);
+		rtlmap_metrics_record(engine->metrics, METRIC_FFT, engine->fft_ns);
+	}
+}
+/*!
+ * Compute dB values [10 * Log(Re^2 + Im^2)] or magnitude values
+ * [Sqr(Re^2 + Im^2)] of a power spectrum in one pass.
+ *
+ * \param power power spectrum (see rtlmap_process)
+ * \param bins dB or magnitude values (output)
+ * \param bin_c bin count
+ * \param magnitude compute magnitude instead of dB
+ */
+void rtlmap_reduce(const float *power, float *bins, int bin_c, int magnitude){
+	rtlmap_init();
+	if (!magnitude)
+		power_to_db(power, bins, bin_c);
+	else
+		power_to_mag(power, bins, bin_c);
+}
+/*!
+ * Convert I/Q samples to complex samples with the selected kernel.
+ * (first step of rtlmap_process, exposed for benchmarking)
+ *
+ * \param buf array that contains I/Q samples
+ * \param in complex samples (output)
+ * \param window window coefficients (see FFTEngine, NULL for rectangular)
+ * \param corr I/Q correction, its sums are updated (NULL for none)
+ * \param sample_c number of complex samples
+ */
+void rtlmap_convert(const uint8_t *buf, fft_complex *in, const fft_real *window, 
+		IQCorrection *corr, int sample_c){
+	rtlmap_init();
+	convert_iq(buf, in, window, corr, sample_c);
+}
+/*!
+ * Update the estimates of the I/Q correction from the sums of the
+ * samples converted since the last update. Estimates move towards
+ * the values of these samples by n / (n + time_constant), the
+ * first update takes them as they are. (blind estimation, the
+ * signals are assumed to have uncorrelated I and Q on average)
+ * phase = E[iq] / E[i^2] -> Q without the part of I
+ * gain = sqrt(E[i^2] / E[(q - phase * i)^2]) -> Q with the power of I
+ *
+ * \param corr I/Q correction
+ */
+void rtlmap_update_correction(IQCorrection *corr){
+	if (!corr->n)
+		return;
+	double n = corr->n, *sum = corr->sum;
+	double weight = corr->ii > 0 ? n / (n + corr->time_constant) : 1;
+	/**! Samples are DC-free with the old estimate, so 'mean' is its error. */
+	double mean_i = sum[0] / n, mean_q = sum[1] / n;
+	corr->dc_i += weight * mean_i;
+	corr->dc_q += weight * mean_q;
+	corr->ii += weight * (sum[2] / n - mean_i * mean_i - corr->ii);
+	corr->qq += weight * (sum[3] / n - mean_q * mean_q - corr->qq);
+	corr->iq += weight * (sum[4] / n - mean_i * mean_q - corr->iq);
+	memset(corr->sum, 0, sizeof(corr->sum));
+	corr->n = 0;
+	/**! No correction without signal. (eg.: zeros of a broken file) */
+	double q_residual = corr->ii > 0 ? corr->qq - corr->iq * corr->iq / corr->ii : 0;
+	if (q_residual <= 0)
+		return;
+	corr->phase = corr->iq / corr->ii;
+	corr->gain = sqrt(corr->ii / q_residual);
+}
+/*!
+ * Get the name of a window function.
+ *
+ * \param window window function (see enum window_type)
+ * \return rect, hann, blackman-harris, flattop or kaiser
+ */
+const char *rtlmap_window_name(int window){
+	if (window < WINDOW_RECT || window > WINDOW_KAISER)
+		return "unknown";
+	return window_names[window];
+}
+/*!
+ * Allocate a peak tracker.
+ *
+ * \param tracker peak tracker to initialize
+ * \param bin_c bin count of the spectra
+ * \param k maximum peak count per frame
+ * \param snr minimum power above the noise floor (dB)
+ * \return 0 on success
+ * \return 1 on failure at allocating memory
+ */
+int rtlmap_peaks_create(PeakTracker *tracker, int bin_c, int k, float snr){
+	memset(tracker, 0, sizeof(PeakTracker));
+	tracker->k = k;
+	tracker->bin_c = bin_c;
+	tracker->threshold = powf(10, snr / 10);
+	tracker->scratch = malloc(sizeof(float) * bin_c);
+	tracker->top = malloc(sizeof(Bin) * k);
+	/**! A track is kept for PEAK_MAX_MISSED frames, so new peaks need extra slots. */
+	tracker->tracks = malloc(sizeof(PeakTrack) * 2 * k);
+	tracker->events = malloc(sizeof(PeakEvent) * 3 * k);
+	if (!tracker->scratch || !tracker->top || !tracker->tracks || !tracker->events) {
+		log_fatal("Failed to allocate peak tracker.\n");
+		rtlmap_peaks_destroy(tracker);
+		return 1;
+	}
+	return 0;
+}
+/*!
+ * Free the peak tracker.
+ *
+ * \param tracker peak tracker to free
+ */
+void rtlmap_peaks_destroy(PeakTracker *tracker){
+	free(tracker->scratch);
+	free(tracker->top);
+	free(tracker->tracks);
+	free(tracker->events);
+	memset(tracker, 0, sizeof(PeakTracker));
+}
+/*!
+ * Find the k-th smallest value. (quickselect, O(N) on average)
+ * Reorders the array.
+ *
+ * \param v values
+ * \param n value count
+ * \param k index of the value in sorted order
+ * \return k-th smallest value
+ */
+static float select_nth(float *v, int n, int k){
+	int lo = 0, hi = n - 1;
+	while (lo < hi) {
+		float pivot = v[(lo + hi) / 2];
+		int i = lo, j = hi;
+		while (i <= j) {
+			while (v[i] < pivot)
+				i++;
+			while (v[j] > pivot)
+				j--;
+			if (i <= j) {
+				float t = v[i];
+				v[i++] = v[j];
+				v[j--] = t;
+			}
+		}
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+	return v[k];
+}
+/*!
+ * Move a bin down the min-heap until both children are larger.
+ *
+ * \param heap min-heap (by value)
+ * \param n heap size
+ * \param i index of the bin
+ */
+static void sift_down(Bin *heap, int n, int i){
+	while (1) {
+		int min = i, l = 2 * i + 1, r = l + 1;
+		if (l < n && heap[l].val < heap[min].val)
+			min = l;
+		if (r < n && heap[r].val < heap[min].val)
+			min = r;
+		if (min == i)
+			return;
+		Bin t = heap[i];
+		heap[i] = heap[min];
+		heap[min] = t;
+		i = min;
+	}
+}
+/*!
+ * Compare two bins by value for qsort function. (descending)
+ *
+ * \param a first bin
+ * \param b second bin
+ * \return value for comparing
+ */
+static int cmp_bin(const void *a, const void *b){
+	float fa = ((const Bin*)a)->val;
+	float fb = ((const Bin*)b)->val;
+	return (fa < fb) - (fa > fb);
+}
+/*!
+ * Find the strongest peaks of a power spectrum.
+ * noise floor -> threshold -> local maxima -> top K
+ * Peaks are stored in 'top' in descending order of power.
+ *
+ * \param tracker peak tracker
+ * \param power power spectrum (bin_c bins)
+ * \return peak count
+ */
+int rtlmap_find_peaks(PeakTracker *tracker, const float *power){
+	int bin_c = tracker->bin_c, k = tracker->k, top_c = 0;
+	Bin *heap = tracker->top;
+	memcpy(tracker->scratch, power, sizeof(float) * bin_c);
+	float median = select_nth(tracker->scratch, bin_c, bin_c / 2);
+	if (tracker->floor <= 0)
+		tracker->floor = median;
+	else
+		tracker->floor += FLOOR_ALPHA * (median - tracker->floor);
+	float threshold = tracker->floor * tracker->threshold;
+	for (int i = 1; i < bin_c - 1; i++) {
+		float p = power[i];
+		if (p <= threshold || p <= power[i-1] || p < power[i+1])
+			continue;
+		if (top_c < k) {
+			/**! Build the heap when it is full. */
+			heap[top_c++] = (Bin){p, i};
+			if (top_c == k)
+				for (int j = k / 2 - 1; j >= 0; j--)
+					sift_down(heap, k, j);
+		} else if (p > heap[0].val) {
+			heap[0] = (Bin){p, i};
+			sift_down(heap, k, 0);
+		}
+	}
+	qsort(heap, top_c, sizeof(Bin), cmp_bin);
+	tracker->top_c = top_c;
+	return top_c;
+}
+/*!
+ * Find the peaks of a power spectrum and match them with the
+ * tracked peaks of the previous frames. A peak belongs to the
+ * nearest unmatched track within PEAK_DISTANCE bins, otherwise
+ * a new track is started. (PEAK_NEW event) Tracks that are not
+ * found for PEAK_MAX_MISSED frames are dropped. (PEAK_LOST event)
+ *
+ * \param tracker peak tracker
+ * \param power power spectrum (bin_c bins)
+ * \return event count (see 'events')
+ */
+int rtlmap_track_peaks(PeakTracker *tracker, const float *power){
+	int top_c = rtlmap_find_peaks(tracker, power), event_c = 0;
+	int matched[2 * tracker->k];
+	memset(matched, 0, sizeof(matched));
+	for (int i = 0; i < top_c; i++) {
+		Bin *peak = &tracker->top[i];
+		float snr = DB_PER_LOG2 * log2f(peak->val / tracker->floor);
+		int best = -1;
+		for (int j = 0; j < tracker->track_c; j++) {
+			int d = abs(tracker->tracks[j].bin - peak->id);
+			if (!matched[j] && d <= PEAK_DISTANCE && 
+					(best < 0 || d < abs(tracker->tracks[best].bin - peak->id)))
+				best = j;
+		}
+		if (best < 0) {
+			if (tracker->track_c == 2 * tracker->k)
+				continue;
+			best = tracker->track_c++;
+			tracker->tracks[best].id = tracker->next_id++;
+			tracker->events[event_c++] = (PeakEvent){PEAK_NEW, 
+				tracker->tracks[best].id, peak->id, peak->val, snr};
+		}
+		matched[best] = 1;
+		tracker->tracks[best].bin = peak->id;
+		tracker->tracks[best].power = peak->val;
+		tracker->tracks[best].snr = snr;
+		tracker->tracks[best].missed = 0;
+	}
+	for (int j = 0; j < tracker->track_c; j++) {
+		PeakTrack *track = &tracker->tracks[j];
+		if (matched[j] || ++track->missed <= PEAK_MAX_MISSED)
+			continue;
+		tracker->events[event_c++] = (PeakEvent){PEAK_LOST, 
+			track->id, track->bin, track->power, track->snr};
+		/**! Move the last track here, it is checked in this loop too. */
+		matched[j] = matched[tracker->track_c - 1];
+		*track = tracker->tracks[--tracker->track_c];
+		j--;
+	}
+	tracker->event_c = event_c;
+	return event_c;
+}
+/*!
+ * Allocate a change trigger.
+ *
+ * \param trigger change trigger to initialize
+ * \param bin_c bin count of the spectra
+ * \param on level above the baseline that turns the trigger on (dB)
+ * \param off level above the baseline that keeps the trigger on (dB)
+ * \return 0 on success
+ * \return 1 on failure at allocating memory
+ */
+int rtlmap_change_create(ChangeTrigger *trigger, int bin_c, float on, float off){
+	memset(trigger, 0, sizeof(ChangeTrigger));
+	trigger->bin_c = bin_c;
+	trigger->on = on;
+	trigger->off = off;
+	trigger->mean = calloc(bin_c, sizeof(float));
+	trigger->var = calloc(bin_c, sizeof(float));
+	if (!trigger->mean || !trigger->var) {
+		log_fatal("Failed to allocate change trigger.\n");
+		rtlmap_change_destroy(trigger);
+		return 1;
+	}
+	return 0;
+}
+/*!
+ * Free the change trigger.
+ *
+ * \param trigger change trigger to free
+ */
+void rtlmap_change_destroy(ChangeTrigger *trigger){
+	free(trigger->mean);
+	free(trigger->var);
+	memset(trigger, 0, sizeof(ChangeTrigger));
+}
+/*!
+ * Compare the spectrum with the baselines and update them.
+ * The first CHANGE_FRAMES frames only learn the baselines.
+ * (cumulative average) Then the baselines are exponential
+ * averages: mean += a * d, var = (1 - a) * (var + a * d^2)
+ *
+ * \param trigger change trigger
+ * \param power power spectrum (|X|^2, bin_c values)
+ * \return 1 if the trigger is on
+ */
+int rtlmap_change_update(ChangeTrigger *trigger, const float *power){
+	int learning = trigger->frame_c < CHANGE_FRAMES, on_c = 0, off_c = 0;
+	float alpha = learning ? 1.0f / (trigger->frame_c + 1) : 1.0f / CHANGE_FRAMES;
+	trigger->excess = -INFINITY;
+	for (int i = 0; i < trigger->bin_c; i++) {
+		float level = DB_PER_LOG2 * fast_log2f(power[i] > MIN_POWER ? power[i] : MIN_POWER),
+			d = level - trigger->mean[i],
+			sigma = CHANGE_SIGMA * sqrtf(trigger->var[i]),
+			a = alpha;
+		if (d > trigger->off && d > sigma) {
+			off_c++;
+			on_c += d > trigger->on;
+			if (!learning)
+				a /= CHANGE_SLOW;
+		}
+		if (d > trigger->excess) {
+			trigger->excess = d;
+			trigger->bin = i;
+		}
+		trigger->mean[i] += a * d;
+		trigger->var[i] = (1 - a) * (trigger->var[i] + a * d * d);
+	}
+	trigger->frame_c++;
+	trigger->started = !learning && !trigger->active && on_c;
+	trigger->stopped = trigger->active && !off_c;
+	if (trigger->started)
+		trigger->active = 1;
+	else if (trigger->stopped)
+		trigger->active = 0;
+	trigger->active_c += trigger->active;
+	return trigger->active;
+}
+/*!
+ * Parse frequency with an optional k/M/G suffix.
+ * (arguments of rtl_map and channel plans)
+ *
+ * \param str frequency string (eg.: 88M, 100.5k, 433920000)
+ * \param end end of the parsed string (output)
+ * \return frequency (Hz)
+ */
+double rtlmap_parse_freq(const char *str, char **end){
+	double freq = strtod(str, end);
+	switch (**end) {
+		case 'k': case 'K': freq *= 1e3; (*end)++; break;
+		case 'M': freq *= 1e6; (*end)++; break;
+		case 'G': freq *= 1e9; (*end)++; break;
+	}
+	return freq;
+}
+/*!
+ * Load a channel plan from a text file.
+ * Each line is 'center bandwidth [name]', frequencies in Hz with
+ * an optional k, M or G suffix. (eg.: 162.025M 25k AIS-B)
+ * Empty lines and lines that start with '#' are skipped.
+ *
+ * \param plan channel plan to initialize
+ * \param filename channel plan file
+ * \return 0 on success
+ * \return 1 on failure at reading the file or invalid lines
+ */
+int rtlmap_channels_load(ChannelPlan *plan, const char *filename){
+	memset(plan, 0, sizeof(ChannelPlan));
+	FILE *fp = fopen(filename, "r");
+	if (!fp) {
+		log_fatal("Failed to open channel plan %s\n", filename);
+		return 1;
+	}
+	plan->center = malloc(sizeof(double) * MAX_CHANNELS);
+	plan->bandwidth = malloc(sizeof(double) * MAX_CHANNELS);
+	plan->names = calloc(MAX_CHANNELS, CHANNEL_NAME_LENGTH);
+	plan->index = malloc(sizeof(int) * MAX_CHANNELS);
+	if (!plan->center || !plan->bandwidth || !plan->names || !plan->index) {
+		log_fatal("Failed to allocate channel plan.\n");
+		fclose(fp);
+		rtlmap_channels_destroy(plan);
+		return 1;
+	}
+	char line[256];
+	for (int line_c = 1; fgets(line, sizeof(line), fp); line_c++) {
+		char *str = line + strspn(line, " \t"), *end;
+		if (*str == '#' || *str == '\n' || *str == '\r' || *str == '\0')
+			continue;
+		double center = rtlmap_parse_freq(str, &end), bandwidth = 0;
+		int valid = end != str && (*end == ' ' || *end == '\t');
+		if (valid) {
+			str = end;
+			bandwidth = rtlmap_parse_freq(str, &end);
+			valid = end != str && bandwidth > 0 && center > 0 && 
+				(*end == '\0' || strchr(" \t\r\n", *end));
+		}
+		if (!valid || plan->channel_c == MAX_CHANNELS) {
+			log_fatal("Invalid channel at %s:%d\n", filename, line_c);
+			fclose(fp);
+			rtlmap_channels_destroy(plan);
+			return 1;
+		}
+		int i = plan->channel_c++;
+		plan->index[i] = i + 1;
+		plan->center[i] = center;
+		plan->bandwidth[i] = bandwidth;
+		sscanf(end, " %31s", plan->names[i]);
+	}
+	fclose(fp);
+	if (!plan->channel_c) {
+		log_fatal("Channel plan %s has no channels.\n", filename);
+		rtlmap_channels_destroy(plan);
+		return 1;
+	}
+	return 0;
+}
+/*!
+ * Map the channels to the bins of the spectra and allocate the sums.
+ * Bin i of the spectrum is at center_freq + (i - bin_c/2) * bin_hz.
+ * (see SpectrumHeader) Channels that are not completely inside the
+ * spectrum are removed, 'index' keeps the numbers of the others.
+ *
+ * \param plan loaded channel plan
+ * \param bin_c bin count of the spectra
+ * \param center_freq center frequency of the spectra (Hz)
+ * \param bin_hz frequency distance between two bins (Hz)
+ * \param enbw equivalent noise bandwidth of the window (bins)
+ * \return 0 on success
+ * \return 1 on failure at allocating memory
+ */
+int rtlmap_channels_map(ChannelPlan *plan, int bin_c, double center_freq, double bin_hz, float enbw){
+	int channel_c = 0;
+	plan->bin_c = bin_c;
+	plan->enbw = enbw > 0 ? enbw : 1;
+	plan->lo = malloc(sizeof(double) * plan->channel_c);
+	plan->hi = malloc(sizeof(double) * plan->channel_c);
+	plan->power = calloc(plan->channel_c, sizeof(float));
+	if (!plan->lo || !plan->hi || !plan->power) {
+		log_fatal("Failed to allocate channel plan.\n");
+		return 1;
+	}
+	/**! Bin i covers [i - 0.5, i + 0.5) around its frequency, edges are shifted to bin starts. */
+	plan->first = bin_c;
+	plan->last = 0;
+	for (int i = 0; i < plan->channel_c; i++) {
+		double offset = (plan->center[i] - center_freq) / bin_hz + bin_c / 2 + 0.5,
+			half = plan->bandwidth[i] / bin_hz / 2;
+		if (offset - half < 0 || offset + half > bin_c)
+			continue;
+		/**! Kept channels move to the front of the arrays. (i >= channel_c) */
+		int j = channel_c++;
+		plan->index[j] = plan->index[i];
+		plan->center[j] = plan->center[i];
+		plan->bandwidth[j] = plan->bandwidth[i];
+		memmove(plan->names[j], plan->names[i], CHANNEL_NAME_LENGTH);
+		plan->lo[j] = offset - half;
+		plan->hi[j] = offset + half;
+		if ((int)plan->lo[j] < plan->first)
+			plan->first = (int)plan->lo[j];
+		if ((int)ceil(plan->hi[j]) > plan->last)
+			plan->last = (int)ceil(plan->hi[j]);
+	}
+	plan->channel_c = channel_c;
+	if (plan->last > bin_c)
+		plan->last = bin_c;
+	if (!channel_c)
+		plan->first = plan->last = 0;
+	plan->prefix = malloc(sizeof(double) * (plan->last - plan->first + 1));
+	if (!plan->prefix) {
+		log_fatal("Failed to allocate channel plan.\n");
+		return 1;
+	}
+	log_info("Measuring %d channels in bins %d-%d (%.1f Hz per bin)\n", 
+		plan->channel_c, plan->first, plan->last, bin_hz);
+	return 0;
+}
+/*!
+ * Sum of the power below a fractional bin position.
+ * The bin under the position adds the part below it.
+ *
+ * \param plan channel plan
+ * \param power power spectrum
+ * \param pos fractional bin
+ * \return sum of power (|X|^2)
+ */
+static double power_below(const ChannelPlan *plan, const float *power, double pos){
+	int bin = (int)pos;
+	double sum = plan->prefix[bin - plan->first];
+	if (bin < plan->last)
+		sum += (pos - bin) * power[bin];
+	return sum;
+}
+/*!
+ * Compute the power of each channel in a spectrum.
+ * Prefix sums cover only the bins of the channels, so the cost
+ * is independent of the bins outside them. Sums are in double
+ * precision, narrow channels are not lost under the rest.
+ *
+ * \param plan mapped channel plan (see rtlmap_channels_map)
+ * \param power power spectrum (see rtlmap_process)
+ * \return channel count (values in plan->power)
+ */
+int rtlmap_channels_measure(ChannelPlan *plan, const float *power){
+	double sum = 0, *prefix = plan->prefix - plan->first;
+	for (int i = plan->first; i < plan->last; i++) {
+		prefix[i] = sum;
+		sum += power[i];
+	}
+	prefix[plan->last] = sum;
+	for (int i = 0; i < plan->channel_c; i++)
+		plan->power[i] = (power_below(plan, power, plan->hi[i]) - 
+			power_below(plan, power, plan->lo[i])) / plan->enbw;
+	return plan->channel_c;
+}
+/*!
+ * Free the channel plan.
+ *
+ * \param plan channel plan
+ */
+void rtlmap_channels_destroy(ChannelPlan *plan){
+	free(plan->center);
+	free(plan->bandwidth);
+	free(plan->names);
+	free(plan->index);
+	free(plan->lo);
+	free(plan->hi);
+	free(plan->prefix);
+	free(plan->power);
+	memset(plan, 0, sizeof(ChannelPlan));
+}
+/*!
+ * Allocate the holds (and the persistence) of the spectra.
+ *
+ * \param hold hold to initialize
+ * \param bin_c bin count of the spectra
+ * \param persistence also count the levels of the bins
+ * \return 0 on success
+ * \return 1 on failure at allocating memory
+ */
+int rtlmap_hold_create(SpectrumHold *hold, int bin_c, int persistence){
+	memset(hold, 0, sizeof(SpectrumHold));
+	hold->bin_c = bin_c;
+	hold->max = (float*) FFTW(malloc)(sizeof(float) * bin_c);
+	hold->min = (float*) FFTW(malloc)(sizeof(float) * bin_c);
+	if (persistence) {
+		hold->cols = bin_c < PERSISTENCE_WIDTH ? bin_c : PERSISTENCE_WIDTH;
+		hold->levels = PERSISTENCE_LEVELS;
+		hold->col_scale = (float)hold->cols / bin_c;
+		hold->density = calloc((size_t)hold->cols * hold->levels, sizeof(uint32_t));
+	}
+	if (!hold->max || !hold->min || (persistence && !hold->density)) {
+		log_fatal("Failed to allocate the hold traces.\n");
+		rtlmap_hold_destroy(hold);
+		return 1;
+	}
+	for (int i = 0; i < bin_c; i++) {
+		hold->max[i] = 0;
+		hold->min[i] = FLT_MAX;
+	}
+	return 0;
+}
+/*!
+ * Free the holds of the spectra.
+ *
+ * \param hold hold to free
+ */
+void rtlmap_hold_destroy(SpectrumHold *hold){
+	FFTW(free)(hold->max);
+	FFTW(free)(hold->min);
+	free(hold->density);
+	memset(hold, 0, sizeof(SpectrumHold));
+}
+/*!
+ * Set the value range of the persistence levels.
+ * Values outside the range are counted in the first/last level.
+ *
+ * \param hold hold
+ * \param min value of the lowest level (dB or magnitude, like the reduced bins)
+ * \param max value of the highest level
+ */
+void rtlmap_hold_range(SpectrumHold *hold, float min, float max){
+	hold->floor = min;
+	hold->step = max > min ? (max - min) / PERSISTENCE_LEVELS : 1;
+}
+/*!
+ * Compute dB or magnitude values of a power spectrum (see rtlmap_reduce)
+ * and update the holds and the persistence in the same pass.
+ * Bins are processed in chunks of HOLD_CHUNK, the holds of a chunk
+ * are updated while its power and values are still in the cache.
+ * The persistence range must be set before. (see rtlmap_hold_range)
+ *
+ * \param hold hold of the spectra
+ * \param power power spectrum (see rtlmap_process)
+ * \param bins dB or magnitude values (output)
+ * \param bin_c bin count (at most the bin count of the hold)
+ * \param magnitude compute magnitude instead of dB
+ */
+void rtlmap_reduce_hold(SpectrumHold *hold, const float *power, float *bins, int bin_c, int magnitude){
+	rtlmap_init();
+	if (bin_c > hold->bin_c)
+		bin_c = hold->bin_c;
+	for (int start = 0; start < bin_c; start += HOLD_CHUNK) {
+		int n = bin_c - start < HOLD_CHUNK ? bin_c - start : HOLD_CHUNK;
+		const float *p = power + start;
+		float *out = bins + start, *max = hold->max + start, *min = hold->min + start;
+		if (!magnitude)
+			power_to_db(p, out, n);
+		else
+			power_to_mag(p, out, n);
+		/**! Selects without branches, so that the compiler vectorizes the holds. */
+		for (int i = 0; i < n; i++) {
+			max[i] = p[i] > max[i] ? p[i] : max[i];
+			min[i] = p[i] < min[i] ? p[i] : min[i];
+		}
+		if (!hold->cols || !hold->step)
+			continue;
+		float inv_step = 1 / hold->step;
+		for (int i = 0; i < n; i++) {
+			int level = (int)((out[i] - hold->floor) * inv_step);
+			level = level < 0 ? 0 : level >= hold->levels ? hold->levels - 1 : level;
+			int col = (int)((start + i) * hold->col_scale);
+			hold->density[(size_t)col * hold->levels + level]++;
+		}
+	}
+	hold->frame_c++;
+}
+/*!
+ * Compute dB or magnitude values of the max-hold and min-hold traces.
+ *
+ * \param hold hold of the spectra
+ * \param max values of the max-hold trace (output, bin_c)
+ * \param min values of the min-hold trace (output, bin_c)
+ * \param magnitude compute magnitude instead of dB
+ */
+void rtlmap_hold_traces(SpectrumHold *hold, float *max, float *min, int magnitude){
+	rtlmap_reduce(hold->max, max, hold->bin_c, magnitude);
+	rtlmap_reduce(hold->min, min, hold->bin_c, magnitude);
+}
+/*!
+ * Compute the persistence image from the level counts.
+ * Rows are the levels from the highest to the lowest, so the
+ * image looks like the spectrum graph. Values are in [0, 1] with
+ * a log scale of the counts, rare levels (short signals) are
+ * still visible next to the noise floor.
+ *
+ * \param hold hold of the spectra (with persistence)
+ * \param image values (output, levels rows of cols values)
+ */
+void rtlmap_hold_image(SpectrumHold *hold, float *image){
+	uint32_t top = 1;
+	size_t count = (size_t)hold->cols * hold->levels;
+	for (size_t i = 0; i < count; i++)
+		top = hold->density[i] > top ? hold->density[i] : top;
+	float scale = 1 / log1pf(top);
+	for (int row = 0; row < hold->levels; row++)
+		for (int col = 0; col < hold->cols; col++)
+			image[(size_t)row * hold->cols + col] = scale * log1pf(
+				hold->density[(size_t)col * hold->levels + hold->levels - 1 - row]);
+}
+/*!
+ * Allocate the history of a waterfall.
+ *
+ * \param waterfall waterfall to initialize
+ * \param rows row (frame) count
+ * \param bin_c bin count of a row
+ * \return 0 on success
+ * \return 1 on failure at allocating memory
+ */
+int rtlmap_waterfall_create(Waterfall *waterfall, int rows, int bin_c){
+	memset(waterfall, 0, sizeof(Waterfall));
+	waterfall->rows = rows;
+	waterfall->bin_c = bin_c;
+	waterfall->data = calloc((size_t)rows * bin_c, sizeof(float));
+	if (!waterfall->data) {
+		log_fatal("Failed to allocate waterfall (%d rows).\n", rows);
+		return 1;
+	}
+	return 0;
+}
+/*!
+ * Free the history of a waterfall.
+ *
+ * \param waterfall waterfall to free
+ */
+void rtlmap_waterfall_destroy(Waterfall *waterfall){
+	free(waterfall->data);
+	memset(waterfall, 0, sizeof(Waterfall));
+}
+/*!
+ * Copy a frame into the next slot of the waterfall.
+ *
+ * \param waterfall waterfall
+ * \param bins values of the frame (bin_c)
+ * \return row of the frame in the history
+ */
+float *rtlmap_waterfall_push(Waterfall *waterfall, const float *bins){
+	float *row = waterfall->data + (size_t)waterfall->head * waterfall->bin_c;
+	memcpy(row, bins, sizeof(float) * waterfall->bin_c);
+	waterfall->head = (waterfall->head + 1) % waterfall->rows;
+	waterfall->row_c++;
+	return row;
+}
+/*!
+ * Write the header of a binary PGM (P5) image.
+ * Height has a fixed width (PGM_HEIGHT_DIGITS), so the header can be
+ * rewritten in place with the final row count of a strip file.
+ *
+ * \param fp file to write
+ * \param width image width (bins)
+ * \param height image height (rows)
+ * \return 0 on success
+ */
+int rtlmap_write_pgm_header(FILE *fp, int width, long height){
+	fprintf(fp, "P5\n%d %*ld\n255\n", width, PGM_HEIGHT_DIGITS, height);
+	return 0;
+}
+/*!
+ * Write a frame as a row of 8-bit gray values to a PGM image.
+ * Values are scaled from [min, max] to [0, 255] and clamped.
+ *
+ * \param fp file to write (after rtlmap_write_pgm_header)
+ * \param bins values of the frame
+ * \param bin_c bin count
+ * \param min value of black
+ * \param max value of white
+ * \return 0 on success
+ */
+int rtlmap_write_pgm_row(FILE *fp, const float *bins, int bin_c, float min, float max){
+	float scale = 255 / (max - min);
+	for (int i = 0; i < bin_c; i++) {
+		float v = (bins[i] - min) * scale;
+		putc_unlocked(v < 0 ? 0 : v > 255 ? 255 : (int)v, fp);
+	}
+	return 0;
+}
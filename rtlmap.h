@@ -0,0 +1,668 @@
+/*
+ * librtlmap, FFT pipeline of rtl_map for RTL-SDR devices. (RTL2832/DVB-T)
+ * Copyright (C) 2019-2023 by orhun <https://www.github.com/orhun>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**!
+ * The pipeline is: capture -> convert -> FFT -> reduce
+ * capture: rtlmap_open_device() + rtlmap_read_async() fill a RingBuffer,
+ * or rtlmap_read_file() replays recorded samples.
+ * convert + FFT: rtlmap_process() turns a buffer of 8-bit I/Q samples
+ * into the averaged power spectrum of an FFTEngine.
+ * reduce: rtlmap_reduce() computes dB or magnitude values of a spectrum.
+ *
+ * All state lives in the structs below, so a process can run any number
+ * of engines and rings. (one thread per engine) FFT plans must be created
+ * from a single thread since the FFTW planner is not thread-safe.
+ */
+#ifndef RTLMAP_H
+#define RTLMAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <sys/socket.h>
+/*! External libraries */
+#include <fftw3.h>
+#include <rtl-sdr.h>
+
+#define DEFAULT_FFT_SIZE 512
+#define DEFAULT_SAMPLE_RATE 2048000
+#define MAX_FFT_SIZE (1 << 22) /*!< Largest FFT size accepted by -N */
+#define FFT_THREADS_MIN_SIZE (1 << 15) /*!< Smaller FFTs are single-threaded, threads cost more than they save */
+#define DEFAULT_BUF_LENGTH (16 * 16384) /*!< USB buffer length (bytes) for small FFTs */
+#define MAX_BUF_LENGTH (4 * MAX_FFT_SIZE) /*!< Largest USB buffer length (bytes) rounded to whole FFT segments */
+#define SPECTRUM_MAGIC "RTLMAPSP" /*!< First bytes of binary spectrum files */
+#define SPECTRUM_VERSION 1 /*!< Binary spectrum file format version */
+#define SYNC_READ_ALIGN 512 /*!< rtlsdr_read_sync length must be a multiple of this */
+#define RING_ALIGN 4096 /*!< Alignment of the ring slots (O_DIRECT writes of the recorder) */
+#define MAX_CLIENTS 64 /*!< Maximum TCP client count of the spectrum server */
+#define SERVER_QUEUE_LENGTH 16 /*!< Published frames kept for the server thread */
+#define SERVER_CMD_DECIMATION 0x01 /*!< Client command: send every Nth frame */
+#define UDP_MAX_BINS 8192 /*!< Bins in a UDP datagram of the spectrum server */
+#define MAX_CHANNELS 4096 /*!< Largest channel count of a channel plan */
+#define CHANNEL_NAME_LENGTH 32 /*!< Longest channel name of a channel plan (with '\0') */
+#define PERSISTENCE_LEVELS 64 /*!< Rows (value levels) of the persistence histogram */
+#define PERSISTENCE_WIDTH 1024 /*!< Largest column count of the persistence histogram */
+#define METRIC_BUCKETS 24 /*!< Histogram buckets, bucket i counts durations up to 2^(i+10) ns */
+/**!
+ * FFT precision is selected at compile time. (see CMakeLists.txt)
+ * FFT_FLOAT -> fftw3f, single-precision (float) buffers and math.
+ * Otherwise -> fftw3, double-precision buffers.
+ * FFTW_THREADS -> fftw3(f)_threads is linked, large FFTs can use threads.
+ * 8-bit samples have ~48 dB of dynamic range, so single precision
+ * is more than enough and halves the memory bandwidth.
+ * FFTW(name) expands to the FFTW function of the selected precision.
+ */
+#ifdef FFT_FLOAT
+typedef float fft_real;
+typedef fftwf_complex fft_complex;
+typedef fftwf_plan fft_plan;
+#define FFTW(name) fftwf_ ## name
+#define WISDOM_FILE_NAME "wisdomf"
+#else
+typedef double fft_real;
+typedef fftw_complex fft_complex;
+typedef fftw_plan fft_plan;
+#define FFTW(name) fftw_ ## name
+#define WISDOM_FILE_NAME "wisdom"
+#endif
+#define log_info(...) rtlmap_log(INFO, __VA_ARGS__)
+#define log_error(...) rtlmap_log(ERROR, __VA_ARGS__)
+#define log_fatal(...) rtlmap_log(FATAL, __VA_ARGS__)
+
+enum log_level {INFO, ERROR, FATAL}; /*!< Log level enumeration */
+enum avg_mode {AVG_NONE, AVG_LIN, AVG_EXP}; /*!< Averaging mode enumeration */
+enum spectrum_flags {SPECTRUM_MAG = 1, SPECTRUM_CHANNELS = 2}; /*!< Binary spectrum header flags */
+enum sink_policy {SINK_BLOCK, SINK_DROP_OLDEST}; /*!< Policy of a full output sink queue */
+enum metric_timer {METRIC_USB_INTERVAL, METRIC_CONVERT, METRIC_FFT, METRIC_REDUCE,
+	METRIC_OUTPUT, METRIC_WRITE, METRIC_TIMERS}; /*!< Histograms of RtlMapMetrics */
+enum window_type {WINDOW_RECT, WINDOW_HANN, WINDOW_BLACKMAN_HARRIS, 
+	WINDOW_FLATTOP, WINDOW_KAISER}; /*!< Window function enumeration */
+/**!
+ * 'RtlMapConfig' holds the settings of the pipeline.
+ * Start from RTLMAP_DEFAULT_CONFIG and change the needed fields.
+ */
+typedef struct RtlMapConfig {
+	int fft_size, /*!< FFT size (data points) */
+		overlap, /*!< Overlap of Welch segments in percent */
+		avg_mode, /*!< Averaging across frames (see enum avg_mode) */
+		window; /*!< Window function of the segments (see enum window_type) */
+	float avg_alpha, /*!< Exponential averaging factor */
+		window_beta; /*!< Shape parameter of the Kaiser window */
+	unsigned int fft_flags; /*!< FFTW planner effort */
+	int fft_threads; /*!< Threads of an FFT of FFT_THREADS_MIN_SIZE or more points (FFTW_THREADS) */
+	const char *wisdom_file; /*!< FFTW wisdom file (NULL for the cache directory) */
+	int sample_rate, /*!< Sample rate (S/s) */
+		gain, /*!< Tuner gain (tenths of a dB, 0 for auto) */
+		offset_tuning, /*!< Enable offset tuning for zero-IF tuners */
+		iq_correction, /*!< Remove DC offset and I/Q imbalance */
+		zoom_offset, /*!< Center of the zoomed band from the center frequency (Hz) */
+		decimation, /*!< Zoom factor, 1 for the full band */
+		magnitude; /*!< Reduce to magnitude instead of dB */
+} RtlMapConfig;
+#define RTLMAP_DEFAULT_CONFIG { \
+	.fft_size = DEFAULT_FFT_SIZE, .overlap = 50, .avg_mode = AVG_NONE, \
+	.window = WINDOW_HANN, .window_beta = 8.6, .avg_alpha = 0.1, .fft_flags = FFTW_MEASURE, .fft_threads = 1, .wisdom_file = NULL, \
+	.sample_rate = DEFAULT_SAMPLE_RATE, .gain = 14, .offset_tuning = 1, \
+	.iq_correction = 1, .zoom_offset = 0, .decimation = 1, .magnitude = 0 }
+/**!
+ * 'IQCorrection' removes the DC offset (center frequency spike) and
+ * the gain/phase imbalance of the I/Q samples while they are converted.
+ * [i = I - dc_i, q = gain * ((Q - dc_q) - phase * i)]
+ * The conversion kernels add the sums of each segment, then the
+ * estimates follow them with a time constant. (see rtlmap_process)
+ * The state does not depend on the sample rate or the FFT size.
+ */
+typedef struct IQCorrection {
+	float dc_i, dc_q, /*!< DC offset estimates */
+		phase, /*!< Part of I that leaks into Q, E[iq] / E[i^2] */
+		gain; /*!< Gain of Q that matches the power of I */
+	double ii, qq, iq; /*!< Estimates of the second moments of the DC-free samples */
+	double sum[5]; /*!< Sums of i, q, i^2, q^2 and iq since the last update */
+	long n, /*!< Sample count of 'sum' */
+		time_constant; /*!< Samples that the estimates need to follow a change (1/e) */
+} IQCorrection;
+/**!
+ * 'ZoomFilter' shows a narrow band around an offset from the center
+ * frequency with a finer resolution. (see -Z arg.) The samples are
+ * mixed down by the offset, low-pass filtered and decimated, then
+ * the FFT runs on the decimated stream. Outputs are only computed
+ * for the kept samples (polyphase), and mixing is moved into the
+ * complex taps so it also runs at the decimated rate:
+ * y[t] = e^(-jwt) * sum(h[k] * e^(jwk) * x[t-k])
+ */
+typedef struct ZoomFilter {
+	int decimation, /*!< Decimation factor (1 disables the zoom) */
+		tap_c, /*!< Filter length (decimation * ZOOM_TAPS_PER_PHASE) */
+		next, /*!< Index of the next output sample in 'in' */
+		out_c; /*!< Decimated samples in 'out' */
+	fft_real *taps; /*!< Mixed filter taps (re, im), reversed */
+	fft_complex *in, /*!< Filter history (tap_c - 1) + converted samples */
+		*out; /*!< Decimated samples of the next segment (FFT size) */
+	double rot_re, rot_im, /*!< Mixer phase of the next output sample */
+		step_re, step_im; /*!< Mixer phase step per output sample, e^(-jw * decimation) */
+} ZoomFilter;
+/**!
+ * 'FFTEngine' keeps everything that FFTW needs to compute
+ * the FFT of a frame. Plan and arrays are created once at
+ * startup (see rtlmap_engine_create) and reused for every frame,
+ * so reading samples does not allocate memory or re-plan.
+ */
+typedef struct FFTEngine {
+	int size; /*!< FFT size (data points) */
+	fft_plan plan; /*!< FFT plan that will contain all the data that FFTW needs */
+	fft_complex *in, *out; /*!< Input and output arrays of the transform */
+	fft_real *window; /**!
+			   * Window coefficients, one per I and Q value (2 * size),
+			   * applied while converting. (NULL for rectangular)
+			   */
+	float coherent_gain, /*!< Mean of the window, divided out of the coefficients */
+		enbw; /*!< Equivalent noise bandwidth of the window (bins) */
+	IQCorrection corr; /*!< DC offset and I/Q imbalance estimates */
+	ZoomFilter zoom; /*!< Mixer and decimator before the FFT (see -Z) */
+	int correct; /*!< Apply 'corr' while converting (see RtlMapConfig) */
+	int hop; /*!< Samples between the starts of two Welch segments (see -o) */
+	float *psd, /*!< Sum of |X|^2 over the segments of the current buffer */
+		*avg, /*!< Averaged power spectrum, used for the output (see -a) */
+		*bins; /*!< Output values (dB or magnitude) of the averaged spectrum */
+	long avg_c; /*!< Number of spectra in 'avg' */
+	int avg_mode; /*!< Averaging mode (see enum avg_mode) */
+	float avg_alpha; /*!< Exponential averaging factor */
+	struct RtlMapMetrics *metrics; /*!< Convert/FFT times are recorded here (can be NULL) */
+	int64_t fft_ns; /*!< FFT time of the current buffer (with metrics) */
+} FFTEngine;
+/**!
+ * 'RingBuffer' is a single-producer/single-consumer queue of
+ * preallocated USB buffers. The read callback (libusb thread)
+ * only copies incoming samples into the next free slot and the
+ * DSP thread drains them, so FFT computation and output never
+ * block the USB transfers.
+ * An IQRecorder is a second consumer with its own tail, slots are
+ * reused after both consumers released them.
+ */
+typedef struct RingBuffer {
+	uint8_t *data; /*!< Slot memory (slots * slot_len bytes) */
+	uint32_t *len, /*!< Length of the samples in each slot */
+		*tag; /*!< Tag of each slot (hop index in scan mode) */
+	int64_t *time_ns; /*!< Time of each slot when it is filled (monotonic) */
+	uint32_t slot_len; /*!< Size of one slot (USB buffer length) */
+	unsigned int slots; /*!< Slot count */
+	atomic_uint head, /*!< Next slot to write (producer) */
+		tail, /*!< Next slot to read (consumer) */
+		rec_tail; /*!< Next slot to write to disk (recorder) */
+	sem_t items, /*!< Wakes the consumer when a slot is filled */
+		rec_items; /*!< Wakes the recorder when a slot is filled (or the ring is full of its slots) */
+	int recorded; /*!< Ring has a recorder (see rtlmap_recorder_start) */
+	atomic_ulong received, /*!< Buffers received from the device */
+		overruns, /*!< Buffers lost because the ring was full */
+		dropped; /*!< Buffers skipped by the DSP thread (refresh rate) */
+	struct RtlMapMetrics *metrics; /*!< Samples and buffer intervals are recorded here (can be NULL) */
+	int64_t last_commit_ns; /*!< Time of the last filled slot (with metrics) */
+} RingBuffer;
+/**!
+ * 'IQRecorder' writes the raw samples of a RingBuffer to disk from its
+ * own thread. Samples are written from the ring slots (no copies) with
+ * O_DIRECT if the file system supports it.
+ * Without a trigger, all samples are written to one file.
+ * With a trigger, the ring holds the 'pre_slots' buffers before the
+ * buffer of the consumer (DSP thread) and
+ * rtlmap_recorder_trigger() writes them and the next 'post_slots'
+ * buffers to a new file. (<filename>.<n>)
+ */
+typedef struct IQRecorder {
+	RingBuffer *ring; /*!< Recorded ring */
+	const char *filename; /*!< File (or base name of the triggered files) */
+	int fd, /*!< Open file (-1 if none) */
+		direct, /*!< File is opened with O_DIRECT */
+		triggered, /*!< Only the buffers around a trigger are written */
+		file_c; /*!< Files written in triggered mode */
+	unsigned int pre_slots, /*!< Buffers kept before the trigger */
+		post_slots; /*!< Buffers written after the (last) trigger */
+	unsigned int end; /*!< Ring position where the triggered file ends */
+	int active; /*!< A triggered file is being written */
+	uint64_t written; /*!< Bytes written */
+	pthread_mutex_t lock; /*!< Protects 'end' and 'active' */
+	pthread_t thread; /*!< Recorder thread */
+	int running; /*!< Recorder thread is started */
+	atomic_int stop; /*!< Tells the recorder thread to return */
+} IQRecorder;
+/**!
+ * Binary spectrum file format. (see -B arg.)
+ * A file starts with a 'SpectrumHeader', then every frame is written
+ * as a 'SpectrumRecord' which is followed by 'bin_count' float32 values
+ * (dB or magnitude, see flags). Values are in host byte order.
+ * With SPECTRUM_CHANNELS, the values are the powers of the channels
+ * of a ChannelPlan instead of bins, in the order of the plan.
+ * Frequency of bin i is:
+ * center_freq + (i - bin_count/2) * sample_rate / fft_size
+ * With zoom, center_freq is the center of the zoomed band and
+ * sample_rate is the decimated sample rate.
+ * Values are corrected for the coherent gain of the window, so
+ * tones have the same level with every window. Noise density
+ * is the value minus 10 * log10(enbw * sample_rate / fft_size).
+ */
+typedef struct SpectrumHeader {
+	char magic[8]; /*!< SPECTRUM_MAGIC */
+	uint32_t version; /*!< SPECTRUM_VERSION */
+	uint32_t header_size; /*!< sizeof(SpectrumHeader) */
+	uint64_t center_freq; /*!< Center frequency (Hz) */
+	uint32_t sample_rate; /*!< Sample rate (S/s) */
+	uint32_t fft_size; /*!< FFT size */
+	int32_t gain; /*!< Tuner gain (tenths of a dB, 0 for auto) */
+	uint32_t flags; /*!< SPECTRUM_MAG if values are magnitudes, SPECTRUM_CHANNELS if values are channels */
+	int64_t timestamp_ns; /*!< Start time (ns since epoch) */
+	uint32_t window; /*!< Window function (see enum window_type) */
+	float enbw; /*!< Equivalent noise bandwidth of the window (bins) */
+} SpectrumHeader;
+typedef struct SpectrumRecord {
+	int64_t timestamp_ns; /*!< Frame time (ns since epoch) */
+	uint64_t center_freq; /*!< Center frequency of the frame (Hz) */
+	uint32_t bin_count; /*!< Number of float32 values after the record */
+	uint32_t first_bin; /*!< Index of the first value (UDP datagrams), zero in files */
+} SpectrumRecord;
+/**!
+ * 'Bin' is created from 'SampleBin' struct with
+ * the purpose of storing sample IDs and values to
+ * make data processing operations more easier and faster.
+ * Such as classification and sorting. (see PeakTracker)
+ */
+typedef struct SampleBin { 
+	float val;
+    int id;
+} Bin;
+enum peak_event_type {PEAK_NEW, PEAK_LOST}; /*!< Peak event types */
+/**!
+ * 'PeakEvent' is emitted when a tracked peak appears or disappears.
+ */
+typedef struct PeakEvent {
+	int type, /*!< PEAK_NEW or PEAK_LOST */
+		id, /*!< Track ID, unique for the tracker */
+		bin; /*!< Bin of the peak */
+	float power, /*!< Power of the peak (|X|^2) */
+		snr; /*!< Power above the noise floor (dB) */
+} PeakEvent;
+/**!
+ * 'PeakTrack' is a peak that is followed across frames by its bin.
+ */
+typedef struct PeakTrack {
+	int id, /*!< Track ID */
+		bin, /*!< Bin of the peak in the last frame it was found */
+		missed; /*!< Frames since the peak was last found */
+	float power, snr; /*!< Power and SNR in the last frame it was found */
+} PeakTrack;
+/**!
+ * 'PeakTracker' finds the strongest K peaks of each spectrum and
+ * tracks them across frames. The noise floor is the median of the
+ * bins (found with quickselect, O(N)) smoothed over frames. Local
+ * maxima that are 'snr' dB above it go through a K-sized min-heap,
+ * so the spectrum is never sorted. (O(N log K) per frame)
+ */
+typedef struct PeakTracker {
+	int k, /*!< Maximum peak count per frame */
+		bin_c; /*!< Bin count of the spectra */
+	float threshold, /*!< Power ratio above the noise floor (from snr) */
+		floor; /*!< Noise floor estimate (|X|^2) */
+	float *scratch; /*!< Copy of the spectrum for quickselect */
+	Bin *top; /*!< Strongest peaks of the last frame, descending */
+	int top_c; /*!< Peak count in 'top' */
+	PeakTrack *tracks; /*!< Tracked peaks */
+	int track_c, /*!< Tracked peak count */
+		next_id; /*!< ID of the next new track */
+	PeakEvent *events; /*!< Events of the last frame */
+	int event_c; /*!< Event count in 'events' */
+} PeakTracker;
+/**!
+ * 'ChangeTrigger' tells if a frame differs from the usual spectrum.
+ * Every bin has a baseline, the running mean and variance of its
+ * level (dB) over about CHANGE_FRAMES frames. The trigger is turned
+ * on by a bin that is 'on' dB and CHANGE_SIGMA standard deviations
+ * above its mean, and stays on until all bins are below 'off' dB.
+ * (hysteresis) Bins above the baseline adapt slower, so an event
+ * is not learned as the new baseline while it lasts.
+ */
+typedef struct ChangeTrigger {
+	int bin_c; /*!< Bin count of the spectra */
+	float on, off; /*!< Levels above the baseline that turn the trigger on/off (dB) */
+	float *mean, /*!< Mean level of each bin (dB) */
+		*var; /*!< Variance of the level of each bin (dB^2) */
+	long frame_c, /*!< Frames since creation */
+		active_c; /*!< Frames while the trigger was on */
+	int active, /*!< Trigger is on */
+		started, /*!< Trigger was turned on by the last frame */
+		stopped, /*!< Trigger was turned off by the last frame */
+		bin; /*!< Bin that is the most above its baseline in the last frame */
+	float excess; /*!< Level of 'bin' above its mean (dB) */
+} ChangeTrigger;
+/**!
+ * 'Waterfall' keeps the last 'rows' frames in one preallocated
+ * circular 2D buffer. (rows * bin_c values, row-major)
+ * Rows are stored in slot order, so slot 'head' is overwritten by
+ * the next frame and the whole buffer can be sent in one write.
+ */
+typedef struct Waterfall {
+	int rows, /*!< Row (frame) count of the history */
+		bin_c, /*!< Bin count of a row */
+		head; /*!< Slot of the next row */
+	long row_c; /*!< Rows pushed since creation */
+	float *data; /*!< Row values (dB or magnitude) */
+} Waterfall;
+/**!
+ * 'SpectrumHold' keeps the max-hold and min-hold traces and the
+ * persistence (density) of the spectra over many frames. Holds are
+ * kept as power in preallocated aligned arrays and updated in place
+ * while the frame is reduced. (see rtlmap_reduce_hold) Persistence
+ * counts the frames that had each value level in each column, bins
+ * are merged into at most PERSISTENCE_WIDTH columns.
+ */
+typedef struct SpectrumHold {
+	int bin_c; /*!< Bin count of the spectra */
+	float *max, /*!< Highest power of each bin (|X|^2) */
+		*min; /*!< Lowest power of each bin (|X|^2) */
+	long frame_c; /*!< Frames since creation */
+	int cols, /*!< Column count of the persistence, 0 if it is disabled */
+		levels; /*!< Level count of the persistence (PERSISTENCE_LEVELS) */
+	float floor, /*!< Value of the lowest level (dB or magnitude) */
+		step, /*!< Value range of a level, 0 until the range is set */
+		col_scale; /*!< Columns per bin */
+	uint32_t *density; /*!< Hits of each level of each column (cols * levels, column-major) */
+} SpectrumHold;
+/**!
+ * 'ChannelPlan' integrates the power of a list of channels (center
+ * and bandwidth) in each spectrum. Channel edges are mapped to
+ * fractional bins once, (see rtlmap_channels_map) then a frame only
+ * needs the prefix sums of the covered bins and a difference per
+ * channel. Edge bins are weighted by their part in the channel.
+ * Powers are divided by the ENBW of the window, so a channel has
+ * the power of the noise and the tones in it. (like a power meter)
+ * Channels outside the spectrum are removed while mapping, so the
+ * plan of each device only has the channels that it receives.
+ */
+typedef struct ChannelPlan {
+	int channel_c; /*!< Channel count */
+	int *index; /*!< Number of each channel in the channel plan file (from 1) */
+	double *center, /*!< Center frequency of each channel (Hz) */
+		*bandwidth; /*!< Bandwidth of each channel (Hz) */
+	char (*names)[CHANNEL_NAME_LENGTH]; /*!< Name of each channel (can be empty) */
+	int bin_c, /*!< Bin count of the spectra (after rtlmap_channels_map) */
+		first, /*!< First bin covered by a channel */
+		last; /*!< Bin after the last covered bin */
+	double *lo, *hi; /*!< Edges of each channel (fractional bins) */
+	double *prefix; /*!< Sum of the power below each covered bin (last - first + 1) */
+	float enbw; /*!< Equivalent noise bandwidth of the window (bins) */
+	float *power; /*!< Power of each channel in the last frame (|X|^2) */
+} ChannelPlan;
+/**!
+ * 'SinkFrame' is a frame in the queue of an OutputSink.
+ * Buffers are allocated when the sink is created.
+ */
+typedef struct SinkFrame {
+	int64_t timestamp_ns; /*!< Time of the frame (ns since epoch) */
+	uint64_t center_freq; /*!< Center frequency of the frame (Hz) */
+	int bin_c, /*!< Value count in 'bins' */
+		extra_c; /*!< Value count in 'extra' */
+	float *bins, /*!< dB or magnitude values */
+		*extra; /*!< Additional values of the frame (eg. peaks) */
+} SinkFrame;
+typedef void (*sink_write_fn)(void *ctx, SinkFrame **frames, int frame_c); /*!< Writes a batch of frames */
+/**!
+ * 'OutputSink' writes frames from its own thread, so a slow output
+ * (disk, gnuplot) does not block the DSP threads. rtlmap_sink_push()
+ * copies a frame into one of the preallocated buffers of a bounded
+ * queue. The writer thread takes all queued frames at once and gives
+ * them to 'write' as one batch. If the queue is full, the DSP thread
+ * waits (SINK_BLOCK) or the oldest queued frame is dropped.
+ * (SINK_DROP_OLDEST)
+ */
+typedef struct OutputSink {
+	const char *name; /*!< Name of the sink (logs) */
+	sink_write_fn write; /*!< Writes a batch of frames */
+	void *ctx; /*!< Argument of 'write' */
+	int policy, /*!< SINK_BLOCK or SINK_DROP_OLDEST */
+		slots, /*!< Queue length (frames) */
+		bin_c, /*!< Maximum value count of 'bins' */
+		extra_c; /*!< Maximum value count of 'extra' */
+	SinkFrame *frames; /*!< Frame buffers */
+	SinkFrame **queue, /*!< Queued frames, oldest at 'head' (circular) */
+		**batch; /*!< Frames given to 'write' */
+	int head, /*!< Index of the oldest frame in 'queue' */
+		count, /*!< Queued frame count */
+		busy; /*!< Oldest frames that are being written */
+	unsigned long written, /*!< Written frames */
+		dropped, /*!< Dropped frames */
+		batch_c; /*!< Batch count */
+	pthread_mutex_t lock; /*!< Protects the queue */
+	pthread_cond_t ready, /*!< Signaled when a frame is queued */
+		space; /*!< Signaled when frames are written */
+	pthread_t thread; /*!< Writer thread */
+	int running, /*!< Writer thread is started */
+		stop; /*!< Tells the writer thread to return after the queue is empty */
+	struct RtlMapMetrics *metrics; /*!< Batch write times are recorded here (can be NULL) */
+} OutputSink;
+/**!
+ * 'SpectrumFrame' is a frame of the spectrum server, encoded once as
+ * a SpectrumRecord and its bins. (see -B file format) All clients
+ * send from the same frame, the last reference gives it back to the
+ * free list of the server, so frames are not allocated after startup.
+ */
+typedef struct SpectrumFrame {
+	atomic_int refs; /*!< References (server queue, clients, server thread) */
+	uint64_t seq; /*!< Sequence number of the frame */
+	size_t len, /*!< Encoded length (bytes) */
+		size; /*!< Allocated length of 'data' (bytes) */
+	struct SpectrumFrame *next; /*!< Next frame in the free list */
+	uint8_t *data; /*!< Encoded frame */
+} SpectrumFrame;
+/**!
+ * 'ServerClient' is a TCP client of the spectrum server.
+ * A client sends one frame at a time and keeps the newest frame
+ * that arrives meanwhile, older pending frames are dropped. So
+ * slow clients lose frames instead of blocking the DSP threads.
+ */
+typedef struct ServerClient {
+	int fd; /*!< Socket */
+	char name[64]; /*!< Address of the client */
+	unsigned int decimation; /*!< Every Nth frame is sent (SERVER_CMD_DECIMATION) */
+	uint64_t last_seq; /*!< Sequence number of the last frame taken */
+	SpectrumFrame *frame, /*!< Frame being sent */
+		*pending; /*!< Frame to send next */
+	size_t sent; /*!< Bytes of 'frame' that are sent */
+	uint8_t cmd[5]; /*!< Command being received (1 byte command, 4 byte parameter) */
+	int cmd_len; /*!< Received bytes of 'cmd' */
+	unsigned long frame_c, /*!< Sent frames */
+		dropped; /*!< Dropped frames */
+} ServerClient;
+/**!
+ * 'SpectrumServer' broadcasts the frames to TCP clients and/or a UDP
+ * destination from its own thread. (see rtlmap_server_publish)
+ * TCP clients get a SpectrumHeader and then frames, like a -B file.
+ * UDP datagrams are SpectrumRecords with up to UDP_MAX_BINS bins,
+ * 'first_bin' tells where they are in the frame.
+ */
+typedef struct SpectrumServer {
+	int listen_fd, /*!< TCP socket (-1 if not used) */
+		udp_fd, /*!< UDP socket (-1 if not used) */
+		wake_fd[2]; /*!< Pipe that wakes the server thread for a new frame */
+	struct sockaddr_storage udp_addr; /*!< UDP destination (unicast or multicast) */
+	socklen_t udp_addr_len; /*!< Length of 'udp_addr' */
+	ServerClient clients[MAX_CLIENTS]; /*!< Connected clients */
+	int client_c; /*!< Client count */
+	SpectrumFrame header; /*!< Encoded SpectrumHeader, sent first to every client */
+	SpectrumFrame *queue[SERVER_QUEUE_LENGTH], /*!< Last published frames (by 'seq') */
+		*free_frames; /*!< Frames that can be reused */
+	uint64_t seq, /*!< Sequence number of the last published frame */
+		sent_seq; /*!< Sequence number of the last frame given to the clients */
+	unsigned long udp_dropped; /*!< Datagrams that are not sent */
+	pthread_mutex_t lock; /*!< Protects 'queue', 'free_frames' and 'seq' */
+	pthread_t thread; /*!< Server thread */
+	int running; /*!< Server thread is started */
+	atomic_int stop; /*!< Tells the server thread to return */
+} SpectrumServer;
+/**!
+ * 'MetricHistogram' counts durations in power of two buckets.
+ * Counters are updated with relaxed atomics, so any thread can
+ * record without a lock and readers see approximate snapshots.
+ */
+typedef struct MetricHistogram {
+	atomic_ulong buckets[METRIC_BUCKETS + 1]; /*!< Durations per bucket, the last one is unbounded */
+	atomic_ulong count; /*!< Recorded durations */
+	atomic_ullong sum_ns; /*!< Sum of the durations (ns) */
+} MetricHistogram;
+/**!
+ * 'RtlMapMetrics' keeps the counters and histograms of the pipeline.
+ * Rings, engines and sinks that point to it record their timings,
+ * the application records the rest (reduce/output time, frames) and
+ * fills the gauges before the metrics are read. (see 'update')
+ * rtlmap_metrics_format() writes them in the Prometheus text format.
+ */
+typedef struct RtlMapMetrics {
+	MetricHistogram timers[METRIC_TIMERS]; /*!< Durations (see enum metric_timer) */
+	atomic_ullong samples; /*!< I/Q samples received */
+	atomic_ulong frames; /*!< Frames output */
+	int64_t start_ns; /*!< Creation time (monotonic) */
+	void (*update)(struct RtlMapMetrics *metrics); /*!< Fills the gauges (can be NULL) */
+	unsigned long buffers, /*!< Buffers received */
+		overruns, /*!< Buffers lost because a ring was full */
+		dropped, /*!< Buffers skipped by the DSP threads */
+		missed, /*!< Frame deadlines passed without a frame */
+		sink_dropped; /*!< Frames dropped by the output sinks */
+	int ring_depth, /*!< Filled slots of the rings */
+		ring_slots, /*!< Slots of the rings */
+		sink_depth; /*!< Queued frames of the output sinks */
+	pthread_mutex_t lock; /*!< Serializes 'update' and the readers */
+} RtlMapMetrics;
+/**!
+ * 'MetricsSnapshot' is a copy of the counters of RtlMapMetrics,
+ * so a summary can show the change since the previous one.
+ */
+typedef struct MetricsSnapshot {
+	int64_t time_ns; /*!< Time of the snapshot (monotonic) */
+	uint64_t samples, frames, buffers, overruns, dropped, missed, sink_dropped;
+	uint64_t count[METRIC_TIMERS], sum_ns[METRIC_TIMERS],
+		buckets[METRIC_TIMERS][METRIC_BUCKETS + 1];
+} MetricsSnapshot;
+/**!
+ * 'MetricsServer' answers HTTP requests for /metrics from its own thread.
+ */
+typedef struct MetricsServer {
+	int listen_fd; /*!< TCP socket */
+	RtlMapMetrics *metrics; /*!< Served metrics */
+	pthread_t thread; /*!< Server thread */
+	int running; /*!< Server thread is started */
+	atomic_int stop; /*!< Tells the server thread to return */
+} MetricsServer;
+_Static_assert(sizeof(SpectrumHeader) == 56, "unexpected SpectrumHeader padding");
+_Static_assert(sizeof(SpectrumRecord) == 24, "unexpected SpectrumRecord padding");
+
+/*! Logging (log_info, log_error, log_fatal) */
+int rtlmap_log(int level, char *format, ...);
+void rtlmap_set_log_colors(int enabled);
+/*! Setup */
+int rtlmap_init();
+const char *rtlmap_kernel_name();
+int rtlmap_buffer_length(int fft_size);
+int rtlmap_is_fast_fft_size(int size);
+double rtlmap_parse_freq(const char *str, char **end);
+/*! Capture */
+int rtlmap_list_devices();
+int rtlmap_open_device(rtlsdr_dev_t **dev, int dev_id, int center_freq, RtlMapConfig *config);
+int rtlmap_read_async(rtlsdr_dev_t *dev, RingBuffer *ring, uint32_t buf_len);
+int rtlmap_read_file(const char *filename, RingBuffer *ring, uint32_t buf_len,
+	int sample_rate, atomic_int *stop);
+int rtlmap_ring_init(RingBuffer *ring, unsigned int slots, uint32_t slot_len);
+void rtlmap_ring_free(RingBuffer *ring);
+uint8_t *rtlmap_ring_reserve(RingBuffer *ring);
+void rtlmap_ring_commit(RingBuffer *ring, uint32_t len, uint32_t tag);
+int rtlmap_ring_push(RingBuffer *ring, const uint8_t *buf, uint32_t len, uint32_t tag);
+uint8_t *rtlmap_ring_peek(RingBuffer *ring, uint32_t *len, uint32_t *tag);
+int64_t rtlmap_ring_time(const RingBuffer *ring);
+void rtlmap_ring_pop(RingBuffer *ring);
+/*! Convert -> FFT */
+void rtlmap_convert(const uint8_t *buf, fft_complex *in, const fft_real *window, 
+	IQCorrection *corr, int sample_c);
+void rtlmap_update_correction(IQCorrection *corr);
+const char *rtlmap_window_name(int window);
+int rtlmap_engine_create(FFTEngine *engine, const RtlMapConfig *config);
+void rtlmap_engine_destroy(FFTEngine *engine);
+void rtlmap_process(FFTEngine *engine, uint8_t *buf, uint32_t len);
+void rtlmap_merge_average(float *avg, const float *spectrum, int bin_c, long *avg_c,
+	int avg_mode, float avg_alpha);
+/*! Reduce */
+void rtlmap_reduce(const float *power, float *bins, int bin_c, int magnitude);
+/*! Peak detection */
+int rtlmap_peaks_create(PeakTracker *tracker, int bin_c, int k, float snr);
+void rtlmap_peaks_destroy(PeakTracker *tracker);
+int rtlmap_find_peaks(PeakTracker *tracker, const float *power);
+int rtlmap_track_peaks(PeakTracker *tracker, const float *power);
+/*! Change trigger */
+int rtlmap_change_create(ChangeTrigger *trigger, int bin_c, float on, float off);
+void rtlmap_change_destroy(ChangeTrigger *trigger);
+int rtlmap_change_update(ChangeTrigger *trigger, const float *power);
+/*! Channel power */
+int rtlmap_channels_load(ChannelPlan *plan, const char *filename);
+int rtlmap_channels_map(ChannelPlan *plan, int bin_c, double center_freq, double bin_hz, float enbw);
+int rtlmap_channels_measure(ChannelPlan *plan, const float *power);
+void rtlmap_channels_destroy(ChannelPlan *plan);
+/*! Waterfall */
+int rtlmap_waterfall_create(Waterfall *waterfall, int rows, int bin_c);
+void rtlmap_waterfall_destroy(Waterfall *waterfall);
+float *rtlmap_waterfall_push(Waterfall *waterfall, const float *bins);
+int rtlmap_write_pgm_header(FILE *fp, int width, long height);
+int rtlmap_write_pgm_row(FILE *fp, const float *bins, int bin_c, float min, float max);
+/*! Max/min hold and persistence */
+int rtlmap_hold_create(SpectrumHold *hold, int bin_c, int persistence);
+void rtlmap_hold_destroy(SpectrumHold *hold);
+void rtlmap_hold_range(SpectrumHold *hold, float min, float max);
+void rtlmap_reduce_hold(SpectrumHold *hold, const float *power, float *bins, int bin_c, int magnitude);
+void rtlmap_hold_traces(SpectrumHold *hold, float *max, float *min, int magnitude);
+void rtlmap_hold_image(SpectrumHold *hold, float *image);
+/*! Raw I/Q recorder */
+int rtlmap_recorder_start(IQRecorder *rec, RingBuffer *ring, const char *filename,
+	unsigned int pre_slots, unsigned int post_slots);
+void rtlmap_recorder_trigger(IQRecorder *rec);
+void rtlmap_recorder_stop(IQRecorder *rec);
+/*! Output sinks */
+int rtlmap_sink_create(OutputSink *sink, const char *name, int slots, int bin_c, int extra_c,
+	int policy, sink_write_fn write, void *ctx);
+int rtlmap_sink_push(OutputSink *sink, const float *bins, int bin_c, uint64_t center_freq,
+	const float *extra, int extra_c);
+void rtlmap_sink_destroy(OutputSink *sink);
+/*! Spectrum server */
+int rtlmap_server_start(SpectrumServer *server, const char *tcp_addr, const char *udp_addr,
+	const RtlMapConfig *config, int center_freq);
+int rtlmap_server_publish(SpectrumServer *server, const float *bins, int bin_c, uint64_t center_freq);
+void rtlmap_server_stop(SpectrumServer *server);
+/*! Metrics */
+void rtlmap_metrics_init(RtlMapMetrics *metrics);
+void rtlmap_metrics_destroy(RtlMapMetrics *metrics);
+int64_t rtlmap_clock_ns();
+void rtlmap_metrics_record(RtlMapMetrics *metrics, int timer, int64_t ns);
+void rtlmap_metrics_snapshot(RtlMapMetrics *metrics, MetricsSnapshot *snapshot);
+int rtlmap_metrics_format(RtlMapMetrics *metrics, FILE *fp);
+int rtlmap_metrics_summary(RtlMapMetrics *metrics, MetricsSnapshot *prev, char *buf, size_t len);
+int rtlmap_metrics_serve(MetricsServer *server, const char *addr, RtlMapMetrics *metrics);
+void rtlmap_metrics_stop(MetricsServer *server);
+/*! Binary spectrum files */
+int rtlmap_write_spectrum_header(FILE *fp, const RtlMapConfig *config, int center_freq);
+void rtlmap_fill_spectrum_header(SpectrumHeader *header, const RtlMapConfig *config, int center_freq);
+int64_t rtlmap_timestamp_ns();
+int rtlmap_write_spectrum_record(FILE *fp, const float *bins, int bin_c, uint64_t center_freq,
+	int64_t timestamp_ns);
+int rtlmap_convert_spectrum_file(char *filename, FILE *fp);
+
+#endif
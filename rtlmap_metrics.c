@@ -0,0 +1,261 @@
+/*
+ * librtlmap, FFT pipeline of rtl_map for RTL-SDR devices. (RTL2832/DVB-T)
+ * Copyright (C) 2019-2023 by orhun <https://www.github.com/orhun>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**!
+ * Metrics of the pipeline: counters and duration histograms that
+ * are updated with relaxed atomics on the hot path, a summary line
+ * (see -m arg.) and the Prometheus text format. (see -e arg.)
+ */
+#include <string.h>
+#include <time.h>
+#include "rtlmap.h"
+
+/*! Names and descriptions of the histograms (see enum metric_timer) */
+static const char *timer_names[METRIC_TIMERS] = {
+	"usb_interval", "convert", "fft", "reduce", "output", "write"
+};
+static const char *timer_help[METRIC_TIMERS] = {
+	"Time between two received buffers",
+	"Conversion, windowing and zoom filter time of a buffer",
+	"FFT and power spectrum time of a buffer",
+	"Reduce (dB or magnitude) time of a frame",
+	"Time of giving a frame to the outputs (sinks and server)",
+	"Write time of a batch of an output sink"
+};
+
+/*!
+ * Initialize the metrics.
+ *
+ * \param metrics metrics to initialize
+ */
+void rtlmap_metrics_init(RtlMapMetrics *metrics){
+	memset(metrics, 0, sizeof(RtlMapMetrics));
+	metrics->start_ns = rtlmap_clock_ns();
+	pthread_mutex_init(&metrics->lock, NULL);
+}
+/*!
+ * Free the resources of the metrics.
+ *
+ * \param metrics metrics
+ */
+void rtlmap_metrics_destroy(RtlMapMetrics *metrics){
+	pthread_mutex_destroy(&metrics->lock);
+}
+/*!
+ * Get the time of the monotonic clock in nanoseconds.
+ * (durations, unlike rtlmap_timestamp_ns)
+ *
+ * \return time (ns)
+ */
+int64_t rtlmap_clock_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/*!
+ * Upper bound of a histogram bucket.
+ *
+ * \param bucket bucket index (< METRIC_BUCKETS)
+ * \return duration (ns)
+ */
+static uint64_t bucket_bound(int bucket){
+	return (uint64_t)1 << (bucket + 10);
+}
+/*!
+ * Record a duration.
+ * Safe to call from any thread.
+ *
+ * \param metrics metrics
+ * \param timer histogram (see enum metric_timer)
+ * \param ns duration (ns)
+ */
+void rtlmap_metrics_record(RtlMapMetrics *metrics, int timer, int64_t ns){
+	MetricHistogram *hist = &metrics->timers[timer];
+	if (ns < 0)
+		ns = 0;
+	/**! ceil(log2(ns)) - 10, durations up to 1 us are in the first bucket. */
+	int bucket = ns <= 1024 ? 0 : 64 - __builtin_clzll((uint64_t)ns - 1) - 10;
+	if (bucket > METRIC_BUCKETS)
+		bucket = METRIC_BUCKETS;
+	atomic_fetch_add_explicit(&hist->buckets[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+}
+/*!
+ * Fill the gauges and copy the counters. (metrics->lock is held)
+ *
+ * \param metrics metrics
+ * \param snapshot copy of the counters
+ */
+static void take_snapshot(RtlMapMetrics *metrics, MetricsSnapshot *snapshot){
+	if (metrics->update != NULL)
+		metrics->update(metrics);
+	snapshot->time_ns = rtlmap_clock_ns();
+	snapshot->samples = atomic_load_explicit(&metrics->samples, memory_order_relaxed);
+	snapshot->frames = atomic_load_explicit(&metrics->frames, memory_order_relaxed);
+	snapshot->buffers = metrics->buffers;
+	snapshot->overruns = metrics->overruns;
+	snapshot->dropped = metrics->dropped;
+	snapshot->missed = metrics->missed;
+	snapshot->sink_dropped = metrics->sink_dropped;
+	for (int t = 0; t < METRIC_TIMERS; t++) {
+		MetricHistogram *hist = &metrics->timers[t];
+		snapshot->count[t] = atomic_load_explicit(&hist->count, memory_order_relaxed);
+		snapshot->sum_ns[t] = atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+		for (int b = 0; b <= METRIC_BUCKETS; b++)
+			snapshot->buckets[t][b] = atomic_load_explicit(&hist->buckets[b],
+				memory_order_relaxed);
+	}
+}
+/*!
+ * Copy the counters of the metrics.
+ *
+ * \param metrics metrics
+ * \param snapshot copy of the counters
+ */
+void rtlmap_metrics_snapshot(RtlMapMetrics *metrics, MetricsSnapshot *snapshot){
+	pthread_mutex_lock(&metrics->lock);
+	take_snapshot(metrics, snapshot);
+	pthread_mutex_unlock(&metrics->lock);
+}
+/*!
+ * Write a counter or gauge in the Prometheus text format.
+ *
+ * \param fp file pointer
+ * \param name metric name (without the prefix)
+ * \param type "counter" or "gauge"
+ * \param help description
+ * \param value value
+ */
+static void write_metric(FILE *fp, const char *name, const char *type, const char *help,
+		double value){
+	fprintf(fp, "# HELP rtlmap_%s %s.\n# TYPE rtlmap_%s %s\nrtlmap_%s %.17g\n",
+		name, help, name, type, name, value);
+}
+/*!
+ * Write the metrics in the Prometheus text format. (version 0.0.4)
+ * Durations are in seconds, histogram buckets are cumulative.
+ *
+ * \param metrics metrics
+ * \param fp file pointer
+ * \return 0 on success
+ */
+int rtlmap_metrics_format(RtlMapMetrics *metrics, FILE *fp){
+	MetricsSnapshot s;
+	pthread_mutex_lock(&metrics->lock);
+	take_snapshot(metrics, &s);
+	int ring_depth = metrics->ring_depth, ring_slots = metrics->ring_slots,
+		sink_depth = metrics->sink_depth;
+	pthread_mutex_unlock(&metrics->lock);
+	write_metric(fp, "uptime_seconds", "gauge", "Time since the start",
+		(s.time_ns - metrics->start_ns) / 1e9);
+	write_metric(fp, "samples_total", "counter", "I/Q samples received", s.samples);
+	write_metric(fp, "buffers_total", "counter", "Buffers received", s.buffers);
+	write_metric(fp, "overruns_total", "counter",
+		"Buffers lost because the ring buffer was full", s.overruns);
+	write_metric(fp, "dropped_buffers_total", "counter",
+		"Buffers skipped by the DSP threads", s.dropped);
+	write_metric(fp, "frames_total", "counter", "Frames output (refresh rate)", s.frames);
+	write_metric(fp, "missed_deadlines_total", "counter",
+		"Frame deadlines passed without a frame", s.missed);
+	write_metric(fp, "sink_dropped_frames_total", "counter",
+		"Frames dropped by the output queues", s.sink_dropped);
+	write_metric(fp, "ring_depth", "gauge", "Filled slots of the ring buffers", ring_depth);
+	write_metric(fp, "ring_slots", "gauge", "Slots of the ring buffers", ring_slots);
+	write_metric(fp, "sink_queue_depth", "gauge", "Queued frames of the output sinks", sink_depth);
+	for (int t = 0; t < METRIC_TIMERS; t++) {
+		const char *name = timer_names[t];
+		fprintf(fp, "# HELP rtlmap_%s_seconds %s.\n# TYPE rtlmap_%s_seconds histogram\n",
+			name, timer_help[t], name);
+		uint64_t sum = 0;
+		for (int b = 0; b < METRIC_BUCKETS; b++) {
+			sum += s.buckets[t][b];
+			fprintf(fp, "rtlmap_%s_seconds_bucket{le=\"%g\"} %lu\n",
+				name, bucket_bound(b) / 1e9, (unsigned long)sum);
+		}
+		fprintf(fp, "rtlmap_%s_seconds_bucket{le=\"+Inf\"} %lu\n"
+			"rtlmap_%s_seconds_sum %.9f\nrtlmap_%s_seconds_count %lu\n",
+			name, (unsigned long)(sum + s.buckets[t][METRIC_BUCKETS]),
+			name, s.sum_ns[t] / 1e9, name, (unsigned long)s.count[t]);
+	}
+	return ferror(fp) ? -1 : 0;
+}
+/*!
+ * Estimate a quantile of the durations between two snapshots.
+ * Returns the upper bound of the bucket that contains it.
+ *
+ * \param prev previous snapshot
+ * \param cur current snapshot
+ * \param timer histogram (see enum metric_timer)
+ * \param q quantile (0-1)
+ * \return duration (ns)
+ */
+static double quantile_ns(const MetricsSnapshot *prev, const MetricsSnapshot *cur,
+		int timer, double q){
+	uint64_t count = cur->count[timer] - prev->count[timer], sum = 0;
+	for (int b = 0; b < METRIC_BUCKETS && count; b++) {
+		sum += cur->buckets[timer][b] - prev->buckets[timer][b];
+		if (sum >= q * count)
+			return bucket_bound(b);
+	}
+	return count ? (double)bucket_bound(METRIC_BUCKETS - 1) * 2 : 0;
+}
+/*!
+ * Format a summary of the metrics since the previous summary.
+ * (rates, mean and p99 durations, queue depths)
+ * 'prev' is updated for the next summary.
+ *
+ * \param metrics metrics
+ * \param prev snapshot of the previous summary (zero for the first)
+ * \param buf buffer of the summary line
+ * \param len buffer length
+ * \return length of the summary
+ */
+int rtlmap_metrics_summary(RtlMapMetrics *metrics, MetricsSnapshot *prev, char *buf, size_t len){
+	MetricsSnapshot cur;
+	pthread_mutex_lock(&metrics->lock);
+	take_snapshot(metrics, &cur);
+	int ring_depth = metrics->ring_depth, ring_slots = metrics->ring_slots,
+		sink_depth = metrics->sink_depth;
+	pthread_mutex_unlock(&metrics->lock);
+	if (!prev->time_ns)
+		prev->time_ns = metrics->start_ns;
+	double elapsed = (cur.time_ns - prev->time_ns) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+	int n = snprintf(buf, len, "%.2f MS/s, %.1f frames/s, ring %d/%d, queue %d, "
+		"%lu overruns, %lu dropped, %lu deadlines missed, %lu frames lost",
+		(cur.samples - prev->samples) / elapsed / 1e6,
+		(cur.frames - prev->frames) / elapsed,
+		ring_depth, ring_slots, sink_depth,
+		(unsigned long)(cur.overruns - prev->overruns),
+		(unsigned long)(cur.dropped - prev->dropped),
+		(unsigned long)(cur.missed - prev->missed),
+		(unsigned long)(cur.sink_dropped - prev->sink_dropped));
+	/**! Mean/p99 (ms) of each duration that was recorded in the interval */
+	for (int t = 0; t < METRIC_TIMERS && n >= 0 && (size_t)n < len; t++) {
+		uint64_t count = cur.count[t] - prev->count[t];
+		if (!count)
+			continue;
+		n += snprintf(buf + n, len - n, ", %s %.3f/%.3f ms", timer_names[t],
+			(cur.sum_ns[t] - prev->sum_ns[t]) / (double)count / 1e6,
+			quantile_ns(prev, &cur, t, 0.99) / 1e6);
+	}
+	*prev = cur;
+	return n;
+}
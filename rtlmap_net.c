@@ -0,0 +1,703 @@
+/*
+ * librtlmap, FFT pipeline of rtl_map for RTL-SDR devices. (RTL2832/DVB-T)
+ * Copyright (C) 2019-2023 by orhun <https://www.github.com/orhun>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**!
+ * Spectrum server: broadcasts the frames of the binary spectrum format
+ * to TCP clients and a UDP destination. (see -l and -U args)
+ * The DSP threads encode each frame once (rtlmap_server_publish), the
+ * server thread gives the same frame to every client by reference and
+ * sends it with nonblocking writes. Nothing on the DSP side waits for
+ * the network.
+ * The metrics server answers HTTP requests for /metrics. (see -e arg.)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include "rtlmap.h"
+
+#define LISTEN_BACKLOG 16
+#define POLL_TIMEOUT_MS 500 /*!< Server thread checks 'stop' at least this often */
+#define HTTP_TIMEOUT_MS 1000 /*!< Metrics server waits this long for a client */
+#define HTTP_REQUEST_LENGTH 1024 /*!< Longest HTTP request (headers) of the metrics server */
+
+/*!
+ * Get a frame from the free list of the server, or allocate one.
+ *
+ * \param server spectrum server
+ * \param len encoded length of the frame (bytes)
+ * \return frame with a single reference (NULL on failure)
+ */
+static SpectrumFrame *frame_get(SpectrumServer *server, size_t len){
+	pthread_mutex_lock(&server->lock);
+	SpectrumFrame *frame = server->free_frames;
+	if (frame != NULL)
+		server->free_frames = frame->next;
+	pthread_mutex_unlock(&server->lock);
+	if (frame == NULL && !(frame = calloc(1, sizeof(SpectrumFrame))))
+		return NULL;
+	/**! Bin count is fixed, so frames are allocated only once. */
+	if (frame->size < len) {
+		uint8_t *data = realloc(frame->data, len);
+		if (data == NULL) {
+			free(frame->data);
+			free(frame);
+			return NULL;
+		}
+		frame->data = data;
+		frame->size = len;
+	}
+	frame->len = len;
+	frame->next = NULL;
+	atomic_store(&frame->refs, 1);
+	return frame;
+}
+/*!
+ * Take a reference of the frame.
+ *
+ * \param frame shared frame
+ * \return frame
+ */
+static SpectrumFrame *frame_ref(SpectrumFrame *frame){
+	atomic_fetch_add(&frame->refs, 1);
+	return frame;
+}
+/*!
+ * Release a reference of the frame.
+ * Last reference puts the frame back to the free list.
+ *
+ * \param server spectrum server
+ * \param frame shared frame (can be NULL)
+ */
+static void frame_unref(SpectrumServer *server, SpectrumFrame *frame){
+	if (frame == NULL || atomic_fetch_sub(&frame->refs, 1) != 1)
+		return;
+	pthread_mutex_lock(&server->lock);
+	frame->next = server->free_frames;
+	server->free_frames = frame;
+	pthread_mutex_unlock(&server->lock);
+}
+/*!
+ * Resolve an address of [host:]port format.
+ * Host can be a name, IPv4 or [IPv6] address.
+ *
+ * \param addr address string
+ * \param socktype SOCK_STREAM or SOCK_DGRAM
+ * \param passive address is used for listening (host is optional)
+ * \return address info list (NULL on failure)
+ */
+static struct addrinfo *resolve_address(const char *addr, int socktype, int passive){
+	char host[256] = {0};
+	const char *port = strrchr(addr, ':');
+	if (port != NULL) {
+		size_t len = port - addr;
+		if (len >= sizeof(host))
+			return NULL;
+		memcpy(host, addr, len);
+		port++;
+	} else if (passive) {
+		port = addr;
+	} else {
+		return NULL;
+	}
+	/**! Brackets of IPv6 addresses. ([::1]:1234) */
+	char *node = host;
+	size_t host_len = strlen(host);
+	if (host_len > 1 && host[0] == '[' && host[host_len - 1] == ']') {
+		host[host_len - 1] = '\0';
+		node++;
+	}
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = socktype,
+		.ai_flags = passive ? AI_PASSIVE : 0
+	}, *res;
+	if (getaddrinfo(node[0] ? node : NULL, port, &hints, &res))
+		return NULL;
+	return res;
+}
+/*!
+ * Set O_NONBLOCK flag of the file descriptor.
+ *
+ * \param fd file descriptor
+ * \return 0 on success
+ */
+static int set_nonblock(int fd){
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0;
+}
+/*!
+ * Create a nonblocking listening TCP socket.
+ *
+ * \param addr [host:]port to listen
+ * \param name name of the server (logs)
+ * \return socket (-1 on failure)
+ */
+static int open_listen_socket(const char *addr, const char *name){
+	struct addrinfo *res = resolve_address(addr, SOCK_STREAM, 1);
+	if (res == NULL) {
+		log_error("Invalid listen address: %s\n", addr);
+		return -1;
+	}
+	int listen_fd = -1;
+	for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+		int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol), on = 1;
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && 
+			!listen(fd, LISTEN_BACKLOG) && !set_nonblock(fd)) {
+			listen_fd = fd;
+			break;
+		}
+		close(fd);
+	}
+	freeaddrinfo(res);
+	if (listen_fd < 0) {
+		log_error("Failed to listen on %s: %s\n", addr, strerror(errno));
+		return -1;
+	}
+	log_info("%s listening on %s\n", name, addr);
+	return listen_fd;
+}
+/*!
+ * Create the UDP socket of the server.
+ * Multicast groups are sent with the default TTL of 1. (local network)
+ *
+ * \param server spectrum server
+ * \param addr host:port of the destination
+ * \return 0 on success
+ */
+static int open_udp_socket(SpectrumServer *server, const char *addr){
+	struct addrinfo *res = resolve_address(addr, SOCK_DGRAM, 0);
+	if (res == NULL) {
+		log_error("Invalid UDP address: %s\n", addr);
+		return -1;
+	}
+	int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+	if (fd >= 0 && !set_nonblock(fd)) {
+		memcpy(&server->udp_addr, res->ai_addr, res->ai_addrlen);
+		server->udp_addr_len = res->ai_addrlen;
+		server->udp_fd = fd;
+	} else if (fd >= 0) {
+		close(fd);
+	}
+	freeaddrinfo(res);
+	if (server->udp_fd < 0) {
+		log_error("Failed to create UDP socket: %s\n", strerror(errno));
+		return -1;
+	}
+	log_info("Sending spectrum datagrams to %s\n", addr);
+	return 0;
+}
+/*!
+ * Close the connection of a client and release its frames.
+ * Last client takes the place of the closed one.
+ *
+ * \param server spectrum server
+ * \param i client index
+ */
+static void close_client(SpectrumServer *server, int i){
+	ServerClient *client = &server->clients[i];
+	log_info("Client %s disconnected: %lu frames sent, %lu dropped\n",
+		client->name, client->frame_c, client->dropped);
+	frame_unref(server, client->frame);
+	frame_unref(server, client->pending);
+	close(client->fd);
+	server->clients[i] = server->clients[--server->client_c];
+}
+/*!
+ * Accept the pending connections.
+ * New clients get the header first, like a binary spectrum file.
+ *
+ * \param server spectrum server
+ */
+static void accept_clients(SpectrumServer *server){
+	while (server->client_c < MAX_CLIENTS) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		int fd = accept(server->listen_fd, (struct sockaddr *)&addr, &addr_len), on = 1;
+		if (fd < 0)
+			return;
+		if (set_nonblock(fd)) {
+			close(fd);
+			continue;
+		}
+		/**! Frames are written at once, no need to wait for more data. */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		ServerClient *client = &server->clients[server->client_c++];
+		*client = (ServerClient){
+			.fd = fd,
+			.decimation = 1,
+			.last_seq = server->sent_seq,
+			.frame = frame_ref(&server->header)
+		};
+		char host[INET6_ADDRSTRLEN] = "?", port[8] = "?";
+		getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof(host), 
+			port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+		snprintf(client->name, sizeof(client->name), "%s:%s", host, port);
+		log_info("Client %s connected (%d/%d)\n", client->name, 
+			server->client_c, MAX_CLIENTS);
+	}
+}
+/*!
+ * Send the frame of the client until the socket buffer is full.
+ * Pending frame is started after the current one is completed.
+ *
+ * \param server spectrum server
+ * \param client TCP client
+ * \return 0 on success, -1 if the connection is closed
+ */
+static int flush_client(SpectrumServer *server, ServerClient *client){
+	while (client->frame != NULL) {
+		SpectrumFrame *frame = client->frame;
+		ssize_t n = send(client->fd, frame->data + client->sent, 
+			frame->len - client->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+		if (n <= 0)
+			return -1;
+		client->sent += n;
+		if (client->sent < frame->len)
+			continue;
+		if (frame != &server->header)
+			client->frame_c++;
+		frame_unref(server, frame);
+		client->frame = client->pending;
+		client->pending = NULL;
+		client->sent = 0;
+	}
+	return 0;
+}
+/*!
+ * Read the commands of the client. (rtl_tcp style)
+ * Commands are 1 byte of type and 4 bytes of big-endian parameter.
+ * 0x01: send every Nth frame (decimation of the refresh rate)
+ *
+ * \param client TCP client
+ * \return 0 on success, -1 if the connection is closed
+ */
+static int read_client(ServerClient *client){
+	for (;;) {
+		ssize_t n = recv(client->fd, client->cmd + client->cmd_len, 
+			sizeof(client->cmd) - client->cmd_len, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+		if (n <= 0)
+			return -1;
+		client->cmd_len += n;
+		if (client->cmd_len < (int)sizeof(client->cmd))
+			continue;
+		client->cmd_len = 0;
+		uint32_t param;
+		memcpy(&param, client->cmd + 1, sizeof(param));
+		param = ntohl(param);
+		if (client->cmd[0] == SERVER_CMD_DECIMATION) {
+			client->decimation = param > 0 ? param : 1;
+			log_info("Client %s: sending every %u. frame\n", 
+				client->name, client->decimation);
+		} else {
+			log_error("Client %s: unknown command 0x%02x\n", 
+				client->name, client->cmd[0]);
+		}
+	}
+}
+/*!
+ * Send the frame to the UDP destination.
+ * Datagrams are a SpectrumRecord and up to UDP_MAX_BINS bins,
+ * the bins are sent from the shared frame. (scatter/gather)
+ *
+ * \param server spectrum server
+ * \param frame encoded frame
+ */
+static void send_datagrams(SpectrumServer *server, SpectrumFrame *frame){
+	SpectrumRecord record;
+	memcpy(&record, frame->data, sizeof(record));
+	uint32_t bin_c = record.bin_count;
+	float *bins = (float *)(frame->data + sizeof(record));
+	uint32_t first = 0;
+	do {
+		record.first_bin = first;
+		record.bin_count = bin_c - first < UDP_MAX_BINS ? bin_c - first : UDP_MAX_BINS;
+		struct iovec iov[2] = {
+			{.iov_base = &record, .iov_len = sizeof(record)},
+			{.iov_base = bins + first, .iov_len = record.bin_count * sizeof(float)}
+		};
+		struct msghdr msg = {
+			.msg_name = &server->udp_addr,
+			.msg_namelen = server->udp_addr_len,
+			.msg_iov = iov,
+			.msg_iovlen = 2
+		};
+		if (sendmsg(server->udp_fd, &msg, MSG_DONTWAIT) < 0)
+			server->udp_dropped++;
+		first += UDP_MAX_BINS;
+	} while (first < bin_c);
+}
+/*!
+ * Give the new frames to the clients.
+ * Clients that are busy with a frame keep only the newest frame,
+ * the older pending frame is dropped.
+ *
+ * \param server spectrum server
+ */
+static void dispatch_frames(SpectrumServer *server){
+	for (;;) {
+		pthread_mutex_lock(&server->lock);
+		/**! Frames that are overwritten in the queue are lost for all clients. */
+		if (server->seq - server->sent_seq > SERVER_QUEUE_LENGTH)
+			server->sent_seq = server->seq - SERVER_QUEUE_LENGTH;
+		SpectrumFrame *frame = NULL;
+		if (server->sent_seq < server->seq) {
+			server->sent_seq++;
+			frame = frame_ref(server->queue[server->sent_seq % SERVER_QUEUE_LENGTH]);
+		}
+		pthread_mutex_unlock(&server->lock);
+		if (frame == NULL)
+			return;
+		if (server->udp_fd >= 0)
+			send_datagrams(server, frame);
+		for (int i = 0; i < server->client_c; i++) {
+			ServerClient *client = &server->clients[i];
+			if (frame->seq - client->last_seq < client->decimation)
+				continue;
+			client->last_seq = frame->seq;
+			if (client->frame == NULL) {
+				client->frame = frame_ref(frame);
+				client->sent = 0;
+			} else {
+				if (client->pending != NULL) {
+					frame_unref(server, client->pending);
+					client->dropped++;
+				}
+				client->pending = frame_ref(frame);
+			}
+		}
+		frame_unref(server, frame);
+	}
+}
+/*!
+ * Thread of the spectrum server.
+ * Waits for the connections, commands and writable sockets of the
+ * clients, and for the frames of the DSP threads. (wake pipe)
+ *
+ * \param arg spectrum server
+ * \return NULL
+ */
+static void *server_worker(void *arg){
+	SpectrumServer *server = arg;
+	struct pollfd fds[MAX_CLIENTS + 2];
+	while (!atomic_load(&server->stop)) {
+		int fd_c = 0;
+		fds[fd_c++] = (struct pollfd){.fd = server->wake_fd[0], .events = POLLIN};
+		fds[fd_c++] = (struct pollfd){
+			.fd = server->client_c < MAX_CLIENTS ? server->listen_fd : -1, 
+			.events = POLLIN
+		};
+		for (int i = 0; i < server->client_c; i++)
+			fds[fd_c++] = (struct pollfd){
+				.fd = server->clients[i].fd,
+				.events = POLLIN | (server->clients[i].frame != NULL ? POLLOUT : 0)
+			};
+		if (poll(fds, fd_c, POLL_TIMEOUT_MS) < 0 && errno != EINTR) {
+			log_error("Spectrum server failed: %s\n", strerror(errno));
+			break;
+		}
+		/**! Clients are checked from the end, closed ones are replaced by the last. */
+		for (int i = server->client_c - 1; i >= 0; i--) {
+			short revents = fds[i + 2].revents;
+			if ((revents & POLLIN && read_client(&server->clients[i])) ||
+				(revents & (POLLERR | POLLHUP | POLLNVAL)) ||
+				(revents & POLLOUT && flush_client(server, &server->clients[i])))
+				close_client(server, i);
+		}
+		if (fds[1].revents & POLLIN)
+			accept_clients(server);
+		if (fds[0].revents & POLLIN) {
+			char drain[64];
+			while (read(server->wake_fd[0], drain, sizeof(drain)) > 0);
+		}
+		/**! Frames are sent right away, poll is needed only for full buffers. */
+		dispatch_frames(server);
+		for (int i = server->client_c - 1; i >= 0; i--)
+			if (flush_client(server, &server->clients[i]))
+				close_client(server, i);
+	}
+	return NULL;
+}
+/*!
+ * Start the spectrum server.
+ * Exits on failure at creating the thread.
+ *
+ * \param server spectrum server
+ * \param tcp_addr [host:]port to listen (NULL for UDP only)
+ * \param udp_addr host:port of the UDP destination (NULL for TCP only)
+ * \param config engine configuration (see rtlmap_fill_spectrum_header)
+ * \param center_freq center frequency of the device (Hz)
+ * \return 0 on success
+ */
+int rtlmap_server_start(SpectrumServer *server, const char *tcp_addr, const char *udp_addr,
+		const RtlMapConfig *config, int center_freq){
+	memset(server, 0, sizeof(SpectrumServer));
+	server->listen_fd = server->udp_fd = -1;
+	server->wake_fd[0] = server->wake_fd[1] = -1;
+	pthread_mutex_init(&server->lock, NULL);
+	/**! Header is a frame that is never released. (first reference) */
+	if (!(server->header.data = malloc(sizeof(SpectrumHeader)))) {
+		log_fatal("Failed to allocate server buffers.\n");
+		return -1;
+	}
+	rtlmap_fill_spectrum_header((SpectrumHeader *)server->header.data, config, center_freq);
+	server->header.len = server->header.size = sizeof(SpectrumHeader);
+	atomic_store(&server->header.refs, 1);
+	if (pipe(server->wake_fd) || set_nonblock(server->wake_fd[0]) || 
+		set_nonblock(server->wake_fd[1])) {
+		log_fatal("Failed to create server pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	if ((tcp_addr != NULL && 
+		(server->listen_fd = open_listen_socket(tcp_addr, "Spectrum server")) < 0) ||
+		(udp_addr != NULL && open_udp_socket(server, udp_addr)))
+		return -1;
+	if (pthread_create(&server->thread, NULL, server_worker, server)) {
+		log_fatal("Failed to create server thread.\n");
+		return -1;
+	}
+	server->running = 1;
+	return 0;
+}
+/*!
+ * Publish a frame to the clients of the spectrum server.
+ * Called from the DSP threads, never blocks on the network.
+ * The frame is encoded once, (SpectrumRecord + bins) all
+ * clients send from the same buffer.
+ *
+ * \param server spectrum server
+ * \param bins dB or magnitude values
+ * \param bin_c bin count
+ * \param center_freq center frequency of the frame
+ * \return 0 on success
+ */
+int rtlmap_server_publish(SpectrumServer *server, const float *bins, int bin_c, uint64_t center_freq){
+	SpectrumFrame *frame = frame_get(server, 
+		sizeof(SpectrumRecord) + (size_t)bin_c * sizeof(float));
+	if (frame == NULL)
+		return -1;
+	SpectrumRecord record = {
+		.timestamp_ns = rtlmap_timestamp_ns(),
+		.center_freq = center_freq,
+		.bin_count = bin_c
+	};
+	memcpy(frame->data, &record, sizeof(record));
+	memcpy(frame->data + sizeof(record), bins, (size_t)bin_c * sizeof(float));
+	pthread_mutex_lock(&server->lock);
+	frame->seq = ++server->seq;
+	SpectrumFrame **slot = &server->queue[frame->seq % SERVER_QUEUE_LENGTH], *old = *slot;
+	*slot = frame;
+	pthread_mutex_unlock(&server->lock);
+	frame_unref(server, old);
+	/**! Pipe is nonblocking, a full pipe already wakes the server. */
+	if (write(server->wake_fd[1], "", 1) < 0 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+/*!
+ * Stop the spectrum server, close the connections and free the frames.
+ *
+ * \param server spectrum server
+ */
+void rtlmap_server_stop(SpectrumServer *server){
+	if (server->running) {
+		atomic_store(&server->stop, 1);
+		if (write(server->wake_fd[1], "", 1) < 0)
+			log_error("Failed to wake the server thread.\n");
+		pthread_join(server->thread, NULL);
+		server->running = 0;
+		if (server->udp_dropped)
+			log_info("Spectrum server: %lu datagrams dropped\n", server->udp_dropped);
+	}
+	while (server->client_c)
+		close_client(server, server->client_c - 1);
+	for (int i = 0; i < SERVER_QUEUE_LENGTH; i++) {
+		frame_unref(server, server->queue[i]);
+		server->queue[i] = NULL;
+	}
+	while (server->free_frames != NULL) {
+		SpectrumFrame *frame = server->free_frames;
+		server->free_frames = frame->next;
+		free(frame->data);
+		free(frame);
+	}
+	free(server->header.data);
+	server->header.data = NULL;
+	for (int i = 0; i < 2; i++)
+		if (server->wake_fd[i] >= 0)
+			close(server->wake_fd[i]);
+	if (server->listen_fd >= 0)
+		close(server->listen_fd);
+	if (server->udp_fd >= 0)
+		close(server->udp_fd);
+	server->listen_fd = server->udp_fd = server->wake_fd[0] = server->wake_fd[1] = -1;
+	pthread_mutex_destroy(&server->lock);
+}
+/*!
+ * Send a buffer completely with a blocking socket.
+ *
+ * \param fd socket
+ * \param buf data to send
+ * \param len length of data
+ * \return 0 on success
+ */
+static int send_all(int fd, const char *buf, size_t len){
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+/*!
+ * Answer the HTTP request of a client of the metrics server.
+ * GET /metrics gets the metrics, (Prometheus text format) other
+ * requests get a 404. Connection is closed after the response.
+ *
+ * \param server metrics server
+ * \param fd client socket (blocking, with timeouts)
+ */
+static void serve_request(MetricsServer *server, int fd){
+	char req[HTTP_REQUEST_LENGTH + 1];
+	size_t req_len = 0;
+	/**! Only the request line is used, headers are read until the empty line. */
+	while (req_len < HTTP_REQUEST_LENGTH) {
+		ssize_t n = recv(fd, req + req_len, HTTP_REQUEST_LENGTH - req_len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		req_len += n;
+		req[req_len] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+			break;
+	}
+	req[req_len] = '\0';
+	if (!req_len)
+		return;
+	char *body = NULL, head[256];
+	size_t body_len = 0;
+	int found = !strncmp(req, "GET /metrics", 12) && 
+		(req[12] == ' ' || req[12] == '?' || req[12] == '\r' || req[12] == '\n');
+	FILE *fp = found ? open_memstream(&body, &body_len) : NULL;
+	if (fp != NULL && rtlmap_metrics_format(server->metrics, fp))
+		found = 0;
+	if (fp != NULL)
+		fclose(fp);
+	if (!found) {
+		free(body);
+		body = NULL;
+		body_len = 0;
+	}
+	int head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		"Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		found ? "200 OK" : "404 Not Found", found ? body_len : strlen("Not found\n"));
+	if (!send_all(fd, head, head_len))
+		send_all(fd, found ? body : "Not found\n", found ? body_len : strlen("Not found\n"));
+	free(body);
+}
+/*!
+ * Thread of the metrics server.
+ * Clients are served one at a time, a scrape takes a few
+ * milliseconds and slow clients time out.
+ *
+ * \param arg metrics server
+ * \return NULL
+ */
+static void *metrics_worker(void *arg){
+	MetricsServer *server = arg;
+	struct timeval timeout = {
+		.tv_sec = HTTP_TIMEOUT_MS / 1000,
+		.tv_usec = HTTP_TIMEOUT_MS % 1000 * 1000
+	};
+	while (!atomic_load(&server->stop)) {
+		struct pollfd pfd = {.fd = server->listen_fd, .events = POLLIN};
+		int r = poll(&pfd, 1, POLL_TIMEOUT_MS);
+		if (r < 0 && errno != EINTR) {
+			log_error("Metrics server failed: %s\n", strerror(errno));
+			break;
+		}
+		if (r <= 0)
+			continue;
+		int fd = accept(server->listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		/**! Accepted sockets are blocking, timeouts keep the thread from waiting forever. */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serve_request(server, fd);
+		close(fd);
+	}
+	return NULL;
+}
+/*!
+ * Start the HTTP server of the metrics. (GET /metrics)
+ *
+ * \param server metrics server
+ * \param addr [host:]port to listen
+ * \param metrics served metrics
+ * \return 0 on success
+ */
+int rtlmap_metrics_serve(MetricsServer *server, const char *addr, RtlMapMetrics *metrics){
+	memset(server, 0, sizeof(MetricsServer));
+	server->metrics = metrics;
+	if ((server->listen_fd = open_listen_socket(addr, "Metrics server")) < 0)
+		return -1;
+	if (pthread_create(&server->thread, NULL, metrics_worker, server)) {
+		log_fatal("Failed to create metrics server thread.\n");
+		return -1;
+	}
+	server->running = 1;
+	return 0;
+}
+/*!
+ * Stop the metrics server.
+ *
+ * \param server metrics server
+ */
+void rtlmap_metrics_stop(MetricsServer *server){
+	if (server->running) {
+		atomic_store(&server->stop, 1);
+		pthread_join(server->thread, NULL);
+		server->running = 0;
+	}
+	if (server->listen_fd >= 0)
+		close(server->listen_fd);
+	server->listen_fd = -1;
+}
@@ -0,0 +1,280 @@
+/*
+ * librtlmap, FFT pipeline of rtl_map for RTL-SDR devices. (RTL2832/DVB-T)
+ * Copyright (C) 2019-2023 by orhun <https://www.github.com/orhun>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**!
+ * Raw I/Q recorder: writes the USB buffers of a RingBuffer to disk.
+ * (see -I and -J args) The recorder is the second consumer of the
+ * ring, so the DSP thread and the recorder read the same slots and
+ * the samples are never copied. Files have the rtl_sdr format and
+ * can be replayed with -i.
+ */
+#define _GNU_SOURCE /*!< O_DIRECT */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "rtlmap.h"
+
+#define RECORD_IOV 16 /*!< Slots written with a single writev */
+
+/*!
+ * Open a file of the recorder.
+ * O_DIRECT is not supported by all file systems (eg. tmpfs),
+ * the file is opened without it in that case.
+ *
+ * \param rec recorder
+ * \param filename file to create
+ * \return 0 on success
+ */
+static int open_record_file(IQRecorder *rec, const char *filename){
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	rec->direct = 1;
+#ifdef O_DIRECT
+	rec->fd = open(filename, flags | O_DIRECT, 0644);
+	if (rec->fd < 0 && errno == EINVAL)
+#endif
+	{
+		rec->direct = 0;
+		rec->fd = open(filename, flags, 0644);
+	}
+	if (rec->fd < 0) {
+		log_error("Failed to open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+/*!
+ * Close the file of the recorder.
+ *
+ * \param rec recorder
+ */
+static void close_record_file(IQRecorder *rec){
+	if (rec->fd < 0)
+		return;
+	close(rec->fd);
+	rec->fd = -1;
+}
+/*!
+ * Write the buffers (iovecs) completely.
+ * Partial writes are continued from where they stopped.
+ *
+ * \param fd file descriptor
+ * \param iov buffers (modified)
+ * \param iov_c buffer count
+ * \return 0 on success
+ */
+static int write_iov(int fd, struct iovec *iov, int iov_c){
+	while (iov_c > 0) {
+		ssize_t n = writev(fd, iov, iov_c);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		while (iov_c > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iov_c--;
+		}
+		if (iov_c > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+/*!
+ * Write the slots of the ring between the given positions.
+ * Slots are written in place, RECORD_IOV slots at a time.
+ * O_DIRECT is turned off for the rest of the file at the
+ * first buffer that is not a multiple of RING_ALIGN bytes.
+ *
+ * \param rec recorder
+ * \param from first ring position
+ * \param to ring position after the last slot
+ */
+static void write_slots(IQRecorder *rec, unsigned int from, unsigned int to){
+	RingBuffer *ring = rec->ring;
+	struct iovec iov[RECORD_IOV];
+	while (rec->fd >= 0 && from != to) {
+		int iov_c = 0;
+		for (; from != to && iov_c < RECORD_IOV; from++, iov_c++) {
+			unsigned int slot = from % ring->slots;
+			iov[iov_c].iov_base = ring->data + (size_t)slot * ring->slot_len;
+			iov[iov_c].iov_len = ring->len[slot];
+			rec->written += ring->len[slot];
+			if (rec->direct && ring->len[slot] % RING_ALIGN) {
+				fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+				rec->direct = 0;
+			}
+		}
+		if (write_iov(rec->fd, iov, iov_c)) {
+			log_error("Failed to write raw samples: %s\n", strerror(errno));
+			close_record_file(rec);
+		}
+	}
+}
+/*!
+ * Thread of the recorder.
+ * Wakes up for each filled slot of the ring and writes the new slots.
+ * In triggered mode, only 'pre_slots' before the slot of the consumer
+ * (DSP thread) are kept while there is no trigger, older slots are
+ * released to the producer.
+ *
+ * \param arg recorder
+ * \return NULL
+ */
+static void *recorder_worker(void *arg){
+	IQRecorder *rec = arg;
+	RingBuffer *ring = rec->ring;
+	char filename[PATH_MAX];
+	uint64_t file_start = 0; /*!< 'written' at the start of the triggered file */
+	int capturing = 0; /*!< A triggered file is started */
+	for (;;) {
+		while (sem_wait(&ring->rec_items) && errno == EINTR);
+		int stop = atomic_load(&rec->stop);
+		unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire),
+			tail = atomic_load_explicit(&ring->rec_tail, memory_order_relaxed);
+		if (!rec->triggered) {
+			write_slots(rec, tail, head);
+			tail = head;
+		} else {
+			pthread_mutex_lock(&rec->lock);
+			int active = rec->active;
+			unsigned int end = rec->end;
+			pthread_mutex_unlock(&rec->lock);
+			if (active && !capturing) {
+				capturing = 1;
+				file_start = rec->written;
+				snprintf(filename, sizeof(filename), "%s.%d", rec->filename, rec->file_c++);
+				if (!open_record_file(rec, filename))
+					log_info("Recording %s\n", filename);
+			}
+			if (active) {
+				/**! Ring positions wrap around, compare the distance. */
+				unsigned int last = (int)(end - head) < 0 ? end : head;
+				if ((int)(last - tail) < 0)
+					last = tail;
+				write_slots(rec, tail, last);
+				tail = last;
+				pthread_mutex_lock(&rec->lock);
+				/**! Trigger during the file extends it. (end is moved) */
+				if (stop || (last == end && rec->end == end)) {
+					rec->active = 0;
+					capturing = 0;
+					if (rec->fd >= 0)
+						log_info("Recorded %s (%.1f MB)\n", filename,
+							(rec->written - file_start) / 1e6);
+					close_record_file(rec);
+				}
+				pthread_mutex_unlock(&rec->lock);
+			} else {
+				/**! Pre-trigger buffers are counted from the DSP thread, it can lag behind the head. */
+				unsigned int dsp = atomic_load_explicit(&ring->tail, memory_order_acquire);
+				if ((int)(dsp - tail) > (int)rec->pre_slots)
+					tail = dsp - rec->pre_slots;
+			}
+		}
+		atomic_store_explicit(&ring->rec_tail, tail, memory_order_release);
+		if (stop)
+			break;
+	}
+	return NULL;
+}
+/*!
+ * Start recording the raw samples of the ring.
+ * Must be called before the producer of the ring is started.
+ * The ring must have more than 'pre_slots' slots, the producer
+ * can only use the slots that are not kept for the trigger.
+ *
+ * \param rec recorder
+ * \param ring ring buffer to record
+ * \param filename file to write (base name of the files with a trigger)
+ * \param pre_slots buffers kept before the trigger
+ * \param post_slots buffers written after the trigger (0 for no trigger)
+ * \return 0 on success
+ */
+int rtlmap_recorder_start(IQRecorder *rec, RingBuffer *ring, const char *filename,
+		unsigned int pre_slots, unsigned int post_slots){
+	memset(rec, 0, sizeof(IQRecorder));
+	rec->ring = ring;
+	rec->filename = filename;
+	rec->fd = -1;
+	rec->triggered = post_slots > 0;
+	rec->pre_slots = pre_slots;
+	rec->post_slots = post_slots;
+	if (rec->triggered && pre_slots >= ring->slots) {
+		log_fatal("Ring buffer is too small for the pre-trigger buffers.\n");
+		return -1;
+	}
+	if (!rec->triggered && open_record_file(rec, filename))
+		return -1;
+	pthread_mutex_init(&rec->lock, NULL);
+	sem_init(&ring->rec_items, 0, 0);
+	atomic_store(&ring->rec_tail, atomic_load(&ring->head));
+	ring->recorded = 1;
+	if (pthread_create(&rec->thread, NULL, recorder_worker, rec)) {
+		log_fatal("Failed to create recorder thread.\n");
+		return -1;
+	}
+	rec->running = 1;
+	if (rec->triggered)
+		log_info("Recording %u buffers before and %u after each trigger to %s.N\n",
+			pre_slots, post_slots, filename);
+	else
+		log_info("Recording raw samples to %s%s\n", filename, 
+			rec->direct ? " (O_DIRECT)" : "");
+	return 0;
+}
+/*!
+ * Write the buffers around the current buffer of the consumer.
+ * (DSP thread) Kept buffers before it are written to a new
+ * file, and 'post_slots' buffers after it. A trigger during
+ * the file extends the file.
+ *
+ * \param rec recorder (started with post_slots > 0)
+ */
+void rtlmap_recorder_trigger(IQRecorder *rec){
+	if (!rec->running || !rec->triggered)
+		return;
+	unsigned int tail = atomic_load_explicit(&rec->ring->tail, memory_order_relaxed);
+	pthread_mutex_lock(&rec->lock);
+	rec->end = tail + 1 + rec->post_slots;
+	rec->active = 1;
+	pthread_mutex_unlock(&rec->lock);
+}
+/*!
+ * Stop the recorder after writing the remaining buffers.
+ * Must be called after the producer of the ring is stopped.
+ *
+ * \param rec recorder
+ */
+void rtlmap_recorder_stop(IQRecorder *rec){
+	if (!rec->running)
+		return;
+	atomic_store(&rec->stop, 1);
+	sem_post(&rec->ring->rec_items);
+	pthread_join(rec->thread, NULL);
+	rec->running = 0;
+	close_record_file(rec);
+	pthread_mutex_destroy(&rec->lock);
+	log_info("Recorded %.1f MB of raw samples%s\n", rec->written / 1e6, 
+		rec->triggered ? "" : " (all buffers)");
+}
@@ -0,0 +1,194 @@
+/*
+ * librtlmap, FFT pipeline of rtl_map for RTL-SDR devices. (RTL2832/DVB-T)
+ * Copyright (C) 2019-2023 by orhun <https://www.github.com/orhun>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**!
+ * Output sinks: bounded queues of preallocated frames that are
+ * written by a thread per sink. (see OutputSink) The format of
+ * the output is up to the write function of the sink.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "rtlmap.h"
+
+/*!
+ * Thread of an output sink.
+ * Takes all queued frames as a batch, the frames stay in the
+ * queue (busy) until they are written, so the DSP thread can
+ * only drop the frames after them.
+ *
+ * \param arg output sink
+ * \return NULL
+ */
+static void *sink_worker(void *arg){
+	OutputSink *sink = arg;
+	pthread_mutex_lock(&sink->lock);
+	for (;;) {
+		while (!sink->count && !sink->stop)
+			pthread_cond_wait(&sink->ready, &sink->lock);
+		if (!sink->count)
+			break;
+		int frame_c = sink->busy = sink->count;
+		for (int i = 0; i < frame_c; i++)
+			sink->batch[i] = sink->queue[(sink->head + i) % sink->slots];
+		pthread_mutex_unlock(&sink->lock);
+		int64_t start = sink->metrics != NULL ? rtlmap_clock_ns() : 0;
+		sink->write(sink->ctx, sink->batch, frame_c);
+		if (sink->metrics != NULL)
+			rtlmap_metrics_record(sink->metrics, METRIC_WRITE, rtlmap_clock_ns() - start);
+		pthread_mutex_lock(&sink->lock);
+		sink->head = (sink->head + frame_c) % sink->slots;
+		sink->count -= frame_c;
+		sink->busy = 0;
+		sink->written += frame_c;
+		sink->batch_c++;
+		pthread_cond_broadcast(&sink->space);
+	}
+	pthread_mutex_unlock(&sink->lock);
+	return NULL;
+}
+/*!
+ * Create an output sink and start its writer thread.
+ *
+ * \param sink output sink to initialize
+ * \param name name of the sink (logs)
+ * \param slots queue length (frames)
+ * \param bin_c maximum bin count of the frames
+ * \param extra_c maximum count of the additional values of the frames
+ * \param policy SINK_BLOCK or SINK_DROP_OLDEST
+ * \param write function that writes a batch of frames (writer thread)
+ * \param ctx argument of 'write'
+ * \return 0 on success
+ * \return 1 on failure at allocating memory or creating the thread
+ */
+int rtlmap_sink_create(OutputSink *sink, const char *name, int slots, int bin_c, int extra_c,
+		int policy, sink_write_fn write, void *ctx){
+	memset(sink, 0, sizeof(OutputSink));
+	sink->name = name;
+	sink->write = write;
+	sink->ctx = ctx;
+	sink->policy = policy;
+	sink->slots = slots;
+	sink->bin_c = bin_c;
+	sink->extra_c = extra_c;
+	sink->frames = calloc(slots, sizeof(SinkFrame));
+	sink->queue = calloc(slots, sizeof(SinkFrame *));
+	sink->batch = calloc(slots, sizeof(SinkFrame *));
+	if (!sink->frames || !sink->queue || !sink->batch) {
+		log_fatal("Failed to allocate output sink.\n");
+		rtlmap_sink_destroy(sink);
+		return 1;
+	}
+	for (int i = 0; i < slots; i++) {
+		SinkFrame *frame = &sink->frames[i];
+		frame->bins = malloc(sizeof(float) * bin_c);
+		frame->extra = extra_c ? malloc(sizeof(float) * extra_c) : NULL;
+		if (!frame->bins || (extra_c && !frame->extra)) {
+			log_fatal("Failed to allocate output sink.\n");
+			rtlmap_sink_destroy(sink);
+			return 1;
+		}
+		sink->queue[i] = frame;
+	}
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_cond_init(&sink->ready, NULL);
+	pthread_cond_init(&sink->space, NULL);
+	if (pthread_create(&sink->thread, NULL, sink_worker, sink)) {
+		log_fatal("Failed to create writer thread of %s.\n", name);
+		return 1;
+	}
+	sink->running = 1;
+	return 0;
+}
+/*!
+ * Queue a frame for the writer thread of the sink.
+ * Values are copied, so the buffers can be reused after return.
+ * If the queue is full, waits for the writer (SINK_BLOCK) or
+ * drops the oldest frame that is not being written. (SINK_DROP_OLDEST)
+ *
+ * \param sink output sink
+ * \param bins dB or magnitude values
+ * \param bin_c bin count (at most the bin count of the sink)
+ * \param center_freq center frequency of the frame
+ * \param extra additional values (can be NULL)
+ * \param extra_c additional value count (at most the extra count of the sink)
+ * \return 0 on success
+ * \return 1 if a frame is dropped
+ */
+int rtlmap_sink_push(OutputSink *sink, const float *bins, int bin_c, uint64_t center_freq,
+		const float *extra, int extra_c){
+	int r = 0;
+	pthread_mutex_lock(&sink->lock);
+	while (sink->count == sink->slots && sink->policy == SINK_BLOCK && !sink->stop)
+		pthread_cond_wait(&sink->space, &sink->lock);
+	if (sink->count == sink->slots) {
+		sink->dropped++;
+		r = 1;
+		/**! All frames are being written, this frame is the oldest one that is not. */
+		if (sink->busy == sink->count) {
+			pthread_mutex_unlock(&sink->lock);
+			return r;
+		}
+		/**! Oldest waiting frame is moved to the end of the queue for the new frame. */
+		SinkFrame *oldest = sink->queue[(sink->head + sink->busy) % sink->slots];
+		for (int i = sink->busy; i < sink->count - 1; i++)
+			sink->queue[(sink->head + i) % sink->slots] =
+				sink->queue[(sink->head + i + 1) % sink->slots];
+		sink->queue[(sink->head + sink->count - 1) % sink->slots] = oldest;
+		sink->count--;
+	}
+	SinkFrame *frame = sink->queue[(sink->head + sink->count) % sink->slots];
+	frame->timestamp_ns = rtlmap_timestamp_ns();
+	frame->center_freq = center_freq;
+	frame->bin_c = bin_c < sink->bin_c ? bin_c : sink->bin_c;
+	frame->extra_c = extra != NULL ? (extra_c < sink->extra_c ? extra_c : sink->extra_c) : 0;
+	memcpy(frame->bins, bins, sizeof(float) * frame->bin_c);
+	if (frame->extra_c)
+		memcpy(frame->extra, extra, sizeof(float) * frame->extra_c);
+	sink->count++;
+	pthread_cond_signal(&sink->ready);
+	pthread_mutex_unlock(&sink->lock);
+	return r;
+}
+/*!
+ * Write the queued frames, stop the writer thread and free the sink.
+ *
+ * \param sink output sink
+ */
+void rtlmap_sink_destroy(OutputSink *sink){
+	if (sink->running) {
+		pthread_mutex_lock(&sink->lock);
+		sink->stop = 1;
+		pthread_cond_broadcast(&sink->ready);
+		pthread_cond_broadcast(&sink->space);
+		pthread_mutex_unlock(&sink->lock);
+		pthread_join(sink->thread, NULL);
+		log_info("Output %s: %lu frames written in %lu batches, %lu dropped\n",
+			sink->name, sink->written, sink->batch_c, sink->dropped);
+		pthread_mutex_destroy(&sink->lock);
+		pthread_cond_destroy(&sink->ready);
+		pthread_cond_destroy(&sink->space);
+	}
+	for (int i = 0; sink->frames != NULL && i < sink->slots; i++) {
+		free(sink->frames[i].bins);
+		free(sink->frames[i].extra);
+	}
+	free(sink->frames);
+	free(sink->queue);
+	free(sink->batch);
+	memset(sink, 0, sizeof(OutputSink));
+}